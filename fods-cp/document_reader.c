@@ -2,68 +2,707 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <math.h>
+#include <pthread.h>
+#include <time.h>
+
+// Vectorized text normalization and set intersection (SSE2 is part of x86-64;
+// AVX2 is detected at run time)
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define NORMALIZE_SSE2 1
+#define NORMALIZE_AVX2 1
+#define INTERSECT_AVX2 1
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#else
+#include <direct.h>
+#include <process.h>
+#endif
+
+// Count every heap allocation for the benchmark report when built with
+// -DFODS_COUNT_ALLOCATIONS. The counting wrappers replace the allocator of the
+// whole process through glibc's internal entry points, so they are opt-in and
+// never used with sanitizers, which they would hide allocations from.
+#if defined(FODS_COUNT_ALLOCATIONS) && defined(__GLIBC__) && \
+    !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#define COUNT_HEAP_ALLOCATIONS 1
+#endif
 
 // Maximum sizes for various elements
 #define MAX_WORD_LENGTH 100
-#define MAX_TOKENS 10000
-#define MAX_STOPWORDS 1000
-#define MAX_KGRAMS 5000
-#define MAX_KGRAM_LENGTH 500
-#define MAX_REFERENCE_PAPERS 10
-#define HASH_TABLE_SIZE 10007  // Prime number for better distribution
+#define READ_CHUNK_SIZE 65536  // Bytes read from a document at a time
+#define INITIAL_TOKEN_CAPACITY 1024  // Token arrays grow as needed
+#define DEFAULT_BENCH_ITERATIONS 20
+#define DEFAULT_BENCH_RUNS 3          // bench: stage timings are the best of these
+#define DEFAULT_BENCH_DOCUMENTS 100   // bench: generated references
+#define DEFAULT_BENCH_WORDS 2000      // bench: words per generated document
+#define DEFAULT_BENCH_VOCABULARY 5000
+#define DEFAULT_PLAGIARISM_RATE 0.2   // bench: share of the target copied from references
+#define BENCH_STOPWORD_RATE 0.3       // Share of generated words taken from the stopwords
+#define MIN_BENCH_PASSAGE 20          // Generated text alternates copied and original
+#define MAX_BENCH_PASSAGE 60          // passages of this many words
+#define ARENA_BLOCK_SIZE 65536  // Bytes per arena block (larger requests get their own)
+#define DICTIONARY_SHARD_BITS 6    // 64 independently locked dictionary shards
+#define DICTIONARY_SHARDS (1 << DICTIONARY_SHARD_BITS)
+#define DICTIONARY_PAGE_SIZE 4096  // Entries per dictionary page
+#define DICTIONARY_MAX_PAGES 1024  // Pages per shard: 4M distinct words each
+#define PRIVATE_TOKEN_BIT 0x80000000u  // Set in IDs of words kept outside the dictionary
+#define INITIAL_REFERENCE_CAPACITY 16  // Reference arrays grow as needed
+#define HASH_TABLE_SIZE 1024  // Initial capacity (power of two), grows as needed
+#define HASH_TABLE_MAX_LOAD 0.8
+#define PROBE_HISTOGRAM_SIZE 9  // Probe lengths 1-8, then 9 or more
+#define LATENCY_BUCKETS 26      // Powers of two from 1 us to 2^24 us (about 17 s), then more
+#define FINGERPRINT_TABLE_SIZE 1024  // Initial capacity, grows as needed
+#define ROLLING_HASH_BASE 0x100000001B3ULL  // Odd multiplier for Rabin-Karp
+#define DEFAULT_WINNOW_WINDOW 4  // Matches of w+k-1 tokens are always detected
+#define LSH_BANDS 64   // Candidate threshold is about (1/bands)^(1/rows) = 0.125
+#define LSH_ROWS 2
+#define MINHASH_SIZE (LSH_BANDS * LSH_ROWS)
+#define DEDUP_BLOCK_ROWS 64    // Documents per all-pairs scoring task
+#define DEFAULT_DEDUP_THRESHOLD 0.5
+#define MAX_SEED_CANDIDATES 8  // Reference positions tried per matching k-gram
+#define TOP_K_CHECK_INTERVAL 64  // Keys scanned between top-K score bound checks
+#define MAX_K_RANGE 16         // Widest --k-range (one fingerprint set per k)
+#define EF_SKIP_QUANTUM 64     // Compressed fingerprints: buckets per skip pointer
+#define GALLOP_RATIO 8         // Intersect by galloping when one set is this many times larger
+#define PROBE_RATIO 32         // ... and by probing its hash table from this ratio on
+#define DEFAULT_INTERSECT_ITERATIONS 2000  // bench-intersect: comparisons per kernel
+#define INDEX_MAGIC "FODSIDX1"
+#define INDEX_VERSION 1
+#define MANIFEST_MAGIC "FODSMANIFEST"
+#define MANIFEST_VERSION 1
+#define MAX_MANIFEST_LINE 4096
+#define MAX_INDEX_SEGMENTS 8  // Adding a segment beyond this starts a background compaction
+#define DEFAULT_SERVER_BATCH 64  // serve: most queued requests scored together
+#define MAX_REQUEST_LINE 4096
+#define SERVER_POLL_MS 200       // serve: how often the accept loop checks for a stop signal
+
+// Immutable stopword set shared by every reader (open addressing, linear probing)
+typedef struct {
+    const char** slots;      // NULL marks an empty slot
+    unsigned int* hashes;    // Cached hash per slot to skip most strcmp calls
+    unsigned int mask;       // Capacity - 1 (capacity is a power of two)
+    int count;
+    char* words;             // Single buffer holding every stopword
+} StopwordSet;
+
+// Block of memory handed out by an Arena
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+// Bump allocator: many small allocations, released all at once
+typedef struct {
+    ArenaBlock* head;   // Block currently being filled
+} Arena;
+
+// One distinct word of the token dictionary
+typedef struct {
+    const char* word;
+    uint64_t hash;             // token_id() of the word
+    uint32_t length;
+    atomic_uint normalized;    // ID of the normalized word, 0 until first needed
+} DictionaryEntry;
+
+// Open-addressing slot table of a dictionary shard. A full table is replaced
+// by a larger one but kept until exit, so lookups can run without the lock.
+typedef struct DictionarySlots {
+    struct DictionarySlots* retired;  // The smaller table this one replaced
+    uint32_t mask;
+    atomic_uint slots[];              // Entry index + 1, 0 = empty
+} DictionarySlots;
+
+// Part of the token dictionary: words whose hash has the same top bits.
+// Entries live in fixed pages so they never move once an ID is handed out.
+typedef struct {
+    pthread_mutex_t lock;           // Serializes adding words; lookups skip it
+    _Atomic(DictionarySlots*) table;
+    uint32_t count;
+    DictionaryEntry** pages;        // DICTIONARY_MAX_PAGES page pointers
+    Arena words;
+} DictionaryShard;
+
+// Words of one document that are not in the token dictionary, for documents
+// that must not grow it. Their IDs are the entry index + 1 with
+// PRIVATE_TOKEN_BIT set, so they never equal a dictionary ID.
+typedef struct {
+    DictionaryEntry* entries;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t* slots;          // Entry index + 1, 0 = empty
+    uint32_t mask;            // Slot count - 1 (a power of two)
+    Arena words;
+} PrivateTokens;
 
 // Structure to store tokens
 typedef struct {
-    char** tokens;
+    uint32_t* ids;     // Token dictionary IDs
+    int64_t* starts;   // Byte offset of each token in the original text
+    int64_t* ends;     // Byte offset just past each token
     int count;
+    int capacity;
 } TokenList; 
 
-// Structure for k-grams
+// Reads whitespace-separated tokens from a file one chunk at a time
 typedef struct {
-    char** kgrams;
+    FILE* file;
+    char buffer[READ_CHUNK_SIZE];
+    size_t length;      // Valid bytes in buffer
+    size_t position;    // Next unread byte in buffer
+    int64_t buffer_offset;  // File offset of buffer[0]
+    int64_t next_offset;    // File offset of the next chunk
+    char* token;        // Current token, NUL-terminated
+    size_t token_capacity;
+    int64_t token_start;    // File offsets of the current token (not
+    int64_t token_end;      // meaningful when normalizing)
+    bool normalize;     // Run normalize_buffer() over each chunk as it is read
+} TokenStream;
+
+// In-place normalization of a buffer; returns the new length
+typedef size_t (*NormalizeKernel)(char* buffer, size_t length);
+
+// Number of values two ascending arrays have in common
+typedef int (*IntersectKernel)(const uint64_t* a, int a_count, const uint64_t* b, int b_count);
+
+// Structure for k-grams: fixed-width tuples of k token IDs
+typedef struct {
+    uint32_t* ids;      // K-gram i is ids[i * k_value] .. ids[i * k_value + k_value - 1]
     int count;
     int k_value;
 } KGramList;
 
-// Hash table node for storing k-grams
-typedef struct HashNode {
-    char* kgram;
+// K-grams as rolling hashes over the token ID stream (no strings)
+typedef struct {
+    uint64_t* hashes;   // One fingerprint per window, in document order (NULL if streamed without order)
+    int count;          // K-grams of the document, whether or not hashes are kept
+    int k_value;
+} KGramHashList;
+
+// Open-addressing set of 64-bit k-gram fingerprints (0 marks an empty slot)
+typedef struct {
+    uint64_t* keys;
+    int* counts;
+    int capacity;       // Always a power of two
+    int count;
+} FingerprintTable;
+
+// Sorted fingerprint set in Elias-Fano form: each value is split into `low_bits`
+// bits stored verbatim and a high part stored in unary (a 1 per value, a 0 per
+// bucket passed), so a document's set takes about 2 + low_bits bits per value
+typedef struct {
+    int count;            // Distinct fingerprints
+    int low_bits;
+    uint64_t* low;        // Packed low parts, count * low_bits bits
+    uint64_t* high;       // Unary high parts, high_length bits
+    uint64_t high_length;
+    int* skips;           // Values whose high part is below j * EF_SKIP_QUANTUM
+    int skip_count;
+    int count_bits;       // Width of each packed occurrence count minus one (0 = all once)
+    uint64_t* counts;
+    int token_count;      // Size of the document before it was compacted
+    int kgram_count;
+    size_t bytes;         // Heap memory held by the set
+} CompressedFingerprints;
+
+// Fingerprints selected by winnowing (minimum hash of each window)
+typedef struct {
+    uint64_t* hashes;
+    int* positions;     // K-gram index of each selected fingerprint
+    int count;
+    int window;
+} WinnowList;
+
+// Hash table slot for storing k-grams
+typedef struct {
+    uint64_t hash;      // Full hash of the k-gram (0 marks an empty slot)
+    uint32_t* kgram;    // k token IDs
     int count;
-    struct HashNode* next;
-} HashNode;
+} HashEntry;
 
-// Hash table structure
+// Hash table structure (open addressing with Robin Hood probing)
 typedef struct {
-    HashNode** table;
-    int size;
+    HashEntry* entries;
+    int size;           // Always a power of two
     int count;
+    int k_value;        // Token IDs per k-gram
+    Arena* arena;       // Holds the k-gram copies when set, otherwise they are malloc'ed
+    uint64_t* sorted_hashes;  // Entry hashes in ascending order (NULL until sorted or after an insert)
 } HashTable;
 
+// Overlap statistics of two k-gram sets, gathered in a single pass
+typedef struct {
+    int size1;
+    int size2;
+    int intersection;
+    int union_count;
+    double dot_product;   // Sum of count1 * count2 over shared k-grams
+    double weighted_dot;  // Sum of count1 * count2 * idf^2 over shared k-grams (TF-IDF only)
+} SetStats;
+
 // DocumentReader class equivalent in C
 typedef struct {
     char* filename;
     TokenList token_list;
     KGramList kgram_list;
+    Arena kgram_arena;             // K-gram hash table copies
     HashTable* kgram_hash;
-    char* stopwords[MAX_STOPWORDS];
-    int stopwords_count;
+    KGramHashList kgram_hashes;
+    FingerprintTable* fingerprint_set;
+    WinnowList winnow;
+    FingerprintTable* winnow_set;
+    uint64_t* minhash;             // MINHASH_SIZE values, NULL until computed
+    const StopwordSet* stopwords;  // Shared, not owned by the reader
+    bool streamed;                 // Fingerprinted by ingest_document_stream(); no tokens kept
+    CompressedFingerprints* compressed;  // Engine fingerprints, sorted and packed (NULL unless compacting)
+    bool compact;                  // Only the filename, MinHash and compressed set are kept
+    PrivateTokens* private_tokens; // Words the dictionary lacks (NULL: new words are interned)
 } DocumentReader;
 
+// Task run by the thread pool for every index in [0, count)
+typedef void (*TaskFunction)(void* context, int index);
+
+// Fixed set of worker threads; the calling thread also takes tasks
+typedef struct {
+    pthread_t* threads;
+    int worker_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    TaskFunction function;      // Current job, set under the lock
+    void* context;
+    int task_count;
+    atomic_int next_task;
+    int pending_workers;        // Workers still busy with the current job
+    unsigned long generation;   // Incremented for every job
+    bool shutdown;
+} ThreadPool;
+
+// Locality-sensitive hashing index over MinHash bands
+typedef struct {
+    uint64_t* keys;       // Band key per slot (0 = empty)
+    int* heads;           // First posting of each slot's chain
+    int capacity;         // Always a power of two
+    int used;
+    int* posting_doc;     // Reference index of each posting
+    int* posting_next;    // Next posting in the same chain (-1 ends it)
+    int posting_count;
+    int posting_capacity;
+    int indexed_count;    // References [0, indexed_count) are in the index
+    int k_value;          // K of the fingerprints the signatures were computed from
+} LshIndex;
+
+// Inverted index from k-gram fingerprint to the references containing it
+typedef struct {
+    uint64_t* keys;       // Fingerprint per slot (0 = empty)
+    int* heads;           // First posting of each slot's chain
+    int capacity;         // Always a power of two
+    int used;
+    int* posting_doc;     // Reference index of each posting
+    int* posting_count;   // Occurrences of the fingerprint in that reference
+    int* posting_next;    // Next posting in the same chain (-1 ends it)
+    int posting_total;
+    int posting_capacity;
+    int* doc_sizes;       // Unique fingerprints per reference
+    int doc_capacity;
+    int indexed_count;    // References [0, indexed_count) are in the index
+    int k_value;          // Settings the postings were built with
+    int engine;
+    int winnow_window;
+} InvertedIndex;
+
+// Document frequency of every k-gram of the references, kept up to date as
+// references are added; gives each k-gram its inverse document frequency
+typedef struct {
+    FingerprintTable* document_frequency;  // K-gram hash -> references containing it
+    int documents;        // References counted
+    int indexed_count;    // References [0, indexed_count) have been looked at
+    int k_value;          // Settings the frequencies were counted with
+    int engine;
+    int winnow_window;
+} IdfTable;
+
+// Fingerprint sets of one document for every k in [k_min, k_max]
+typedef struct {
+    int k_min;
+    int k_max;
+    FingerprintTable** sets;  // sets[k - k_min]
+} KGramRange;
+
+// A passage found in both the target and a reference
+typedef struct {
+    int target_token;         // First token of the passage (after preprocessing)
+    int reference_token;
+    int length;               // Tokens in the passage
+    int64_t target_start;     // Byte range in the original files
+    int64_t target_end;
+    int64_t reference_start;
+    int64_t reference_end;
+} MatchSpan;
+
+// Matched passages between the target and one reference, in target order
+typedef struct {
+    MatchSpan* spans;
+    int count;
+    int capacity;
+    int covered_tokens;       // Sum of span lengths
+} MatchList;
+
+// Available comparison engines
+typedef enum {
+    ENGINE_STRING_KGRAMS,   // Token ID k-grams in a Robin Hood hash table
+    ENGINE_ROLLING_HASH,    // Rabin-Karp fingerprints over token IDs
+    ENGINE_WINNOWING,       // Only the winnowed subset of the fingerprints
+    ENGINE_SUFFIX_ARRAY     // Longest common token runs from a suffix array
+} ComparisonEngine;
+
+// Common token runs between the target and one reference
+typedef struct {
+    int target_tokens;
+    int longest;              // Longest run of tokens found in both documents
+    int longest_target;       // Where that run starts in each token list
+    int longest_reference;
+    int covered;              // Target tokens inside common runs of at least k tokens
+} PassageStats;
+
+// One entry of a top-K ranking
+typedef struct {
+    int reference;            // Index into the checker's references
+    float score;
+} RankedReference;
+
 // PlagiarismChecker class equivalent in C
 typedef struct {
+    ComparisonEngine engine;
+    int k_value;
+    int winnow_window;
+    bool use_lsh;               // Only score references whose LSH bands collide
+    LshIndex* lsh_index;
+    bool use_inverted_index;    // Score all references in one pass over the target
+    InvertedIndex* inverted_index;
+    bool find_matches;          // Locate the shared passages of each reference
+    MatchList* matches;         // One list per reference
+    ThreadPool* pool;           // Shared, not owned; NULL runs serially
     DocumentReader* target_doc;
-    DocumentReader* reference_docs[MAX_REFERENCE_PAPERS];
+    DocumentReader** reference_docs;
     int reference_count;
-    float similarity_scores[MAX_REFERENCE_PAPERS];
+    int reference_capacity;
+    float* similarity_scores;
     float overall_similarity;
+    bool print_comparisons;     // Print per-reference details while comparing
+    bool use_tfidf;             // Cosine over TF-IDF weighted k-gram counts
+    IdfTable* idf;
+    double* tfidf_norms;        // Weighted vector length of each reference
+    int norms_documents;        // idf->documents when tfidf_norms were computed
+    double target_norm;
+    bool compact_references;    // References keep only compressed fingerprints
 } PlagiarismChecker;
 
+// Two documents of a batch whose combined similarity reached the threshold
+typedef struct {
+    int first;                // Document indices, first < second
+    int second;
+    int shared;               // Shared unique k-grams
+    float jaccard;
+    float cosine;
+    float score;              // 60% Jaccard + 40% cosine, as for references
+} DuplicatePair;
+
+// On-disk reference index header (all offsets are from the start of the file)
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t k_value;
+    uint32_t doc_count;
+    uint32_t reserved;
+    uint64_t docs_offset;     // Array of IndexDocEntry
+    uint64_t names_offset;    // NUL-terminated document names
+    uint64_t file_size;
+} IndexHeader;
+
+// One reference document inside the index
+typedef struct {
+    uint64_t fingerprints_offset;  // Sorted unique uint64_t fingerprints
+    uint64_t counts_offset;        // uint32_t occurrence count per fingerprint
+    uint32_t unique_count;
+    uint32_t kgram_count;
+    uint32_t name_offset;          // Relative to names_offset
+    uint32_t reserved;
+} IndexDocEntry;
+
+// Reference index mapped into memory; the arrays point straight into the file
+typedef struct {
+    void* data;
+    size_t size;
+    const IndexHeader* header;
+    const IndexDocEntry* docs;
+    const char* names;
+} MappedIndex;
+
+// One immutable index file of a segmented index
+typedef struct {
+    int id;                   // Segments are numbered in the order they were written
+    char* file;
+    MappedIndex* index;
+    atomic_int references;    // Snapshots sharing this segment
+} IndexSegment;
+
+// Removed document name; hides copies in segments older than before_segment
+typedef struct {
+    char* name;
+    int before_segment;
+} Tombstone;
+
+// Consistent view of a segmented index. Updates publish a new snapshot, so a
+// query keeps the segments it started with until it releases its snapshot.
+typedef struct {
+    int k_value;
+    IndexSegment** segments;  // Ordered by id
+    int segment_count;
+    Tombstone* tombstones;    // Sorted by name, one per name
+    int tombstone_count;
+    atomic_int references;
+} IndexSnapshot;
+
+// Reference index made of append-only segments listed in a manifest file.
+// Updates are serialized by update_lock within a process and by a lock on
+// INDEX.lock across processes; queries only take snapshot_lock long enough
+// to grab the current snapshot.
+typedef struct {
+    char* manifest_file;
+    pthread_mutex_t update_lock;
+    pthread_mutex_t snapshot_lock;
+    pthread_cond_t compaction_done;
+    IndexSnapshot* current;
+    int next_segment;         // Id of the next segment to write
+    bool compacting;          // A background compaction is running
+} SegmentedIndex;
+
+// Score of one live document of a segmented index
+typedef struct {
+    const char* name;         // Points into the mapped segment
+    float score;
+} IndexScore;
+
+// One check request queued for the server's dispatcher
+typedef struct ServerRequest {
+    char* target_file;
+    float* scores;            // One per reference, written by the dispatcher
+    float overall;
+    bool failed;              // The target could not be read
+    bool done;
+    uint64_t received;        // metrics_timer_start() when the request arrived
+    struct ServerRequest* next;
+} ServerRequest;
+
+// Warm reference corpus answering check requests from a Unix domain socket
+typedef struct {
+    PlagiarismChecker* checker;   // References prepared once, then only read
+    const StopwordSet* stopwords;
+    int k_value;
+    bool stream;
+    int max_batch;
+    pthread_mutex_t lock;
+    pthread_cond_t request_ready; // Queue became non-empty or the server stops
+    pthread_cond_t request_done;  // Some request was answered
+    pthread_cond_t connection_closed;
+    ServerRequest* queue_head;
+    ServerRequest* queue_tail;
+    int* connections;             // Open client sockets, shut down on exit
+    int connection_count;
+    int connection_capacity;
+    bool stopping;
+    long requests;
+    long batches;
+} CheckServer;
+
+// Event counters kept by the metrics layer
+typedef enum {
+    METRIC_DOCUMENTS_READ,
+    METRIC_BYTES_READ,
+    METRIC_TOKENS_READ,       // Words as read, before preprocessing
+    METRIC_TOKENS_KEPT,       // Words left after normalization and stopword removal
+    METRIC_KGRAMS,
+    METRIC_HASH_LOOKUPS,      // K-gram and fingerprint table lookups
+    METRIC_HASH_PROBES,       // Slots examined by those lookups
+    METRIC_REFERENCES_SCORED,
+    METRIC_REFERENCES_PRUNED, // Skipped or abandoned by top-K score bounds
+    METRIC_REQUESTS,          // serve: check requests answered
+    METRIC_REQUEST_BATCHES,
+    METRIC_COUNTER_COUNT
+} MetricCounter;
+
+// Pipeline stages with a latency histogram
+typedef enum {
+    TIMER_READ,               // read_document(), per document
+    TIMER_PREPROCESS,         // preprocess_text(), per document
+    TIMER_KGRAMS,             // K-grams or fingerprints of one document
+    TIMER_STREAM,             // Streaming ingestion of one document
+    TIMER_SCORE,              // Scoring the target against one reference
+    TIMER_QUERY,              // Scoring a target against one index file or segment
+    TIMER_REQUEST,            // serve: from receiving a request to its answer
+    TIMER_COUNT
+} MetricTimer;
+
+// Metrics recorded by one thread. Only the owner writes (plain load + store,
+// no locked instructions); exports sum every shard with relaxed loads.
+typedef struct MetricsShard {
+    struct MetricsShard* next;
+    atomic_ullong counters[METRIC_COUNTER_COUNT];
+    atomic_ullong probe_lengths[PROBE_HISTOGRAM_SIZE];
+    atomic_ullong latency_buckets[TIMER_COUNT][LATENCY_BUCKETS];
+    atomic_ullong latency_ns[TIMER_COUNT];
+} MetricsShard;
+
+// Sum of every shard at one moment
+typedef struct {
+    double uptime;            // Seconds since metrics were enabled
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    uint64_t probe_lengths[PROBE_HISTOGRAM_SIZE];
+    uint64_t latency_buckets[TIMER_COUNT][LATENCY_BUCKETS];
+    uint64_t latency_ns[TIMER_COUNT];
+} MetricsSnapshot;
+
+typedef enum {
+    METRICS_JSON,
+    METRICS_PROMETHEUS        // Text exposition format
+} MetricsFormat;
+
+// Command line settings shared by every run mode
+typedef struct {
+    ComparisonEngine engine;
+    int k_value;
+    int winnow_window;
+    bool use_lsh;
+    bool use_inverted_index;
+    bool find_matches;
+    bool use_tfidf;           // TF-IDF weighted cosine
+    bool stream;              // Fingerprint documents without keeping tokens
+    bool compact;             // Keep references only as compressed fingerprints
+    int k_range_min;          // --k-range: score every k in [min, max] (max 0 = off)
+    int k_range_max;
+    int batch_size;           // serve: most requests scored together
+    int top_k;                // check: rank and report only the best N references (0 = all)
+    bool alloc_stats;         // Report arena allocation counts
+    int iterations;           // bench-normalize, bench-intersect and bench repetitions (0 = command default)
+    float threshold;          // dedup: smallest combined score reported
+    int thread_count;
+    int bench_documents;      // bench: synthetic corpus shape
+    int bench_words;
+    int bench_vocabulary;
+    float plagiarism_rate;
+    unsigned int seed;
+    const char* metrics_file; // Write metrics here at exit (NULL = off)
+    MetricsFormat metrics_format;
+    float metrics_interval;   // Also rewrite the file every this many seconds (0 = off)
+    const char* reference_list;
+    char** documents;         // Positional arguments
+    int document_count;
+} RunOptions;
+
+// Settings and word list of a generated benchmark corpus
+typedef struct {
+    int documents;            // References; the target comes last
+    int words;                // Words per document
+    int vocabulary;           // Distinct content words
+    float plagiarism_rate;
+    uint64_t seed;
+    char** vocabulary_words;  // Synthetic words by frequency rank
+    double* rank_cdf;         // Zipf cumulative distribution over the ranks
+    const char** stopwords;   // Mixed in so stopword removal has work to do
+    int stopword_count;
+} SyntheticCorpus;
+
+// xorshift64* state: the same seed always generates the same corpus
+typedef struct {
+    uint64_t state;
+} BenchRandom;
+
+// Best timing of one bench stage and the cost of that run
+typedef struct {
+    const char* name;
+    double seconds;
+    long allocations;         // Heap allocations made by the stage
+    long allocated_bytes;
+    long peak_rss_kb;         // Process peak after the stage (first run)
+} BenchStage;
+
+// Function prototypes - Thread pool
+int available_cpu_count();
+ThreadPool* create_thread_pool(int thread_count);
+int thread_pool_size(ThreadPool* pool);
+void thread_pool_parallel_for(ThreadPool* pool, int count, TaskFunction function, void* context);
+void free_thread_pool(ThreadPool* pool);
+void set_progress_output(bool enabled);
+void log_progress(const char* format, ...);
+
+// Function prototypes - Arena allocator
+void arena_init(Arena* arena);
+void* arena_alloc(Arena* arena, size_t size);
+char* arena_strndup(Arena* arena, const char* str, size_t length);
+void arena_release(Arena* arena);
+void print_arena_stats();
+
+// Function prototypes - Heap allocation counting
+bool heap_counting_enabled();
+long heap_allocation_count();
+long heap_allocated_bytes();
+long peak_rss_kb();
+
+// Function prototypes - Metrics
+void enable_metrics();
+void metrics_add(MetricCounter counter, uint64_t amount);
+uint64_t metrics_timer_start();
+void metrics_timer_stop(MetricTimer timer, uint64_t start);
+static inline void count_hash_probes(unsigned int probes);
+bool write_metrics(const char* filename, MetricsFormat format);
+void start_metrics_reporter(const char* filename, MetricsFormat format, double interval);
+void stop_metrics_reporter();
+
+// Function prototypes - Token dictionary
+uint32_t intern_token(const char* word, size_t length);
+const char* token_text(uint32_t id);
+uint64_t token_hash(uint32_t id);
+uint32_t normalized_token(uint32_t id);
+int token_dictionary_count();
+uint32_t lookup_token(const char* word, size_t length);
+void use_private_tokens(DocumentReader* reader);
+uint32_t reader_token(DocumentReader* reader, const char* word, size_t length);
+const char* reader_token_text(const DocumentReader* reader, uint32_t id);
+uint64_t reader_token_hash(const DocumentReader* reader, uint32_t id);
+uint32_t reader_normalized_token(DocumentReader* reader, uint32_t id);
+
 // Function prototypes - Member 1
 DocumentReader* create_document_reader();
-void load_stopwords(DocumentReader* reader, const char* stopwords_file);
+StopwordSet* load_stopwords(const char* stopwords_file);
+bool stopword_set_contains(const StopwordSet* set, const char* word);
+void free_stopword_set(StopwordSet* set);
+void set_stopwords(DocumentReader* reader, const StopwordSet* stopwords);
 void read_document(DocumentReader* reader, const char* filename);
+bool open_token_stream(TokenStream* stream, const char* filename);
+const char* next_raw_token(TokenStream* stream);
+void close_token_stream(TokenStream* stream);
+void normalize_token(char* token);
 void preprocess_text(DocumentReader* reader);
 void to_lowercase(char* str);
 void remove_punctuation_numbers(char* str);
@@ -73,658 +712,8442 @@ void free_document_reader(DocumentReader* reader);
 void print_tokens(DocumentReader* reader);
 void export_tokens(DocumentReader* reader, const char* filename);
 
+// Function prototypes - Text normalization
+size_t normalize_buffer(char* buffer, size_t length);
+size_t normalize_buffer_scalar(char* buffer, size_t length);
+NormalizeKernel select_normalize_kernel(const char** name);
+#ifdef NORMALIZE_SSE2
+size_t normalize_buffer_sse2(char* buffer, size_t length);
+#endif
+#ifdef NORMALIZE_AVX2
+size_t normalize_buffer_avx2(char* buffer, size_t length);
+#endif
+
 // Function prototypes - Member 2
 void generate_kgrams(DocumentReader* reader, int k);
-HashTable* create_hash_table(int size);
-unsigned int hash_function(const char* str, int table_size);
-void hash_table_insert(HashTable* ht, const char* kgram);
-bool hash_table_contains(HashTable* ht, const char* kgram);
+HashTable* create_hash_table(int size, int k);
+HashTable* create_arena_hash_table(int size, int k, Arena* arena);
+uint64_t hash_function(const uint32_t* kgram, int k);
+void hash_table_insert(HashTable* ht, const uint32_t* kgram);
+bool hash_table_contains(HashTable* ht, const uint32_t* kgram);
+HashEntry* hash_table_find(HashTable* ht, const uint32_t* kgram, uint64_t hash);
 void print_kgrams(DocumentReader* reader);
 void print_hash_table_stats(HashTable* ht);
 void free_hash_table(HashTable* ht);
 void export_kgrams(DocumentReader* reader, const char* filename);
 
+// Function prototypes - Sorted set intersection
+void hash_table_sort_hashes(HashTable* ht);
+int intersect_count_scalar(const uint64_t* a, int a_count, const uint64_t* b, int b_count);
+int intersect_count_galloping(const uint64_t* a, int a_count, const uint64_t* b, int b_count);
+#ifdef INTERSECT_AVX2
+int intersect_count_avx2(const uint64_t* a, int a_count, const uint64_t* b, int b_count);
+#endif
+IntersectKernel select_intersect_kernel(const char** name);
+int sorted_intersection_count(const uint64_t* a, int a_count, const uint64_t* b, int b_count);
+SetStats hash_table_sorted_stats(HashTable* set1, HashTable* set2);
+
+// Function prototypes - Rolling hash k-grams
+static uint64_t mix64(uint64_t x);
+uint64_t token_id(const char* token);
+uint64_t token_id_bytes(const char* token, size_t length);
+void generate_kgram_fingerprints(DocumentReader* reader, int k);
+int document_kgram_count(DocumentReader* reader);
+int document_token_count(DocumentReader* reader);
+FingerprintTable* create_fingerprint_table(int capacity);
+void fingerprint_table_insert(FingerprintTable* ft, uint64_t fingerprint);
+bool fingerprint_table_contains(FingerprintTable* ft, uint64_t fingerprint);
+void free_fingerprint_table(FingerprintTable* ft);
+int fingerprint_table_count(FingerprintTable* ft, uint64_t fingerprint);
+SetStats fingerprint_set_stats(FingerprintTable* set1, FingerprintTable* set2);
+SetStats fingerprint_weighted_stats(FingerprintTable* set1, FingerprintTable* set2, const IdfTable* idf);
+int fingerprint_intersection_count(FingerprintTable* set1, FingerprintTable* set2);
+float fingerprint_jaccard_similarity(FingerprintTable* set1, FingerprintTable* set2);
+float fingerprint_cosine_similarity(FingerprintTable* set1, FingerprintTable* set2);
+bool fingerprint_stats_above(FingerprintTable* set1, FingerprintTable* set2, const IdfTable* idf,
+                             _Atomic float* floor, SetStats* stats);
+
+// Function prototypes - Winnowing
+void winnow_fingerprints(DocumentReader* reader, int window);
+
+// Function prototypes - Multi-k fingerprints
+void generate_kgram_range(DocumentReader* reader, int k_min, int k_max, KGramRange* range);
+void free_kgram_range(KGramRange* range);
+
+// Function prototypes - Streaming ingestion
+void ingest_document_stream(DocumentReader* reader, const char* filename, int k, bool keep_order);
+
+// Function prototypes - MinHash and LSH
+void compute_minhash_signature(DocumentReader* reader);
+float minhash_similarity(const uint64_t* signature1, const uint64_t* signature2);
+LshIndex* create_lsh_index(int k);
+void lsh_index_add(LshIndex* index, const uint64_t* signature, int doc_id);
+int lsh_index_query(LshIndex* index, const uint64_t* signature, int doc_count, int* candidates);
+void free_lsh_index(LshIndex* index);
+
+// Function prototypes - Inverted index
+InvertedIndex* create_inverted_index(int k, int engine, int winnow_window);
+void inverted_index_add(InvertedIndex* index, FingerprintTable* set, int doc_id);
+void inverted_index_score(InvertedIndex* index, FingerprintTable* target, int doc_count,
+                          const IdfTable* idf, SetStats* stats);
+void free_inverted_index(InvertedIndex* index);
+
+// Function prototypes - TF-IDF weighting
+IdfTable* create_idf_table(int k, int engine, int winnow_window);
+void idf_table_add_fingerprints(IdfTable* idf, FingerprintTable* set);
+void idf_table_add_kgrams(IdfTable* idf, HashTable* ht);
+double idf_weight(const IdfTable* idf, uint64_t key);
+double fingerprint_tfidf_norm(FingerprintTable* set, const IdfTable* idf);
+double hash_table_tfidf_norm(HashTable* ht, const IdfTable* idf);
+float tfidf_cosine(const SetStats* stats, double norm1, double norm2);
+void free_idf_table(IdfTable* idf);
+
+// Function prototypes - Suffix array engine
+int* build_suffix_array(const int* text, int n, int alphabet_size);
+int* build_lcp_array(const int* text, const int* suffix_array, int n);
+PassageStats suffix_array_passage_stats(DocumentReader* target, DocumentReader* reference, int k);
+
+// Function prototypes - Match localization
+void locate_matches(DocumentReader* target, DocumentReader* reference, int k, MatchList* matches);
+void free_match_list(MatchList* matches);
+
+// Function prototypes - Persistent reference index
+bool build_reference_index(const char* index_file, char** files, int file_count,
+                           const StopwordSet* stopwords, int k, ThreadPool* pool, bool report);
+MappedIndex* open_reference_index(const char* index_file);
+const char* index_document_name(const MappedIndex* index, int doc);
+const uint64_t* index_document_fingerprints(const MappedIndex* index, int doc);
+const uint32_t* index_document_counts(const MappedIndex* index, int doc);
+SetStats index_set_stats(FingerprintTable* set, const uint64_t* fingerprints,
+                         const uint32_t* counts, int count);
+void query_reference_index(const MappedIndex* index, DocumentReader* target, float* scores);
+void close_reference_index(MappedIndex* index);
+
+// Function prototypes - Compressed fingerprints
+CompressedFingerprints* compress_fingerprints(FingerprintTable* set);
+SetStats compressed_weighted_stats(const CompressedFingerprints* set1, const CompressedFingerprints* set2,
+                                   const IdfTable* idf);
+bool compressed_stats_above(const CompressedFingerprints* set1, const CompressedFingerprints* set2,
+                            const IdfTable* idf, _Atomic float* floor, SetStats* stats);
+FingerprintTable* expand_compressed_fingerprints(const CompressedFingerprints* set);
+void compact_document(DocumentReader* reader);
+void free_compressed_fingerprints(CompressedFingerprints* set);
+
+// Function prototypes - Segmented reference index
+bool is_index_manifest(const char* filename);
+SegmentedIndex* open_segmented_index(const char* manifest_file, int k, bool create);
+IndexSnapshot* acquire_index_snapshot(SegmentedIndex* index);
+void release_index_snapshot(IndexSnapshot* snapshot);
+int index_snapshot_document_count(const IndexSnapshot* snapshot);
+int query_index_snapshot(const IndexSnapshot* snapshot, DocumentReader* target, IndexScore* scores);
+bool add_index_segment(SegmentedIndex* index, char** files, int file_count,
+                       const StopwordSet* stopwords, ThreadPool* pool);
+int remove_index_documents(SegmentedIndex* index, char** names, int name_count);
+bool compact_segmented_index(SegmentedIndex* index);
+void start_background_compaction(SegmentedIndex* index);
+void wait_for_compaction(SegmentedIndex* index);
+void close_segmented_index(SegmentedIndex* index);
+
+// Function prototypes - Corpus deduplication
+DuplicatePair* find_duplicate_pairs(DocumentReader** readers, int count, ComparisonEngine engine,
+                                    float threshold, ThreadPool* pool, int* pair_count);
+
+// Function prototypes - Server
+int serve_check_requests(PlagiarismChecker* checker, const StopwordSet* stopwords, const char* socket_path,
+                         int k_value, bool stream, int max_batch);
+
 // Function prototypes - Member 3
 PlagiarismChecker* create_plagiarism_checker();
+void set_comparison_engine(PlagiarismChecker* checker, ComparisonEngine engine);
+void set_winnow_window(PlagiarismChecker* checker, int window);
+void set_lsh_enabled(PlagiarismChecker* checker, bool enabled);
+void set_inverted_index_enabled(PlagiarismChecker* checker, bool enabled);
+void set_match_localization(PlagiarismChecker* checker, bool enabled);
+void set_thread_pool(PlagiarismChecker* checker, ThreadPool* pool);
+void set_comparison_output(PlagiarismChecker* checker, bool enabled);
+void set_tfidf_enabled(PlagiarismChecker* checker, bool enabled);
+void set_compact_references(PlagiarismChecker* checker, bool enabled);
+void build_document_kgrams(PlagiarismChecker* checker, DocumentReader* reader, int k);
+FingerprintTable* engine_fingerprint_set(PlagiarismChecker* checker, DocumentReader* reader);
+bool parse_comparison_engine(const char* name, ComparisonEngine* engine);
 void add_target_document(PlagiarismChecker* checker, DocumentReader* target);
 void add_reference_document(PlagiarismChecker* checker, DocumentReader* reference);
+SetStats hash_table_set_stats(HashTable* set1, HashTable* set2);
+SetStats hash_table_weighted_stats(HashTable* set1, HashTable* set2, const IdfTable* idf);
+float jaccard_from_stats(const SetStats* stats);
+float cosine_from_stats(const SetStats* stats);
 float calculate_jaccard_similarity(HashTable* set1, HashTable* set2);
 float calculate_cosine_similarity(HashTable* set1, HashTable* set2);
 int hash_table_intersection_count(HashTable* set1, HashTable* set2);
 int hash_table_union_count(HashTable* set1, HashTable* set2);
+void prepare_references(PlagiarismChecker* checker, int k_value);
+double target_tfidf_norm(PlagiarismChecker* checker, DocumentReader* target);
+float score_reference(PlagiarismChecker* checker, DocumentReader* target, double target_norm, int i);
+bool hash_table_stats_above(HashTable* set1, HashTable* set2, const IdfTable* idf, _Atomic float* floor,
+                            SetStats* stats);
+float combined_score_bound(int size1, int size2, int intersection, bool weighted_cosine);
+int top_k_references(PlagiarismChecker* checker, DocumentReader* target, double target_norm, int top,
+                     RankedReference* results, int* scored);
+void print_top_references(PlagiarismChecker* checker, int k_value, int top);
 void compare_documents(PlagiarismChecker* checker, int k_value);
 void print_comparison_results(PlagiarismChecker* checker);
 void export_results(PlagiarismChecker* checker, const char* filename);
 void free_plagiarism_checker(PlagiarismChecker* checker);
 
-int main() {
+// Function prototypes - Command line
+void print_usage(const char* program);
+bool parse_run_options(int argc, char* argv[], int first, RunOptions* options);
+char** read_reference_list(const char* list_file, int* count);
+char** collect_reference_files(const RunOptions* options, int first, int* count);
+void free_file_list(char** files, int count);
+int run_check(const RunOptions* options);
+int run_k_range(const RunOptions* options, const char* target_file, char** reference_files,
+                int reference_count);
+int run_build_index(const RunOptions* options);
+int run_query(const RunOptions* options);
+int run_index_add(const RunOptions* options);
+int run_index_remove(const RunOptions* options);
+int run_index_compact(const RunOptions* options);
+int run_bench_normalize(const RunOptions* options);
+int run_bench_intersect(const RunOptions* options);
+int run_bench(const RunOptions* options);
+int run_dedup(const RunOptions* options);
+int run_serve(const RunOptions* options);
+char** collect_corpus_files(const RunOptions* options, int* count);
+
+// Function prototypes - Synthetic corpus
+SyntheticCorpus* create_synthetic_corpus(const RunOptions* options, const StopwordSet* stopwords);
+char** write_synthetic_corpus(const SyntheticCorpus* corpus, const char* directory,
+                              size_t* total_bytes, float* copied_share);
+void free_synthetic_corpus(SyntheticCorpus* corpus);
+
+// Shared state for processing reference documents in parallel
+typedef struct {
+    PlagiarismChecker* checker;
+    DocumentReader** readers;
+    char** files;
+    int k_value;
+    bool stream;
+} IngestContext;
+
+// Read, preprocess and build k-grams for one document, either through the
+// token list or in a single streaming pass
+static void ingest_document(IngestContext* ingest, DocumentReader* reader, const char* filename) {
+    if (ingest->stream) {
+        ingest_document_stream(reader, filename, ingest->k_value,
+                               ingest->checker->engine == ENGINE_WINNOWING);
+    } else {
+        read_document(reader, filename);
+        preprocess_text(reader);
+    }
+    build_document_kgrams(ingest->checker, reader, ingest->k_value);
+}
+
+// Read, preprocess and build k-grams for one reference (thread pool task)
+static void ingest_reference_task(void* context, int i) {
+    IngestContext* ingest = (IngestContext*)context;
+    DocumentReader* reader = ingest->readers[i];
+    
+    log_progress("Reference %d: ", i + 1);
+    ingest_document(ingest, reader, ingest->files[i]);
+    log_progress("Paper %d: %d tokens, %d k-grams\n", i + 1,
+                 reader->token_list.count, document_kgram_count(reader));
+    if (ingest->checker->compact_references) {
+        compact_document(reader);
+    }
+}
+
+// Report the memory held by compacted references
+static void print_compact_summary(DocumentReader** readers, int count) {
+    long fingerprints = 0;
+    size_t bytes = 0;
+    for (int i = 0; i < count; i++) {
+        if (readers[i]->compressed != NULL) {
+            fingerprints += readers[i]->compressed->count;
+            bytes += readers[i]->compressed->bytes;
+        }
+    }
+    printf("Compact references: %ld fingerprints in %.1f KB (%.2f bytes each)\n", fingerprints,
+           bytes / 1024.0, fingerprints > 0 ? (double)bytes / fingerprints : 0.0);
+}
+
+// Run one command with parsed options
+static int run_command(const char* command, const RunOptions* options) {
+    if (strcmp(command, "build-index") == 0) {
+        return run_build_index(options);
+    }
+    if (strcmp(command, "query") == 0) {
+        return run_query(options);
+    }
+    if (strcmp(command, "index-add") == 0) {
+        return run_index_add(options);
+    }
+    if (strcmp(command, "index-remove") == 0) {
+        return run_index_remove(options);
+    }
+    if (strcmp(command, "index-compact") == 0) {
+        return run_index_compact(options);
+    }
+    if (strcmp(command, "bench-normalize") == 0) {
+        return run_bench_normalize(options);
+    }
+    if (strcmp(command, "bench-intersect") == 0) {
+        return run_bench_intersect(options);
+    }
+    if (strcmp(command, "bench") == 0) {
+        return run_bench(options);
+    }
+    if (strcmp(command, "dedup") == 0) {
+        return run_dedup(options);
+    }
+    if (strcmp(command, "serve") == 0) {
+        return run_serve(options);
+    }
+    return run_check(options);
+}
+
+int main(int argc, char* argv[]) {
+    const char* command = "check";
+    int first_option = 1;
+    
+    // An optional command comes first; plain checking is the default
+    if (argc > 1 && (strcmp(argv[1], "build-index") == 0 || strcmp(argv[1], "query") == 0 ||
+                     strcmp(argv[1], "index-add") == 0 || strcmp(argv[1], "index-remove") == 0 ||
+                     strcmp(argv[1], "index-compact") == 0 ||
+                     strcmp(argv[1], "bench-normalize") == 0 || strcmp(argv[1], "bench-intersect") == 0 ||
+                     strcmp(argv[1], "bench") == 0 ||
+                     strcmp(argv[1], "dedup") == 0 || strcmp(argv[1], "serve") == 0)) {
+        command = argv[1];
+        first_option = 2;
+    }
+    
+    RunOptions options;
+    if (!parse_run_options(argc, argv, first_option, &options)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    if (options.metrics_file != NULL) {
+        enable_metrics();
+        start_metrics_reporter(options.metrics_file, options.metrics_format, options.metrics_interval);
+    }
+    int status = run_command(command, &options);
+    if (options.metrics_file != NULL) {
+        stop_metrics_reporter();
+        if (!write_metrics(options.metrics_file, options.metrics_format)) status = EXIT_FAILURE;
+    }
+    return status;
+}
+
+// Compare a target against reference papers read from text files
+int run_check(const RunOptions* options) {
     printf("=== PLAGIARISM DETECTION SYSTEM ===\n\n");
     
+    const char* target_file = "target_paper.txt";
+    if (options->document_count > 0) {
+        target_file = options->documents[0];
+    }
+    
+    int reference_count = 0;
+    char** reference_files = collect_reference_files(options, 1, &reference_count);
+    if (reference_files == NULL) {
+        return EXIT_FAILURE;
+    }
+    if (options->k_range_max > 0) {
+        int status = run_k_range(options, target_file, reference_files, reference_count);
+        free_file_list(reference_files, reference_count);
+        return status;
+    }
+    
     // Create document readers for all papers
     DocumentReader* target_reader = create_document_reader();
-    DocumentReader* ref_reader1 = create_document_reader();
-    DocumentReader* ref_reader2 = create_document_reader();
-    DocumentReader* ref_reader3 = create_document_reader();
-    DocumentReader* ref_reader4 = create_document_reader();
-    
-    // Load stopwords
-    load_stopwords(target_reader, "stopwords.txt");
-    load_stopwords(ref_reader1, "stopwords.txt");
-    load_stopwords(ref_reader2, "stopwords.txt");
-    load_stopwords(ref_reader3, "stopwords.txt");
-    load_stopwords(ref_reader4, "stopwords.txt");
+    DocumentReader** ref_readers = (DocumentReader**)malloc((reference_count + 1) * sizeof(DocumentReader*));
+    if (ref_readers == NULL) {
+        fprintf(stderr, "Memory allocation failed for reference readers\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < reference_count; i++) {
+        ref_readers[i] = create_document_reader();
+    }
+    
+    // The checker decides how k-grams are represented
+    PlagiarismChecker* checker = create_plagiarism_checker();
+    set_comparison_engine(checker, options->engine);
+    set_winnow_window(checker, options->winnow_window);
+    set_lsh_enabled(checker, options->use_lsh);
+    set_inverted_index_enabled(checker, options->use_inverted_index);
+    set_match_localization(checker, options->find_matches);
+    set_tfidf_enabled(checker, options->use_tfidf);
+    bool hash_engine = options->engine == ENGINE_ROLLING_HASH || options->engine == ENGINE_WINNOWING;
+    if (options->use_inverted_index && !hash_engine) {
+        fprintf(stderr, "Note: --inverted needs a hash engine; comparing pairwise\n");
+    }
+    if (options->use_tfidf && options->engine == ENGINE_SUFFIX_ARRAY) {
+        fprintf(stderr, "Note: --tfidf does not apply to the suffix engine\n");
+    }
+    if (options->top_k > 0 && (options->use_lsh || options->use_inverted_index || options->find_matches)) {
+        // The ranking scores pairwise and prunes by its own bounds
+        fprintf(stderr, "Note: --top ranks pairwise; --lsh, --inverted and --matches are ignored\n");
+        set_lsh_enabled(checker, false);
+        set_inverted_index_enabled(checker, false);
+        set_match_localization(checker, false);
+    }
+    if (options->compact && !hash_engine) {
+        fprintf(stderr, "Note: --compact needs a hash engine; keeping references whole\n");
+    } else if (options->compact) {
+        // Match localization needs the reference tokens that compacting drops
+        if (options->find_matches && options->top_k == 0) {
+            fprintf(stderr, "Note: --compact keeps no reference tokens; --matches is ignored\n");
+            set_match_localization(checker, false);
+        }
+        set_compact_references(checker, true);
+    }
+    ThreadPool* pool = create_thread_pool(options->thread_count);
+    set_thread_pool(checker, pool);
+    
+    // Load stopwords once and share them between all readers
+    StopwordSet* stopwords = load_stopwords("stopwords.txt");
+    set_stopwords(target_reader, stopwords);
+    for (int i = 0; i < reference_count; i++) {
+        set_stopwords(ref_readers[i], stopwords);
+    }
+    
+    // Streaming keeps no tokens, so it only applies to the hash engines
+    if (options->stream && !hash_engine) {
+        fprintf(stderr, "Note: --stream needs a hash engine; reading documents whole\n");
+    }
+    IngestContext ingest = {checker, ref_readers, reference_files, options->k_value,
+                            options->stream && hash_engine};
     
     // Read and preprocess target document
     printf("1. PROCESSING TARGET DOCUMENT:\n");
-    read_document(target_reader, "target_paper.txt");
-    preprocess_text(target_reader);
-    generate_kgrams(target_reader, 3);
+    ingest_document(&ingest, target_reader, target_file);
     printf("Target document processed: %d tokens, %d k-grams\n\n", 
-           target_reader->token_list.count, target_reader->kgram_list.count);
+           target_reader->token_list.count, document_kgram_count(target_reader));
     
     // Read and preprocess reference documents
     printf("2. PROCESSING REFERENCE DOCUMENTS:\n");
     
-    printf("Reference 1: ");
-    read_document(ref_reader1, "research_paper1.txt");
-    preprocess_text(ref_reader1);
-    generate_kgrams(ref_reader1, 3);
-    printf("Paper 1: %d tokens, %d k-grams\n", 
-           ref_reader1->token_list.count, ref_reader1->kgram_list.count);
-    
-    printf("Reference 2: ");
-    read_document(ref_reader2, "research_paper2.txt");
-    preprocess_text(ref_reader2);
-    generate_kgrams(ref_reader2, 3);
-    printf("Paper 2: %d tokens, %d k-grams\n", 
-           ref_reader2->token_list.count, ref_reader2->kgram_list.count);
-    
-    printf("Reference 3: ");
-    read_document(ref_reader3, "research_paper3.txt");
-    preprocess_text(ref_reader3);
-    generate_kgrams(ref_reader3, 3);
-    printf("Paper 3: %d tokens, %d k-grams\n", 
-           ref_reader3->token_list.count, ref_reader3->kgram_list.count);
-    
-    printf("Reference 4: ");
-    read_document(ref_reader4, "research_paper4.txt");
-    preprocess_text(ref_reader4);
-    generate_kgrams(ref_reader4, 3);
-    printf("Paper 4: %d tokens, %d k-grams\n\n", 
-           ref_reader4->token_list.count, ref_reader4->kgram_list.count);
+    bool parallel = thread_pool_size(pool) > 1;
+    if (parallel) {
+        // Per-document progress would interleave; print a summary afterwards
+        set_progress_output(false);
+    }
+    thread_pool_parallel_for(pool, reference_count, ingest_reference_task, &ingest);
+    if (parallel) {
+        set_progress_output(true);
+        for (int i = 0; i < reference_count; i++) {
+            printf("Paper %d: %d tokens, %d k-grams\n", i + 1,
+                   document_token_count(ref_readers[i]), document_kgram_count(ref_readers[i]));
+        }
+    }
+    if (checker->compact_references) {
+        print_compact_summary(ref_readers, reference_count);
+    }
+    printf("\n");
     
     // MEMBER 3: Create plagiarism checker and perform comparison
     printf("3. PLAGIARISM ANALYSIS:\n");
-    PlagiarismChecker* checker = create_plagiarism_checker();
     
     // Add documents to checker
     add_target_document(checker, target_reader);
-    add_reference_document(checker, ref_reader1);
-    add_reference_document(checker, ref_reader2);
-    add_reference_document(checker, ref_reader3);
-    add_reference_document(checker, ref_reader4);
-    
-    // Perform comparison with k=3 (3-word sequences)
-    compare_documents(checker, 3);
+    for (int i = 0; i < reference_count; i++) {
+        add_reference_document(checker, ref_readers[i]);
+    }
     
-    // Display results
-    print_comparison_results(checker);
+    if (options->top_k > 0) {
+        // Rank only the best references
+        print_top_references(checker, options->k_value, options->top_k);
+    } else {
+        // Perform comparison (k=3 by default: 3-word sequences)
+        compare_documents(checker, options->k_value);
+        
+        // Display results
+        print_comparison_results(checker);
+        
+        // Export results
+        export_results(checker, "plagiarism_report.txt");
+    }
     
-    // Export results
-    export_results(checker, "plagiarism_report.txt");
+    if (options->alloc_stats) {
+        print_arena_stats();
+    }
     
     // Clean up
     free_plagiarism_checker(checker);
     free_document_reader(target_reader);
-    free_document_reader(ref_reader1);
-    free_document_reader(ref_reader2);
-    free_document_reader(ref_reader3);
-    free_document_reader(ref_reader4);
+    for (int i = 0; i < reference_count; i++) {
+        free_document_reader(ref_readers[i]);
+    }
+    free(ref_readers);
+    free_file_list(reference_files, reference_count);
+    free_stopword_set(stopwords);
+    free_thread_pool(pool);
     
     return 0;
 }
 
-// ==================== MEMBER 1 FUNCTIONS (EXISTING) ====================
+// Shared state for a k-range comparison
+typedef struct {
+    DocumentReader** readers;   // Target first, then the references
+    const char** files;
+    KGramRange* ranges;
+    int k_min;
+    int k_max;
+    float* scores;              // Reference r, k: scores[r * width + k - k_min]
+} KRangeContext;
 
-// Create a new DocumentReader instance
-DocumentReader* create_document_reader() {
-    DocumentReader* reader = (DocumentReader*)malloc(sizeof(DocumentReader));
-    if (reader == NULL) {
-        fprintf(stderr, "Memory allocation failed for DocumentReader\n");
-        exit(EXIT_FAILURE);
-    }
-    
-    reader->filename = NULL;
-    reader->token_list.tokens = NULL;
-    reader->token_list.count = 0;
-    reader->kgram_list.kgrams = NULL;
-    reader->kgram_list.count = 0;
-    reader->kgram_list.k_value = 0;
-    reader->kgram_hash = NULL;
-    reader->stopwords_count = 0;
-    
-    return reader;
+// Read and preprocess one document once, then fingerprint it for every k
+static void ingest_k_range_task(void* context, int i) {
+    KRangeContext* sweep = (KRangeContext*)context;
+    read_document(sweep->readers[i], sweep->files[i]);
+    preprocess_text(sweep->readers[i]);
+    generate_kgram_range(sweep->readers[i], sweep->k_min, sweep->k_max, &sweep->ranges[i]);
 }
 
-// Load stopwords from file into hash set (array implementation)
-void load_stopwords(DocumentReader* reader, const char* stopwords_file) {
-    FILE* file = fopen(stopwords_file, "r");
-    if (file == NULL) {
-        fprintf(stderr, "Error: Could not open stopwords file %s\n", stopwords_file);
-        return;
+// Score one reference for every k (thread pool task)
+static void score_k_range_task(void* context, int r) {
+    KRangeContext* sweep = (KRangeContext*)context;
+    int width = sweep->k_max - sweep->k_min + 1;
+    uint64_t timer = metrics_timer_start();
+    for (int w = 0; w < width; w++) {
+        SetStats stats = fingerprint_set_stats(sweep->ranges[0].sets[w], sweep->ranges[r + 1].sets[w]);
+        sweep->scores[r * width + w] = (jaccard_from_stats(&stats) * 0.6) + (cosine_from_stats(&stats) * 0.4);
     }
-    
-    char word[MAX_WORD_LENGTH];
-    while (fscanf(file, "%s", word) != EOF && reader->stopwords_count < MAX_STOPWORDS) {
-        // Convert to lowercase
-        to_lowercase(word);
-        
-        // Allocate memory for the stopword and add to array
-        reader->stopwords[reader->stopwords_count] = strdup(word);
-        reader->stopwords_count++;
-    }
-    
-    fclose(file);
-    printf("Loaded %d stopwords\n", reader->stopwords_count);
+    metrics_add(METRIC_REFERENCES_SCORED, 1);
+    metrics_timer_stop(TIMER_SCORE, timer);
 }
 
-// Read document from file
-void read_document(DocumentReader* reader, const char* filename) {
-    FILE* file = fopen(filename, "r");
-    if (file == NULL) {
-        fprintf(stderr, "Error: Could not open file %s\n", filename);
-        return;
+// Score the target against every reference for each k of --k-range, reading
+// and preprocessing every document only once
+int run_k_range(const RunOptions* options, const char* target_file, char** reference_files,
+                int reference_count) {
+    int k_min = options->k_range_min, k_max = options->k_range_max;
+    int width = k_max - k_min + 1;
+    int doc_count = reference_count + 1;
+    if (options->engine != ENGINE_ROLLING_HASH && options->engine != ENGINE_STRING_KGRAMS) {
+        fprintf(stderr, "Note: --k-range scores all rolling-hash fingerprints; --engine is ignored\n");
+    }
+    if (options->use_lsh || options->use_inverted_index || options->find_matches ||
+        options->use_tfidf || options->stream || options->top_k > 0 || options->compact) {
+        fprintf(stderr, "Note: --k-range compares pairwise; --lsh, --inverted, --matches, --tfidf, "
+                        "--top, --stream and --compact are ignored\n");
     }
     
-    // Free previous filename if exists
-    if (reader->filename != NULL) {
-        free(reader->filename);
+    KRangeContext sweep;
+    sweep.readers = (DocumentReader**)malloc(doc_count * sizeof(DocumentReader*));
+    sweep.files = (const char**)malloc(doc_count * sizeof(char*));
+    sweep.ranges = (KGramRange*)calloc(doc_count, sizeof(KGramRange));
+    sweep.scores = (float*)calloc((size_t)(reference_count + 1) * width, sizeof(float));
+    if (sweep.readers == NULL || sweep.files == NULL || sweep.ranges == NULL || sweep.scores == NULL) {
+        fprintf(stderr, "Memory allocation failed for k-range comparison\n");
+        exit(EXIT_FAILURE);
     }
+    sweep.k_min = k_min;
+    sweep.k_max = k_max;
     
-    // Store filename
-    reader->filename = strdup(filename);
+    StopwordSet* stopwords = load_stopwords("stopwords.txt");
+    ThreadPool* pool = create_thread_pool(options->thread_count);
+    for (int i = 0; i < doc_count; i++) {
+        sweep.readers[i] = create_document_reader();
+        set_stopwords(sweep.readers[i], stopwords);
+        sweep.files[i] = i == 0 ? target_file : reference_files[i - 1];
+    }
     
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    bool parallel = thread_pool_size(pool) > 1;
+    if (parallel) set_progress_output(false);
+    thread_pool_parallel_for(pool, doc_count, ingest_k_range_task, &sweep);
+    thread_pool_parallel_for(pool, reference_count, score_k_range_task, &sweep);
+    if (parallel) set_progress_output(true);
     
-    // Allocate memory for file content
-    char* content = (char*)malloc(file_size + 1);
-    if (content == NULL) {
-        fprintf(stderr, "Memory allocation failed for file content\n");
-        fclose(file);
-        return;
+    printf("\n=== PLAGIARISM DETECTION RESULTS (k=%d..%d) ===\n", k_min, k_max);
+    printf("Target Document: %s (%d tokens)\n\n", target_file, sweep.readers[0]->token_list.count);
+    printf("%-32s", "Reference");
+    for (int k = k_min; k <= k_max; k++) {
+        char label[16];
+        snprintf(label, sizeof(label), "k=%d", k);
+        printf(" %9s", label);
+    }
+    printf("\n");
+    for (int r = 0; r < reference_count; r++) {
+        printf("%-32s", reference_files[r]);
+        for (int w = 0; w < width; w++) {
+            printf(" %8.2f%%", sweep.scores[r * width + w] * 100);
+        }
+        printf("\n");
     }
+    printf("%-32s", "Overall");
+    for (int w = 0; w < width; w++) {
+        float total = 0.0;
+        for (int r = 0; r < reference_count; r++) {
+            total += sweep.scores[r * width + w];
+        }
+        printf(" %8.2f%%", reference_count > 0 ? total / reference_count * 100 : 0.0);
+    }
+    printf("\n");
     
-    // Read file content
-    fread(content, 1, file_size, file);
-    content[file_size] = '\0';
+    if (options->alloc_stats) {
+        print_arena_stats();
+    }
+    for (int i = 0; i < doc_count; i++) {
+        free_kgram_range(&sweep.ranges[i]);
+        free_document_reader(sweep.readers[i]);
+    }
+    free(sweep.readers);
+    free(sweep.files);
+    free(sweep.ranges);
+    free(sweep.scores);
+    free_stopword_set(stopwords);
+    free_thread_pool(pool);
+    return 0;
+}
+
+// Indexes always hold rolling-hash fingerprints, which score like string k-grams
+static void note_index_engine(const RunOptions* options, const char* command) {
+    if (options->engine != ENGINE_ROLLING_HASH && options->engine != ENGINE_STRING_KGRAMS) {
+        fprintf(stderr, "Note: %s uses rolling-hash fingerprints; --engine is ignored\n", command);
+    }
+}
+
+// Process reference papers once and save their fingerprints to an index file
+int run_build_index(const RunOptions* options) {
+    if (options->document_count < 1) {
+        fprintf(stderr, "Error: build-index needs an index file name\n");
+        return EXIT_FAILURE;
+    }
+    note_index_engine(options, "build-index");
     
-    fclose(file);
+    int reference_count = 0;
+    char** reference_files = collect_reference_files(options, 1, &reference_count);
+    if (reference_files == NULL) {
+        return EXIT_FAILURE;
+    }
     
-    // Tokenize the text
-    tokenize_text(reader, content);
+    StopwordSet* stopwords = load_stopwords("stopwords.txt");
+    ThreadPool* pool = create_thread_pool(options->thread_count);
+    bool ok = build_reference_index(options->documents[0], reference_files, reference_count,
+                                    stopwords, options->k_value, pool, true);
     
-    free(content);
-    printf("Read %d words from %s\n", reader->token_list.count, filename);
+    free_file_list(reference_files, reference_count);
+    free_stopword_set(stopwords);
+    free_thread_pool(pool);
+    return ok ? 0 : EXIT_FAILURE;
 }
 
-// Preprocess text: lowercase, remove punctuation/numbers, remove stopwords
-void preprocess_text(DocumentReader* reader) {
-    int write_index = 0;
-    
-    for (int i = 0; i < reader->token_list.count; i++) {
-        char* token = reader->token_list.tokens[i];
-        
+static double monotonic_seconds() {
+#ifdef _WIN32
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+// Read, preprocess and fingerprint a query target for an index built with k
+static DocumentReader* load_query_target(const char* target_file, const StopwordSet* stopwords, int k) {
+    DocumentReader* target_reader = create_document_reader();
+    set_stopwords(target_reader, stopwords);
+    read_document(target_reader, target_file);
+    preprocess_text(target_reader);
+    generate_kgram_fingerprints(target_reader, k);
+    return target_reader;
+}
+
+static void print_query_results(const char* target_file, const IndexScore* scores, int count) {
+    float total_similarity = 0.0;
+    printf("\n=== PLAGIARISM DETECTION RESULTS ===\n");
+    printf("Target Document: %s\n", target_file);
+    for (int i = 0; i < count; i++) {
+        printf("Reference %d: %s\n", i + 1, scores[i].name);
+        printf("Similarity Score: %.2f%%\n", scores[i].score * 100);
+        total_similarity += scores[i].score;
+    }
+    printf("Overall Plagiarism Percentage: %.2f%%\n",
+           count > 0 ? total_similarity / count * 100 : 0.0);
+}
+
+// Query every live document of a segmented index
+static int run_segmented_query(const char* manifest_file, const char* target_file) {
+    SegmentedIndex* index = open_segmented_index(manifest_file, 0, false);
+    if (index == NULL) {
+        return EXIT_FAILURE;
+    }
+    IndexSnapshot* snapshot = acquire_index_snapshot(index);
+    int doc_count = index_snapshot_document_count(snapshot);
+    printf("Opened index %s: %d references in %d segments, k=%d\n", manifest_file,
+           doc_count, snapshot->segment_count, snapshot->k_value);
+    
+    StopwordSet* stopwords = load_stopwords("stopwords.txt");
+    DocumentReader* target_reader = load_query_target(target_file, stopwords, snapshot->k_value);
+    
+    IndexScore* scores = (IndexScore*)calloc(doc_count + 1, sizeof(IndexScore));
+    if (scores == NULL) {
+        fprintf(stderr, "Memory allocation failed for scores\n");
+        exit(EXIT_FAILURE);
+    }
+    int count = query_index_snapshot(snapshot, target_reader, scores);
+    print_query_results(target_file, scores, count);
+    
+    free(scores);
+    free_document_reader(target_reader);
+    free_stopword_set(stopwords);
+    release_index_snapshot(snapshot);
+    close_segmented_index(index);
+    return 0;
+}
+
+// Compare a target against a prebuilt index without reprocessing references
+int run_query(const RunOptions* options) {
+    if (options->document_count < 1) {
+        fprintf(stderr, "Error: query needs an index file name\n");
+        return EXIT_FAILURE;
+    }
+    note_index_engine(options, "query");
+    const char* target_file = options->document_count > 1 ? options->documents[1] : "target_paper.txt";
+    if (is_index_manifest(options->documents[0])) {
+        return run_segmented_query(options->documents[0], target_file);
+    }
+    
+    MappedIndex* index = open_reference_index(options->documents[0]);
+    if (index == NULL) {
+        return EXIT_FAILURE;
+    }
+    int k = (int)index->header->k_value;
+    int doc_count = (int)index->header->doc_count;
+    printf("Mapped index %s: %d references, k=%d\n", options->documents[0], doc_count, k);
+    
+    StopwordSet* stopwords = load_stopwords("stopwords.txt");
+    DocumentReader* target_reader = load_query_target(target_file, stopwords, k);
+    
+    float* scores = (float*)calloc(doc_count + 1, sizeof(float));
+    IndexScore* results = (IndexScore*)calloc(doc_count + 1, sizeof(IndexScore));
+    if (scores == NULL || results == NULL) {
+        fprintf(stderr, "Memory allocation failed for scores\n");
+        exit(EXIT_FAILURE);
+    }
+    query_reference_index(index, target_reader, scores);
+    for (int i = 0; i < doc_count; i++) {
+        results[i].name = index_document_name(index, i);
+        results[i].score = scores[i];
+    }
+    print_query_results(target_file, results, doc_count);
+    
+    free(scores);
+    free(results);
+    free_document_reader(target_reader);
+    free_stopword_set(stopwords);
+    close_reference_index(index);
+    return 0;
+}
+
+// Add references to a segmented index, creating it if needed
+int run_index_add(const RunOptions* options) {
+    if (options->document_count < 1) {
+        fprintf(stderr, "Error: index-add needs an index manifest name\n");
+        return EXIT_FAILURE;
+    }
+    note_index_engine(options, "index-add");
+    
+    int reference_count = 0;
+    char** reference_files = collect_reference_files(options, 1, &reference_count);
+    if (reference_files == NULL) {
+        return EXIT_FAILURE;
+    }
+    SegmentedIndex* index = open_segmented_index(options->documents[0], options->k_value, true);
+    if (index == NULL) {
+        free_file_list(reference_files, reference_count);
+        return EXIT_FAILURE;
+    }
+    if (index->current->k_value != options->k_value) {
+        fprintf(stderr, "Note: index %s uses k=%d\n", options->documents[0], index->current->k_value);
+    }
+    
+    StopwordSet* stopwords = load_stopwords("stopwords.txt");
+    ThreadPool* pool = create_thread_pool(options->thread_count);
+    double start = monotonic_seconds();
+    bool ok = add_index_segment(index, reference_files, reference_count, stopwords, pool);
+    if (ok) {
+        IndexSnapshot* snapshot = acquire_index_snapshot(index);
+        printf("Added %d references in %.1f ms; index has %d references in %d segments\n",
+               reference_count, (monotonic_seconds() - start) * 1000,
+               index_snapshot_document_count(snapshot), snapshot->segment_count);
+        release_index_snapshot(snapshot);
+    }
+    
+    // A compaction started by the update finishes before the program exits
+    close_segmented_index(index);
+    free_file_list(reference_files, reference_count);
+    free_stopword_set(stopwords);
+    free_thread_pool(pool);
+    return ok ? 0 : EXIT_FAILURE;
+}
+
+// Remove references from a segmented index by the names they were added with
+int run_index_remove(const RunOptions* options) {
+    if (options->document_count < 2) {
+        fprintf(stderr, "Error: index-remove needs an index manifest and document names\n");
+        return EXIT_FAILURE;
+    }
+    SegmentedIndex* index = open_segmented_index(options->documents[0], 0, false);
+    if (index == NULL) {
+        return EXIT_FAILURE;
+    }
+    
+    int removed = remove_index_documents(index, options->documents + 1, options->document_count - 1);
+    if (removed == 0) {
+        fprintf(stderr, "Note: no listed document is in index %s\n", options->documents[0]);
+    } else if (removed > 0) {
+        printf("Removed %d references from %s\n", removed, options->documents[0]);
+    }
+    close_segmented_index(index);
+    return removed >= 0 ? 0 : EXIT_FAILURE;
+}
+
+// Merge the segments of an index and drop removed references for good
+int run_index_compact(const RunOptions* options) {
+    if (options->document_count < 1) {
+        fprintf(stderr, "Error: index-compact needs an index manifest name\n");
+        return EXIT_FAILURE;
+    }
+    SegmentedIndex* index = open_segmented_index(options->documents[0], 0, false);
+    if (index == NULL) {
+        return EXIT_FAILURE;
+    }
+    bool ok = compact_segmented_index(index);
+    close_segmented_index(index);
+    return ok ? 0 : EXIT_FAILURE;
+}
+
+// Read a whole file into a NUL-terminated buffer
+static char* read_text_file(const char* filename, size_t* size) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) return NULL;
+    
+    size_t capacity = READ_CHUNK_SIZE;
+    size_t length = 0;
+    char* text = (char*)malloc(capacity + 1);
+    while (text != NULL) {
+        length += fread(text + length, 1, capacity - length, file);
+        if (length < capacity) break;
+        capacity *= 2;
+        char* grown = (char*)realloc(text, capacity + 1);
+        if (grown == NULL) free(text);
+        text = grown;
+    }
+    fclose(file);
+    if (text == NULL) return NULL;
+    
+    text[length] = '\0';
+    *size = length;
+    return text;
+}
+
+// Normalize the same text token by token (the preprocess_text() path) and in
+// bulk with each buffer kernel, check they agree and report the throughput
+int run_bench_normalize(const RunOptions* options) {
+    const char* filename = options->document_count > 0 ? options->documents[0] : "target_paper.txt";
+    int iterations = options->iterations > 0 ? options->iterations : DEFAULT_BENCH_ITERATIONS;
+    size_t size = 0;
+    char* text = read_text_file(filename, &size);
+    if (text == NULL) {
+        fprintf(stderr, "Error: Could not read %s\n", filename);
+        return EXIT_FAILURE;
+    }
+    size = strlen(text);  // Text files only: the per-token path stops at a NUL
+    
+    char* work = (char*)malloc(size + 1);
+    char* expected = (char*)malloc(size + 1);
+    if (work == NULL || expected == NULL) {
+        fprintf(stderr, "Memory allocation failed for benchmark buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    // Reference result: tokens normalized one at a time, joined by single spaces
+    const char* delimiters = " \t\n\r";
+    size_t expected_length = 0;
+    double start = monotonic_seconds();
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        memcpy(work, text, size + 1);
+        expected_length = 0;
+        char* token = work + strspn(work, delimiters);
+        while (*token != '\0') {
+            size_t length = strcspn(token, delimiters);
+            char saved = token[length];
+            token[length] = '\0';
+            to_lowercase(token);
+            remove_punctuation_numbers(token);
+            size_t kept = strlen(token);
+            if (kept > 0) {
+                if (expected_length > 0) expected[expected_length++] = ' ';
+                memcpy(expected + expected_length, token, kept);
+                expected_length += kept;
+            }
+            token += length;
+            token[0] = saved;
+            token += strspn(token, delimiters);
+        }
+    }
+    double token_seconds = monotonic_seconds() - start;
+    expected[expected_length] = '\0';
+    
+    printf("Normalizing %s (%zu bytes, %d iterations)\n", filename, size, iterations);
+    printf("  %-10s %8.1f MB/s\n", "per-token",
+           size * (double)iterations / token_seconds / 1e6);
+    
+    struct {
+        const char* name;
+        NormalizeKernel kernel;
+    } kernels[3];
+    int kernel_count = 0;
+    kernels[kernel_count].name = "scalar";
+    kernels[kernel_count++].kernel = normalize_buffer_scalar;
+#ifdef NORMALIZE_SSE2
+    kernels[kernel_count].name = "sse2";
+    kernels[kernel_count++].kernel = normalize_buffer_sse2;
+#endif
+#ifdef NORMALIZE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[kernel_count].name = "avx2";
+        kernels[kernel_count++].kernel = normalize_buffer_avx2;
+    }
+#endif
+    
+    bool ok = true;
+    for (int i = 0; i < kernel_count; i++) {
+        size_t length = 0;
+        start = monotonic_seconds();
+        for (int iteration = 0; iteration < iterations; iteration++) {
+            memcpy(work, text, size + 1);
+            length = kernels[i].kernel(work, size);
+        }
+        double seconds = monotonic_seconds() - start;
+        
+        // Collapse the kept whitespace so the result is comparable
+        size_t joined = 0;
+        char* token = work;
+        work[length] = '\0';
+        token += strspn(token, delimiters);
+        while (*token != '\0') {
+            size_t token_length = strcspn(token, delimiters);
+            if (joined > 0) work[joined++] = ' ';
+            memmove(work + joined, token, token_length);
+            joined += token_length;
+            token += token_length;
+            token += strspn(token, delimiters);
+        }
+        bool same = joined == expected_length && memcmp(work, expected, joined) == 0;
+        ok = ok && same;
+        
+        printf("  %-10s %8.1f MB/s  %.2fx%s\n", kernels[i].name,
+               size * (double)iterations / seconds / 1e6, token_seconds / seconds,
+               same ? "" : "  MISMATCH");
+    }
+    
+    free(text);
+    free(work);
+    free(expected);
+    return ok ? 0 : EXIT_FAILURE;
+}
+
+// The first 1/64th of a document's k-grams, as a set of its own with sorted hashes
+static HashTable* kgram_prefix_set(const DocumentReader* reader) {
+    const KGramList* kgrams = &reader->kgram_list;
+    int k = kgrams->k_value;
+    int prefix = kgrams->count / 64 > 0 ? kgrams->count / 64 : 1;
+    HashTable* set = create_hash_table(prefix, k);
+    if (set == NULL) {
+        fprintf(stderr, "Memory allocation failed for hash table\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < prefix; i++) {
+        hash_table_insert(set, kgrams->ids + (size_t)i * k);
+    }
+    hash_table_sort_hashes(set);
+    return set;
+}
+
+// Time every way of intersecting two k-gram sets: probing one hash table
+// with the other and merging their sorted hashes with each kernel. The
+// target is also cut to its first 1/64th, a size ratio where galloping pays
+// off. Every path must find the same shared k-grams.
+int run_bench_intersect(const RunOptions* options) {
+    const char* files[2] = {"target_paper.txt", "research_paper1.txt"};
+    for (int d = 0; d < options->document_count && d < 2; d++) {
+        files[d] = options->documents[d];
+    }
+    int iterations = options->iterations > 0 ? options->iterations : DEFAULT_INTERSECT_ITERATIONS;
+    int k = options->k_value;
+    
+    StopwordSet* stopwords = load_stopwords("stopwords.txt");
+    set_progress_output(false);
+    DocumentReader* readers[2];
+    for (int d = 0; d < 2; d++) {
+        readers[d] = create_document_reader();
+        set_stopwords(readers[d], stopwords);
+        read_document(readers[d], files[d]);
+        preprocess_text(readers[d]);
+        generate_kgrams(readers[d], k);
+    }
+    set_progress_output(true);
+    if (readers[0]->kgram_hash == NULL || readers[1]->kgram_hash == NULL) {
+        fprintf(stderr, "Error: Need two documents of at least %d tokens\n", k);
+        for (int d = 0; d < 2; d++) free_document_reader(readers[d]);
+        free_stopword_set(stopwords);
+        return EXIT_FAILURE;
+    }
+    
+    HashTable* short_set = kgram_prefix_set(readers[0]);
+    
+    struct {
+        const char* name;
+        HashTable* set1;
+        HashTable* set2;
+    } pairs[2] = {
+        {"whole target", readers[0]->kgram_hash, readers[1]->kgram_hash},
+        {"target prefix", short_set, readers[1]->kgram_hash},
+    };
+    struct {
+        const char* name;
+        IntersectKernel kernel;
+    } kernels[4];
+    int kernel_count = 0;
+    kernels[kernel_count].name = "scalar";
+    kernels[kernel_count++].kernel = intersect_count_scalar;
+    kernels[kernel_count].name = "galloping";
+    kernels[kernel_count++].kernel = intersect_count_galloping;
+#ifdef INTERSECT_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[kernel_count].name = "avx2";
+        kernels[kernel_count++].kernel = intersect_count_avx2;
+    }
+#endif
+    kernels[kernel_count].name = "auto";
+    kernels[kernel_count++].kernel = sorted_intersection_count;
+    
+    printf("Intersecting k-gram sets of %s and %s (k=%d, %d iterations)\n", files[0], files[1], k,
+           iterations);
+    bool ok = true;
+    for (int p = 0; p < 2; p++) {
+        HashTable* set1 = pairs[p].set1;
+        HashTable* set2 = pairs[p].set2;
+        printf("%s: %d and %d k-grams\n", pairs[p].name, set1->count, set2->count);
+        
+        long shared = 0;
+        double start = monotonic_seconds();
+        for (int iteration = 0; iteration < iterations; iteration++) {
+            shared += hash_table_set_stats(set1, set2).intersection;
+        }
+        double probe_seconds = monotonic_seconds() - start;
+        int expected = (int)(shared / iterations);
+        printf("  %-10s %8.2f us  %d shared\n", "hash probe", probe_seconds / iterations * 1e6, expected);
+        
+        for (int i = 0; i < kernel_count; i++) {
+            // The shorter array goes first, as sorted_intersection_count() does it
+            const uint64_t* a = set1->sorted_hashes;
+            const uint64_t* b = set2->sorted_hashes;
+            int a_count = set1->count, b_count = set2->count;
+            if (a_count > b_count) {
+                const uint64_t* swap = a;
+                a = b;
+                b = swap;
+                a_count = set2->count;
+                b_count = set1->count;
+            }
+            shared = 0;
+            start = monotonic_seconds();
+            for (int iteration = 0; iteration < iterations; iteration++) {
+                shared += kernels[i].kernel(a, a_count, b, b_count);
+            }
+            double seconds = monotonic_seconds() - start;
+            bool same = shared == (long)expected * iterations;
+            ok = ok && same;
+            printf("  %-10s %8.2f us  %.2fx%s\n", kernels[i].name, seconds / iterations * 1e6,
+                   probe_seconds / seconds, same ? "" : "  MISMATCH");
+        }
+    }
+    
+    free_hash_table(short_set);
+    for (int d = 0; d < 2; d++) {
+        free_document_reader(readers[d]);
+    }
+    free_stopword_set(stopwords);
+    return ok ? 0 : EXIT_FAILURE;
+}
+
+// Next value of a corpus generator stream (xorshift64*)
+static uint64_t bench_random_next(BenchRandom* random) {
+    random->state ^= random->state >> 12;
+    random->state ^= random->state << 25;
+    random->state ^= random->state >> 27;
+    return random->state * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform double in [0, 1)
+static double bench_random_unit(BenchRandom* random) {
+    return (bench_random_next(random) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int bench_random_below(BenchRandom* random, int bound) {
+    return (int)(bench_random_next(random) % (uint64_t)bound);
+}
+
+// Independent stream for one use (`stream`) of one document
+static BenchRandom bench_random_stream(const SyntheticCorpus* corpus, int stream) {
+    BenchRandom random;
+    random.state = mix64(corpus->seed ^ ((uint64_t)(stream + 1) * 0x9E3779B97F4A7C15ULL)) | 1;
+    return random;
+}
+
+// Pronounceable word for a frequency rank: the rank in base 80, one
+// consonant-vowel syllable per digit, so frequent words are short
+static char* synthetic_word(int rank) {
+    static const char consonants[] = "bcdfghklmnprstvz";
+    static const char vowels[] = "aeiou";
+    char word[32];
+    int length = 0;
+    for (int value = rank + 80; value > 0; value /= 80) {
+        word[length++] = consonants[value % 80 / 5];
+        word[length++] = vowels[value % 5];
+    }
+    word[length] = '\0';
+    return strdup(word);
+}
+
+// Build the vocabulary of a generated corpus; word ranks follow Zipf's law
+SyntheticCorpus* create_synthetic_corpus(const RunOptions* options, const StopwordSet* stopwords) {
+    SyntheticCorpus* corpus = (SyntheticCorpus*)calloc(1, sizeof(SyntheticCorpus));
+    if (corpus == NULL) {
+        fprintf(stderr, "Memory allocation failed for SyntheticCorpus\n");
+        exit(EXIT_FAILURE);
+    }
+    corpus->documents = options->bench_documents;
+    corpus->words = options->bench_words;
+    corpus->vocabulary = options->bench_vocabulary;
+    corpus->plagiarism_rate = options->plagiarism_rate;
+    corpus->seed = options->seed;
+    
+    corpus->vocabulary_words = (char**)malloc(corpus->vocabulary * sizeof(char*));
+    corpus->rank_cdf = (double*)malloc(corpus->vocabulary * sizeof(double));
+    corpus->stopwords = (const char**)malloc(((stopwords != NULL ? stopwords->count : 0) + 1) * sizeof(char*));
+    if (corpus->vocabulary_words == NULL || corpus->rank_cdf == NULL || corpus->stopwords == NULL) {
+        fprintf(stderr, "Memory allocation failed for SyntheticCorpus\n");
+        exit(EXIT_FAILURE);
+    }
+    double total = 0.0;
+    for (int rank = 0; rank < corpus->vocabulary; rank++) {
+        corpus->vocabulary_words[rank] = synthetic_word(rank);
+        total += 1.0 / (rank + 1);
+        corpus->rank_cdf[rank] = total;
+    }
+    
+    // Slot order is fixed by the stopword hash, so the corpus stays reproducible
+    if (stopwords != NULL) {
+        for (unsigned int i = 0; i <= stopwords->mask; i++) {
+            if (stopwords->slots[i] != NULL) {
+                corpus->stopwords[corpus->stopword_count++] = stopwords->slots[i];
+            }
+        }
+    }
+    return corpus;
+}
+
+// Draw one word: a stopword (encoded as -1 - index) or a vocabulary rank
+static int synthetic_word_id(const SyntheticCorpus* corpus, BenchRandom* random) {
+    if (corpus->stopword_count > 0 && bench_random_unit(random) < BENCH_STOPWORD_RATE) {
+        return -1 - bench_random_below(random, corpus->stopword_count);
+    }
+    double draw = bench_random_unit(random) * corpus->rank_cdf[corpus->vocabulary - 1];
+    int low = 0, high = corpus->vocabulary - 1;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (corpus->rank_cdf[middle] > draw) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
+// Words of reference `doc`; regenerated on demand instead of kept in memory
+static void generate_reference_words(const SyntheticCorpus* corpus, int doc, int* words) {
+    BenchRandom random = bench_random_stream(corpus, doc);
+    for (int i = 0; i < corpus->words; i++) {
+        words[i] = synthetic_word_id(corpus, &random);
+    }
+}
+
+// Words of the target: passages copied from random places in random
+// references, alternating with original passages of the same lengths.
+// Returns how many words were copied.
+static int generate_target_words(const SyntheticCorpus* corpus, int* words, int* scratch) {
+    BenchRandom random = bench_random_stream(corpus, corpus->documents);
+    int filled = 0, copied = 0;
+    while (filled < corpus->words) {
+        int length = MIN_BENCH_PASSAGE + bench_random_below(&random, MAX_BENCH_PASSAGE - MIN_BENCH_PASSAGE + 1);
+        if (length > corpus->words - filled) length = corpus->words - filled;
+        
+        if (bench_random_unit(&random) < corpus->plagiarism_rate) {
+            generate_reference_words(corpus, bench_random_below(&random, corpus->documents), scratch);
+            int start = bench_random_below(&random, corpus->words - length + 1);
+            memcpy(words + filled, scratch + start, length * sizeof(int));
+            copied += length;
+        } else {
+            for (int i = 0; i < length; i++) {
+                words[filled + i] = synthetic_word_id(corpus, &random);
+            }
+        }
+        filled += length;
+    }
+    return copied;
+}
+
+// Write words as text with sentences, capitals, commas, line breaks and the
+// odd number, so normalization has the same work as on real documents
+static void write_synthetic_text(FILE* file, const SyntheticCorpus* corpus, const int* words,
+                                 BenchRandom* random) {
+    bool sentence_start = true;
+    int line_words = 0;
+    for (int i = 0; i < corpus->words; i++) {
+        if (i > 0) fputc(line_words == 0 ? '\n' : ' ', file);
+        if (bench_random_below(random, 200) == 0) {
+            fprintf(file, "%d ", 1900 + bench_random_below(random, 130));
+        }
+        
+        const char* word = words[i] >= 0 ? corpus->vocabulary_words[words[i]]
+                                         : corpus->stopwords[-1 - words[i]];
+        if (sentence_start) {
+            fputc(toupper((unsigned char)word[0]), file);
+            fputs(word + 1, file);
+        } else {
+            fputs(word, file);
+        }
+        
+        int punctuation = bench_random_below(random, 60);
+        sentence_start = punctuation < 5;
+        if (sentence_start) {
+            fputc('.', file);
+        } else if (punctuation < 8) {
+            fputc(',', file);
+        }
+        line_words = (line_words + 1) % 12;
+    }
+    fputc('\n', file);
+}
+
+// Write the references and then the target into `directory`. Returns the
+// file names (references first, target last) or NULL if a file failed.
+char** write_synthetic_corpus(const SyntheticCorpus* corpus, const char* directory,
+                              size_t* total_bytes, float* copied_share) {
+#ifdef _WIN32
+    _mkdir(directory);
+#else
+    mkdir(directory, 0755);  // Usually exists already; fopen reports real problems
+#endif
+    
+    int file_count = corpus->documents + 1;
+    char** files = (char**)calloc(file_count, sizeof(char*));
+    int* words = (int*)malloc(corpus->words * sizeof(int));
+    int* scratch = (int*)malloc(corpus->words * sizeof(int));
+    if (files == NULL || words == NULL || scratch == NULL) {
+        fprintf(stderr, "Memory allocation failed for synthetic corpus\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    *total_bytes = 0;
+    *copied_share = 0.0;
+    for (int doc = 0; doc < file_count; doc++) {
+        size_t length = strlen(directory) + 32;
+        files[doc] = (char*)malloc(length);
+        if (files[doc] == NULL) {
+            fprintf(stderr, "Memory allocation failed for synthetic corpus\n");
+            exit(EXIT_FAILURE);
+        }
+        if (doc < corpus->documents) {
+            snprintf(files[doc], length, "%s/reference_%05d.txt", directory, doc + 1);
+            generate_reference_words(corpus, doc, words);
+        } else {
+            snprintf(files[doc], length, "%s/target.txt", directory);
+            *copied_share = (float)generate_target_words(corpus, words, scratch) / corpus->words;
+        }
+        
+        FILE* file = fopen(files[doc], "w");
+        if (file == NULL) {
+            fprintf(stderr, "Error: Could not create file %s\n", files[doc]);
+            free_file_list(files, doc + 1);
+            files = NULL;
+            break;
+        }
+        BenchRandom random = bench_random_stream(corpus, file_count + doc);
+        write_synthetic_text(file, corpus, words, &random);
+        *total_bytes += (size_t)ftell(file);
+        fclose(file);
+    }
+    
+    free(words);
+    free(scratch);
+    return files;
+}
+
+void free_synthetic_corpus(SyntheticCorpus* corpus) {
+    if (corpus == NULL) return;
+    for (int rank = 0; rank < corpus->vocabulary; rank++) {
+        free(corpus->vocabulary_words[rank]);
+    }
+    free(corpus->vocabulary_words);
+    free(corpus->rank_cdf);
+    free(corpus->stopwords);
+    free(corpus);
+}
+
+// Shared state for the timed stages of one bench run
+typedef struct {
+    PlagiarismChecker* checker;
+    DocumentReader** readers;
+    char** files;
+    int k_value;
+} BenchContext;
+
+static void bench_read_task(void* context, int i) {
+    BenchContext* bench = (BenchContext*)context;
+    read_document(bench->readers[i], bench->files[i]);
+}
+
+static void bench_preprocess_task(void* context, int i) {
+    BenchContext* bench = (BenchContext*)context;
+    preprocess_text(bench->readers[i]);
+}
+
+static void bench_kgram_task(void* context, int i) {
+    BenchContext* bench = (BenchContext*)context;
+    build_document_kgrams(bench->checker, bench->readers[i], bench->k_value);
+}
+
+// Keep a stage's timing and allocation counts if this run was its fastest
+static void record_bench_stage(BenchStage* stage, int run, double start,
+                               long allocations, long allocated_bytes) {
+    double seconds = monotonic_seconds() - start;
+    if (run == 0) {
+        stage->peak_rss_kb = peak_rss_kb();
+    }
+    if (run == 0 || seconds < stage->seconds) {
+        stage->seconds = seconds;
+        stage->allocations = heap_allocation_count() - allocations;
+        stage->allocated_bytes = heap_allocated_bytes() - allocated_bytes;
+    }
+}
+
+static void print_bench_stage(const BenchStage* stage, size_t corpus_bytes, int file_count) {
+    char allocations[32] = "n/a", allocated[32] = "n/a", peak[32] = "n/a";
+    if (heap_counting_enabled()) {
+        snprintf(allocations, sizeof(allocations), "%ld", stage->allocations);
+        snprintf(allocated, sizeof(allocated), "%.2f", stage->allocated_bytes / 1e6);
+    }
+    if (stage->peak_rss_kb > 0) {
+        snprintf(peak, sizeof(peak), "%.1f", stage->peak_rss_kb / 1024.0);
+    }
+    double seconds = stage->seconds > 0.0 ? stage->seconds : 1e-9;
+    printf("%-11s %10.2f %10.1f %10.1f %12s %10s %10s\n", stage->name, stage->seconds * 1000,
+           corpus_bytes / seconds / 1e6, file_count / seconds, allocations, allocated, peak);
+}
+
+// Shared k-grams of two tables by probing, by each merge kernel and by the
+// automatic choice; false when any of them disagrees
+static bool intersect_paths_agree(HashTable* set1, HashTable* set2) {
+    int expected = hash_table_set_stats(set1, set2).intersection;
+    const uint64_t* a = set1->sorted_hashes;
+    const uint64_t* b = set2->sorted_hashes;
+    int a_count = set1->count, b_count = set2->count;
+    if (a_count > b_count) {
+        a = set2->sorted_hashes;
+        b = set1->sorted_hashes;
+        a_count = set2->count;
+        b_count = set1->count;
+    }
+    bool same = intersect_count_scalar(a, a_count, b, b_count) == expected &&
+                intersect_count_galloping(a, a_count, b, b_count) == expected &&
+                sorted_intersection_count(a, a_count, b, b_count) == expected &&
+                hash_table_sorted_stats(set1, set2).intersection == expected;
+#ifdef INTERSECT_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        same = same && intersect_count_avx2(a, a_count, b, b_count) == expected;
+    }
+#endif
+    return same;
+}
+
+static bool report_self_check(const char* check, bool same) {
+    printf("  %-44s %s\n", check, same ? "ok" : "MISMATCH");
+    return same;
+}
+
+// Score every reference of a checker against the target into `scores`, then
+// ask top_k_references() for the best 1, a tenth and all of them: each
+// result must keep its score and have exactly as many references ranked
+// before it as its position. With `expected`, the scores must also equal it.
+static bool check_bench_ranking(PlagiarismChecker* checker, DocumentReader* target, int k,
+                                const char* engine_name, float* scores, const float* expected) {
+    int reference_count = checker->reference_count;
+    build_document_kgrams(checker, target, k);
+    prepare_references(checker, k);
+    double target_norm = target_tfidf_norm(checker, target);
+    char check[64];
+    bool ok = true;
+    
+    bool same = true;
+    for (int i = 0; i < reference_count; i++) {
+        scores[i] = score_reference(checker, target, target_norm, i);
+        same = same && (expected == NULL || scores[i] == expected[i]);
+    }
+    if (expected != NULL) {
+        snprintf(check, sizeof(check), "%s scores vs whole references", engine_name);
+        ok = report_self_check(check, same);
+    }
+    
+    RankedReference* results = (RankedReference*)malloc((reference_count + 1) * sizeof(RankedReference));
+    if (results == NULL) {
+        fprintf(stderr, "Memory allocation failed for top-K search\n");
+        exit(EXIT_FAILURE);
+    }
+    int tops[3] = {1, reference_count / 10, reference_count};
+    same = true;
+    for (int t = 0; t < 3; t++) {
+        if (tops[t] == 0) continue;
+        int count = top_k_references(checker, target, target_norm, tops[t], results, NULL);
+        same = same && count == tops[t];
+        for (int r = 0; r < count && same; r++) {
+            int i = results[r].reference;
+            float score = results[r].score;
+            int before = 0;
+            for (int j = 0; j < reference_count; j++) {
+                before += scores[j] > score || (scores[j] == score && j < i);
+            }
+            same = score == scores[i] && before == r;
+        }
+    }
+    free(results);
+    snprintf(check, sizeof(check), "%s top-K vs full ranking", engine_name);
+    return report_self_check(check, same) && ok;
+}
+
+// Check the shortcuts of the comparison against the plain paths on a fresh
+// copy of the corpus: every intersect kernel against probing, for the target
+// and for its first 1/64th with each reference; top-K against scoring every
+// reference; and compacted references against whole ones, on the rolling
+// engine unless the bench runs another hash engine. False on any mismatch.
+static bool run_bench_self_check(const RunOptions* options, char** files, int reference_count,
+                                 StopwordSet* stopwords, ThreadPool* pool, const char* engine_names[]) {
+    int file_count = reference_count + 1;
+    int k = options->k_value;
+    DocumentReader** readers = (DocumentReader**)malloc(file_count * sizeof(DocumentReader*));
+    float* whole_scores = (float*)malloc((reference_count + 1) * sizeof(float));
+    float* compact_scores = (float*)malloc((reference_count + 1) * sizeof(float));
+    if (readers == NULL || whole_scores == NULL || compact_scores == NULL) {
+        fprintf(stderr, "Memory allocation failed for bench self-check\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < file_count; i++) {
+        readers[i] = create_document_reader();
+        set_stopwords(readers[i], stopwords);
+    }
+    set_progress_output(false);
+    BenchContext bench = {NULL, readers, files, k};
+    thread_pool_parallel_for(pool, file_count, bench_read_task, &bench);
+    thread_pool_parallel_for(pool, file_count, bench_preprocess_task, &bench);
+    for (int i = 0; i < file_count; i++) {
+        generate_kgrams(readers[i], k);
+    }
+    DocumentReader* target = readers[reference_count];
+    
+    printf("\nSelf-check\n");
+    bool same = true;
+    int pairs = 0;
+    if (target->kgram_hash != NULL) {
+        HashTable* prefix = kgram_prefix_set(target);
+        for (int i = 0; i < reference_count; i++) {
+            if (readers[i]->kgram_hash == NULL) continue;
+            same = same && intersect_paths_agree(target->kgram_hash, readers[i]->kgram_hash) &&
+                   intersect_paths_agree(prefix, readers[i]->kgram_hash);
+            pairs += 2;
+        }
+        free_hash_table(prefix);
+    }
+    char check[64];
+    snprintf(check, sizeof(check), "intersect kernels on %d set pairs", pairs);
+    bool ok = report_self_check(check, same);
+    
+    // Compacting drops the tokens, so the engine compacted comes last
+    bool hash_engine = options->engine == ENGINE_ROLLING_HASH || options->engine == ENGINE_WINNOWING;
+    ComparisonEngine engines[2] = {options->engine, ENGINE_ROLLING_HASH};
+    int engine_count = hash_engine ? 1 : 2;
+    for (int e = 0; e < engine_count; e++) {
+        PlagiarismChecker* checker = create_plagiarism_checker();
+        set_comparison_engine(checker, engines[e]);
+        set_winnow_window(checker, options->winnow_window);
+        set_tfidf_enabled(checker, options->use_tfidf);
+        set_thread_pool(checker, pool);
+        set_comparison_output(checker, false);
+        add_target_document(checker, target);
+        for (int i = 0; i < reference_count; i++) {
+            add_reference_document(checker, readers[i]);
+        }
+        const char* engine_name = engine_names[engines[e]];
+        ok = check_bench_ranking(checker, target, k, engine_name, whole_scores, NULL) && ok;
+        
+        if (e == engine_count - 1) {
+            set_compact_references(checker, true);
+            prepare_references(checker, k);
+            for (int i = 0; i < reference_count; i++) {
+                compact_document(readers[i]);
+            }
+            snprintf(check, sizeof(check), "compact %s", engine_name);
+            ok = check_bench_ranking(checker, target, k, check, compact_scores, whole_scores) && ok;
+        }
+        free_plagiarism_checker(checker);
+    }
+    set_progress_output(true);
+    
+    for (int i = 0; i < file_count; i++) {
+        free_document_reader(readers[i]);
+    }
+    free(readers);
+    free(whole_scores);
+    free(compact_scores);
+    return ok;
+}
+
+// Generate a corpus and time reading, preprocessing, k-gram generation and
+// comparison separately on it
+int run_bench(const RunOptions* options) {
+    static const char* engine_names[] = {"strings", "rolling", "winnow", "suffix"};
+    const char* directory = options->document_count > 0 ? options->documents[0] : "bench_corpus";
+    int runs = options->iterations > 0 ? options->iterations : DEFAULT_BENCH_RUNS;
+    if (options->stream) {
+        fprintf(stderr, "Note: bench times the token list pipeline; --stream is ignored\n");
+    }
+    
+    StopwordSet* stopwords = load_stopwords("stopwords.txt");
+    SyntheticCorpus* corpus = create_synthetic_corpus(options, stopwords);
+    size_t corpus_bytes = 0;
+    float copied_share = 0.0;
+    double start = monotonic_seconds();
+    char** files = write_synthetic_corpus(corpus, directory, &corpus_bytes, &copied_share);
+    if (files == NULL) {
+        free_synthetic_corpus(corpus);
+        free_stopword_set(stopwords);
+        return EXIT_FAILURE;
+    }
+    int file_count = corpus->documents + 1;
+    printf("Generated %d references and a target of %d words in %s (%.2f MB, vocabulary %d, seed %u) in %.1f ms\n",
+           corpus->documents, corpus->words, directory, corpus_bytes / 1e6, corpus->vocabulary,
+           options->seed, (monotonic_seconds() - start) * 1000);
+    printf("The target copies %.1f%% of its words from the references\n", copied_share * 100);
+    
+    ThreadPool* pool = create_thread_pool(options->thread_count);
+    printf("Engine %s, k=%d, %d threads, best of %d runs\n\n", engine_names[options->engine],
+           options->k_value, thread_pool_size(pool), runs);
+    
+    enum { STAGE_READ, STAGE_PREPROCESS, STAGE_KGRAMS, STAGE_COMPARE, STAGE_COUNT };
+    BenchStage stages[STAGE_COUNT] = {{"read", 0.0, 0, 0, 0}, {"preprocess", 0.0, 0, 0, 0},
+                                      {"k-grams", 0.0, 0, 0, 0}, {"compare", 0.0, 0, 0, 0}};
+    TaskFunction stage_tasks[STAGE_COUNT] = {bench_read_task, bench_preprocess_task, bench_kgram_task, NULL};
+    float overall_similarity = 0.0, best_score = 0.0;
+    
+    for (int run = 0; run < runs; run++) {
+        DocumentReader** readers = (DocumentReader**)malloc(file_count * sizeof(DocumentReader*));
+        if (readers == NULL) {
+            fprintf(stderr, "Memory allocation failed for document readers\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < file_count; i++) {
+            readers[i] = create_document_reader();
+            set_stopwords(readers[i], stopwords);
+        }
+        PlagiarismChecker* checker = create_plagiarism_checker();
+        set_comparison_engine(checker, options->engine);
+        set_winnow_window(checker, options->winnow_window);
+        set_lsh_enabled(checker, options->use_lsh);
+        set_inverted_index_enabled(checker, options->use_inverted_index);
+        set_match_localization(checker, options->find_matches);
+        set_tfidf_enabled(checker, options->use_tfidf);
+        set_thread_pool(checker, pool);
+        set_comparison_output(checker, false);
+        BenchContext bench = {checker, readers, files, options->k_value};
+        
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            set_progress_output(false);  // compare_documents() turns it back on
+            long allocations = heap_allocation_count();
+            long allocated_bytes = heap_allocated_bytes();
+            double stage_start = monotonic_seconds();
+            if (s == STAGE_COMPARE) {
+                add_target_document(checker, readers[file_count - 1]);
+                for (int i = 0; i < corpus->documents; i++) {
+                    add_reference_document(checker, readers[i]);
+                }
+                compare_documents(checker, options->k_value);
+            } else {
+                thread_pool_parallel_for(pool, file_count, stage_tasks[s], &bench);
+            }
+            record_bench_stage(&stages[s], run, stage_start, allocations, allocated_bytes);
+        }
+        
+        overall_similarity = checker->overall_similarity;
+        best_score = 0.0;
+        for (int i = 0; i < corpus->documents; i++) {
+            if (checker->similarity_scores[i] > best_score) best_score = checker->similarity_scores[i];
+        }
+        free_plagiarism_checker(checker);
+        for (int i = 0; i < file_count; i++) {
+            free_document_reader(readers[i]);
+        }
+        free(readers);
+    }
+    set_progress_output(true);
+    
+    BenchStage total = {"total", 0.0, 0, 0, 0};
+    printf("%-11s %10s %10s %10s %12s %10s %10s\n", "Stage", "ms", "MB/s", "docs/s",
+           "allocations", "alloc MB", "peak RSS MB");
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        print_bench_stage(&stages[s], corpus_bytes, file_count);
+        total.seconds += stages[s].seconds;
+        total.allocations += stages[s].allocations;
+        total.allocated_bytes += stages[s].allocated_bytes;
+        total.peak_rss_kb = stages[s].peak_rss_kb;
+    }
+    print_bench_stage(&total, corpus_bytes, file_count);
+    printf("\nOverall similarity %.2f%%, most similar reference %.2f%%\n",
+           overall_similarity * 100, best_score * 100);
+    if (options->alloc_stats) {
+        print_arena_stats();
+    }
+    bool ok = run_bench_self_check(options, files, corpus->documents, stopwords, pool, engine_names);
+    
+    free_file_list(files, file_count);
+    free_synthetic_corpus(corpus);
+    free_stopword_set(stopwords);
+    free_thread_pool(pool);
+    return ok ? 0 : EXIT_FAILURE;
+}
+
+// Print command line usage
+void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [options] [target reference...]\n"
+                    "       %s build-index [options] INDEX [reference...]\n"
+                    "       %s query [options] INDEX [target]\n"
+                    "       %s index-add [options] INDEX reference...\n"
+                    "       %s index-remove INDEX reference...\n"
+                    "       %s index-compact INDEX\n"
+                    "       %s bench-normalize [--iterations=N] [document]\n"
+                    "       %s bench-intersect [--k=N] [--iterations=N] [target reference]\n"
+                    "       %s bench [options] [--docs=N] [--words=N] [--vocab=N] [--plagiarism=R]\n"
+                    "             [--seed=N] [--iterations=N] [DIR]\n"
+                    "       %s dedup [options] [--threshold=T] DIR|document...\n"
+                    "       %s serve [options] [--batch=N] SOCKET [reference...]\n"
+                    "Options: --engine=strings|rolling|winnow|suffix --k=N --k-range=MIN-MAX --window=W --lsh --inverted\n"
+                    "         --matches --tfidf --top=N\n"
+                    "         --ref-list=FILE --threads=N --stream --compact --alloc-stats\n"
+                    "         --metrics=FILE --metrics-format=json|prometheus --metrics-interval=SECONDS\n",
+            program, program, program, program, program, program, program, program, program, program,
+            program);
+}
+
+// Parse options starting at argv[first]; the first non-option starts the documents
+bool parse_run_options(int argc, char* argv[], int first, RunOptions* options) {
+    options->engine = ENGINE_STRING_KGRAMS;
+    options->k_value = 3;
+    options->winnow_window = DEFAULT_WINNOW_WINDOW;
+    options->use_lsh = false;
+    options->use_inverted_index = false;
+    options->find_matches = false;
+    options->use_tfidf = false;
+    options->stream = false;
+    options->compact = false;
+    options->k_range_min = 0;
+    options->k_range_max = 0;
+    options->batch_size = DEFAULT_SERVER_BATCH;
+    options->top_k = 0;
+    options->alloc_stats = false;
+    options->iterations = 0;
+    options->threshold = DEFAULT_DEDUP_THRESHOLD;
+    options->thread_count = available_cpu_count();
+    options->bench_documents = DEFAULT_BENCH_DOCUMENTS;
+    options->bench_words = DEFAULT_BENCH_WORDS;
+    options->bench_vocabulary = DEFAULT_BENCH_VOCABULARY;
+    options->plagiarism_rate = DEFAULT_PLAGIARISM_RATE;
+    options->seed = 1;
+    options->metrics_file = NULL;
+    options->metrics_format = METRICS_JSON;
+    options->metrics_interval = 0.0;
+    options->reference_list = NULL;
+    options->documents = &argv[argc];
+    options->document_count = 0;
+    
+    for (int i = first; i < argc; i++) {
+        if (argv[i][0] != '-') {
+            // Remaining arguments are document names
+            options->documents = &argv[i];
+            options->document_count = argc - i;
+            break;
+        } else if (strcmp(argv[i], "--lsh") == 0) {
+            options->use_lsh = true;
+        } else if (strcmp(argv[i], "--inverted") == 0) {
+            options->use_inverted_index = true;
+        } else if (strcmp(argv[i], "--matches") == 0) {
+            options->find_matches = true;
+        } else if (strcmp(argv[i], "--tfidf") == 0) {
+            options->use_tfidf = true;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            options->stream = true;
+        } else if (strcmp(argv[i], "--compact") == 0) {
+            options->compact = true;
+        } else if (strcmp(argv[i], "--alloc-stats") == 0) {
+            options->alloc_stats = true;
+        } else if (strncmp(argv[i], "--ref-list=", 11) == 0) {
+            options->reference_list = argv[i] + 11;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            options->thread_count = atoi(argv[i] + 10);
+            if (options->thread_count <= 0) {
+                fprintf(stderr, "Error: Invalid thread count %s\n", argv[i] + 10);
+                return false;
+            }
+        } else if (strncmp(argv[i], "--engine=", 9) == 0) {
+            if (!parse_comparison_engine(argv[i] + 9, &options->engine)) {
+                fprintf(stderr, "Error: Unknown engine %s\n", argv[i] + 9);
+                return false;
+            }
+        } else if (strncmp(argv[i], "--k=", 4) == 0) {
+            options->k_value = atoi(argv[i] + 4);
+            if (options->k_value <= 0) {
+                fprintf(stderr, "Error: Invalid k value %s\n", argv[i] + 4);
+                return false;
+            }
+        } else if (strncmp(argv[i], "--k-range=", 10) == 0) {
+            if (sscanf(argv[i] + 10, "%d-%d", &options->k_range_min, &options->k_range_max) != 2 ||
+                options->k_range_min <= 0 || options->k_range_max < options->k_range_min ||
+                options->k_range_max - options->k_range_min >= MAX_K_RANGE) {
+                fprintf(stderr, "Error: Invalid k range %s (MIN-MAX, at most %d values)\n",
+                        argv[i] + 10, MAX_K_RANGE);
+                return false;
+            }
+        } else if (strncmp(argv[i], "--top=", 6) == 0) {
+            options->top_k = atoi(argv[i] + 6);
+            if (options->top_k <= 0) {
+                fprintf(stderr, "Error: Invalid top count %s\n", argv[i] + 6);
+                return false;
+            }
+        } else if (strncmp(argv[i], "--batch=", 8) == 0) {
+            options->batch_size = atoi(argv[i] + 8);
+            if (options->batch_size <= 0) {
+                fprintf(stderr, "Error: Invalid batch size %s\n", argv[i] + 8);
+                return false;
+            }
+        } else if (strncmp(argv[i], "--threshold=", 12) == 0) {
+            options->threshold = atof(argv[i] + 12);
+            if (options->threshold <= 0.0 || options->threshold > 1.0) {
+                fprintf(stderr, "Error: Threshold must be in (0, 1]: %s\n", argv[i] + 12);
+                return false;
+            }
+        } else if (strncmp(argv[i], "--iterations=", 13) == 0) {
+            options->iterations = atoi(argv[i] + 13);
+            if (options->iterations <= 0) {
+                fprintf(stderr, "Error: Invalid iteration count %s\n", argv[i] + 13);
+                return false;
+            }
+        } else if (strncmp(argv[i], "--docs=", 7) == 0) {
+            options->bench_documents = atoi(argv[i] + 7);
+            if (options->bench_documents <= 0) {
+                fprintf(stderr, "Error: Invalid document count %s\n", argv[i] + 7);
+                return false;
+            }
+        } else if (strncmp(argv[i], "--words=", 8) == 0) {
+            options->bench_words = atoi(argv[i] + 8);
+            if (options->bench_words <= 0) {
+                fprintf(stderr, "Error: Invalid word count %s\n", argv[i] + 8);
+                return false;
+            }
+        } else if (strncmp(argv[i], "--vocab=", 8) == 0) {
+            options->bench_vocabulary = atoi(argv[i] + 8);
+            if (options->bench_vocabulary <= 0) {
+                fprintf(stderr, "Error: Invalid vocabulary size %s\n", argv[i] + 8);
+                return false;
+            }
+        } else if (strncmp(argv[i], "--plagiarism=", 13) == 0) {
+            options->plagiarism_rate = atof(argv[i] + 13);
+            if (options->plagiarism_rate < 0.0 || options->plagiarism_rate > 1.0) {
+                fprintf(stderr, "Error: Plagiarism rate must be in [0, 1]: %s\n", argv[i] + 13);
+                return false;
+            }
+        } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+            options->seed = (unsigned int)strtoul(argv[i] + 7, NULL, 10);
+        } else if (strncmp(argv[i], "--metrics=", 10) == 0) {
+            options->metrics_file = argv[i] + 10;
+        } else if (strncmp(argv[i], "--metrics-format=", 17) == 0) {
+            if (strcmp(argv[i] + 17, "json") == 0) {
+                options->metrics_format = METRICS_JSON;
+            } else if (strcmp(argv[i] + 17, "prometheus") == 0) {
+                options->metrics_format = METRICS_PROMETHEUS;
+            } else {
+                fprintf(stderr, "Error: Unknown metrics format %s\n", argv[i] + 17);
+                return false;
+            }
+        } else if (strncmp(argv[i], "--metrics-interval=", 19) == 0) {
+            options->metrics_interval = atof(argv[i] + 19);
+            if (options->metrics_interval <= 0.0) {
+                fprintf(stderr, "Error: Invalid metrics interval %s\n", argv[i] + 19);
+                return false;
+            }
+        } else if (strncmp(argv[i], "--window=", 9) == 0) {
+            options->winnow_window = atoi(argv[i] + 9);
+            if (options->winnow_window <= 0) {
+                fprintf(stderr, "Error: Invalid winnowing window %s\n", argv[i] + 9);
+                return false;
+            }
+        } else {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            return false;
+        }
+    }
+    if (options->metrics_file == NULL && options->metrics_interval > 0.0) {
+        fprintf(stderr, "Error: --metrics-interval needs --metrics=FILE\n");
+        return false;
+    }
+    return true;
+}
+
+// Read reference file paths from a list file (one path per line)
+char** read_reference_list(const char* list_file, int* count) {
+    FILE* file = fopen(list_file, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open reference list %s\n", list_file);
+        return NULL;
+    }
+    
+    int capacity = INITIAL_REFERENCE_CAPACITY;
+    char** files = (char**)malloc(capacity * sizeof(char*));
+    if (files == NULL) {
+        fprintf(stderr, "Memory allocation failed for reference list\n");
+        exit(EXIT_FAILURE);
+    }
+    *count = 0;
+    
+    char line[4096];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') continue;
+        
+        if (*count == capacity) {
+            capacity *= 2;
+            files = (char**)realloc(files, capacity * sizeof(char*));
+            if (files == NULL) {
+                fprintf(stderr, "Memory allocation failed for reference list\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        files[(*count)++] = strdup(line);
+    }
+    
+    fclose(file);
+    return files;
+}
+
+// Reference files come from --ref-list, the documents after `first`, or the defaults
+char** collect_reference_files(const RunOptions* options, int first, int* count) {
+    static const char* default_reference_files[] = {
+        "research_paper1.txt",
+        "research_paper2.txt",
+        "research_paper3.txt",
+        "research_paper4.txt"
+    };
+    
+    if (options->reference_list != NULL) {
+        return read_reference_list(options->reference_list, count);
+    }
+    
+    const char** source = default_reference_files;
+    *count = sizeof(default_reference_files) / sizeof(default_reference_files[0]);
+    if (options->document_count > first) {
+        source = (const char**)&options->documents[first];
+        *count = options->document_count - first;
+    }
+    
+    char** files = (char**)malloc((*count + 1) * sizeof(char*));
+    if (files == NULL) {
+        fprintf(stderr, "Memory allocation failed for reference list\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < *count; i++) {
+        files[i] = strdup(source[i]);
+    }
+    return files;
+}
+
+// Free a list returned by collect_reference_files()
+void free_file_list(char** files, int count) {
+    if (files == NULL) return;
+    for (int i = 0; i < count; i++) {
+        free(files[i]);
+    }
+    free(files);
+}
+
+// Append a copy of a path to a growable file list
+static void file_list_append(char*** files, int* count, int* capacity, const char* path) {
+    if (*count == *capacity) {
+        *capacity = *capacity == 0 ? INITIAL_REFERENCE_CAPACITY : *capacity * 2;
+        *files = (char**)realloc(*files, (*capacity + 1) * sizeof(char*));
+        if (*files == NULL) {
+            fprintf(stderr, "Memory allocation failed for file list\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*files)[(*count)++] = strdup(path);
+}
+
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Documents of a dedup batch: every positional file, the regular files of
+// every positional directory (sorted by name, not recursive) and the
+// entries of --ref-list
+char** collect_corpus_files(const RunOptions* options, int* count) {
+    char** files = NULL;
+    int capacity = 0;
+    *count = 0;
+    
+    for (int d = 0; d < options->document_count; d++) {
+        const char* path = options->documents[d];
+#ifdef _WIN32
+        file_list_append(&files, count, &capacity, path);
+#else
+        struct stat info;
+        if (stat(path, &info) != 0 || !S_ISDIR(info.st_mode)) {
+            file_list_append(&files, count, &capacity, path);
+            continue;
+        }
+        
+        DIR* directory = opendir(path);
+        if (directory == NULL) {
+            fprintf(stderr, "Error: Could not open directory %s\n", path);
+            continue;
+        }
+        int first = *count;
+        struct dirent* entry;
+        while ((entry = readdir(directory)) != NULL) {
+            if (entry->d_name[0] == '.') continue;
+            
+            size_t length = strlen(path) + strlen(entry->d_name) + 2;
+            char* file = (char*)malloc(length);
+            if (file == NULL) {
+                fprintf(stderr, "Memory allocation failed for file list\n");
+                exit(EXIT_FAILURE);
+            }
+            snprintf(file, length, "%s/%s", path, entry->d_name);
+            if (stat(file, &info) == 0 && S_ISREG(info.st_mode)) {
+                file_list_append(&files, count, &capacity, file);
+            }
+            free(file);
+        }
+        closedir(directory);
+        qsort(files + first, *count - first, sizeof(char*), compare_paths);
+#endif
+    }
+    
+    if (options->reference_list != NULL) {
+        int listed = 0;
+        char** list = read_reference_list(options->reference_list, &listed);
+        for (int i = 0; list != NULL && i < listed; i++) {
+            file_list_append(&files, count, &capacity, list[i]);
+        }
+        free_file_list(list, listed);
+    }
+    return files;
+}
+
+// Shared state for ingesting a dedup batch in parallel
+typedef struct {
+    DocumentReader** readers;
+    char** files;
+    const StopwordSet* stopwords;
+    ComparisonEngine engine;
+    int k_value;
+    int winnow_window;
+} DedupIngestContext;
+
+// Stream one batch document straight to fingerprints (thread pool task)
+static void ingest_corpus_task(void* context, int i) {
+    DedupIngestContext* ingest = (DedupIngestContext*)context;
+    DocumentReader* reader = create_document_reader();
+    set_stopwords(reader, ingest->stopwords);
+    ingest_document_stream(reader, ingest->files[i], ingest->k_value, ingest->engine == ENGINE_WINNOWING);
+    if (ingest->engine == ENGINE_WINNOWING && reader->fingerprint_set != NULL) {
+        winnow_fingerprints(reader, ingest->winnow_window);
+    }
+    ingest->readers[i] = reader;
+}
+
+static int compare_duplicate_pairs(const void* a, const void* b) {
+    const DuplicatePair* x = (const DuplicatePair*)a;
+    const DuplicatePair* y = (const DuplicatePair*)b;
+    if (x->score != y->score) return x->score < y->score ? 1 : -1;
+    if (x->first != y->first) return x->first - y->first;
+    return x->second - y->second;
+}
+
+// Find near-duplicate pairs inside a batch of documents
+int run_dedup(const RunOptions* options) {
+    int count = 0;
+    char** files = collect_corpus_files(options, &count);
+    if (count < 2) {
+        fprintf(stderr, "Error: dedup needs at least two documents\n");
+        free_file_list(files, count);
+        return EXIT_FAILURE;
+    }
+    
+    // Pairs are scored on fingerprints; only winnowing changes which ones
+    ComparisonEngine engine = options->engine == ENGINE_WINNOWING ? ENGINE_WINNOWING : ENGINE_ROLLING_HASH;
+    
+    printf("=== NEAR-DUPLICATE DETECTION ===\n\n");
+    StopwordSet* stopwords = load_stopwords("stopwords.txt");
+    ThreadPool* pool = create_thread_pool(options->thread_count);
+    
+    DocumentReader** readers = (DocumentReader**)calloc(count, sizeof(DocumentReader*));
+    if (readers == NULL) {
+        fprintf(stderr, "Memory allocation failed for document readers\n");
+        exit(EXIT_FAILURE);
+    }
+    DedupIngestContext ingest = {readers, files, stopwords, engine, options->k_value,
+                                 options->winnow_window};
+    set_progress_output(false);
+    thread_pool_parallel_for(pool, count, ingest_corpus_task, &ingest);
+    set_progress_output(true);
+    printf("Ingested %d documents (k=%d, %s)\n", count, options->k_value,
+           engine == ENGINE_WINNOWING ? "winnowed fingerprints" : "all fingerprints");
+    
+    int pair_count = 0;
+    DuplicatePair* pairs = find_duplicate_pairs(readers, count, engine, options->threshold,
+                                                pool, &pair_count);
+    qsort(pairs, pair_count, sizeof(DuplicatePair), compare_duplicate_pairs);
+    
+    printf("Pairs with similarity of at least %.2f%%: %d\n\n", options->threshold * 100, pair_count);
+    for (int p = 0; p < pair_count; p++) {
+        printf("%6.2f%%  %s <-> %s (Jaccard %.2f%%, Cosine %.2f%%, %d shared k-grams)\n",
+               pairs[p].score * 100, files[pairs[p].first], files[pairs[p].second],
+               pairs[p].jaccard * 100, pairs[p].cosine * 100, pairs[p].shared);
+    }
+    
+    free(pairs);
+    for (int i = 0; i < count; i++) {
+        free_document_reader(readers[i]);
+    }
+    free(readers);
+    free_file_list(files, count);
+    free_stopword_set(stopwords);
+    free_thread_pool(pool);
+    return 0;
+}
+
+// Load the reference corpus once and answer check requests over a Unix
+// domain socket until interrupted
+int run_serve(const RunOptions* options) {
+    if (options->document_count < 1) {
+        fprintf(stderr, "Error: serve needs a socket path\n");
+        return EXIT_FAILURE;
+    }
+    const char* socket_path = options->documents[0];
+    
+    int reference_count = 0;
+    char** reference_files = collect_reference_files(options, 1, &reference_count);
+    if (reference_files == NULL) {
+        return EXIT_FAILURE;
+    }
+    
+    PlagiarismChecker* checker = create_plagiarism_checker();
+    set_comparison_engine(checker, options->engine);
+    set_winnow_window(checker, options->winnow_window);
+    set_lsh_enabled(checker, options->use_lsh);
+    set_inverted_index_enabled(checker, options->use_inverted_index);
+    set_tfidf_enabled(checker, options->use_tfidf);
+    set_comparison_output(checker, false);
+    bool hash_engine = options->engine == ENGINE_ROLLING_HASH || options->engine == ENGINE_WINNOWING;
+    if (options->use_inverted_index && !hash_engine) {
+        fprintf(stderr, "Note: --inverted needs a hash engine; comparing pairwise\n");
+    }
+    if (options->use_tfidf && options->engine == ENGINE_SUFFIX_ARRAY) {
+        fprintf(stderr, "Note: --tfidf does not apply to the suffix engine\n");
+    }
+    if (options->stream && !hash_engine) {
+        fprintf(stderr, "Note: --stream needs a hash engine; reading documents whole\n");
+    }
+    if (options->find_matches || options->k_range_max > 0) {
+        fprintf(stderr, "Note: serve reports scores only; --matches and --k-range are ignored\n");
+    }
+    if (options->compact && !hash_engine) {
+        fprintf(stderr, "Note: --compact needs a hash engine; keeping references whole\n");
+    }
+    set_compact_references(checker, options->compact && hash_engine);
+    ThreadPool* pool = create_thread_pool(options->thread_count);
+    set_thread_pool(checker, pool);
+    StopwordSet* stopwords = load_stopwords("stopwords.txt");
+    
+    // Build the warm corpus: references are fingerprinted and indexed once
+    double start = monotonic_seconds();
+    DocumentReader** ref_readers = (DocumentReader**)malloc((reference_count + 1) * sizeof(DocumentReader*));
+    if (ref_readers == NULL) {
+        fprintf(stderr, "Memory allocation failed for reference readers\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < reference_count; i++) {
+        ref_readers[i] = create_document_reader();
+        set_stopwords(ref_readers[i], stopwords);
+    }
+    IngestContext ingest = {checker, ref_readers, reference_files, options->k_value,
+                            options->stream && hash_engine};
+    set_progress_output(false);
+    thread_pool_parallel_for(pool, reference_count, ingest_reference_task, &ingest);
+    for (int i = 0; i < reference_count; i++) {
+        add_reference_document(checker, ref_readers[i]);
+    }
+    prepare_references(checker, options->k_value);
+    printf("Loaded %d references in %.2f s (k=%d)\n", reference_count, monotonic_seconds() - start,
+           options->k_value);
+    if (options->compact && hash_engine) {
+        print_compact_summary(ref_readers, reference_count);
+    }
+    
+    // Requests are answered quietly; progress lines would interleave
+    set_progress_output(false);
+    int status = serve_check_requests(checker, stopwords, socket_path, options->k_value,
+                                      options->stream && hash_engine, options->batch_size);
+    set_progress_output(true);
+    
+    free_plagiarism_checker(checker);
+    for (int i = 0; i < reference_count; i++) {
+        free_document_reader(ref_readers[i]);
+    }
+    free(ref_readers);
+    free_file_list(reference_files, reference_count);
+    free_stopword_set(stopwords);
+    free_thread_pool(pool);
+    return status;
+}
+
+// ==================== THREAD POOL ====================
+
+static atomic_bool g_progress_output = true;  // Read by queries while an update runs
+
+// Enable or disable per-document progress lines (disabled while threads run)
+void set_progress_output(bool enabled) {
+    g_progress_output = enabled;
+}
+
+// printf for progress messages that can be silenced
+void log_progress(const char* format, ...) {
+    if (!g_progress_output) return;
+    
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+// Number of online CPUs (1 when it cannot be determined)
+int available_cpu_count() {
+#ifdef _WIN32
+    return 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+// Take task indices until the current job is exhausted
+static void thread_pool_run_tasks(ThreadPool* pool) {
+    for (;;) {
+        int index = atomic_fetch_add(&pool->next_task, 1);
+        if (index >= pool->task_count) break;
+        pool->function(pool->context, index);
+    }
+}
+
+// Worker loop: wait for a new job generation, help finish it, report back
+static void* thread_pool_worker(void* arg) {
+    ThreadPool* pool = (ThreadPool*)arg;
+    unsigned long seen_generation = 0;
+    
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shutdown && pool->generation == seen_generation) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->shutdown) break;
+        seen_generation = pool->generation;
+        
+        pthread_mutex_unlock(&pool->lock);
+        thread_pool_run_tasks(pool);
+        pthread_mutex_lock(&pool->lock);
+        
+        if (--pool->pending_workers == 0) {
+            pthread_cond_signal(&pool->work_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Create a pool using thread_count threads in total (including the caller)
+ThreadPool* create_thread_pool(int thread_count) {
+    ThreadPool* pool = (ThreadPool*)calloc(1, sizeof(ThreadPool));
+    if (pool == NULL) {
+        fprintf(stderr, "Memory allocation failed for ThreadPool\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    atomic_init(&pool->next_task, 0);
+    
+    int workers = thread_count > 1 ? thread_count - 1 : 0;
+    pool->threads = (pthread_t*)malloc((workers + 1) * sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        fprintf(stderr, "Memory allocation failed for ThreadPool\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&pool->threads[i], NULL, thread_pool_worker, pool) != 0) {
+            fprintf(stderr, "Warning: Could only start %d worker threads\n", i);
+            break;
+        }
+        pool->worker_count++;
+    }
+    return pool;
+}
+
+// Threads that take part in a parallel_for (workers plus the caller)
+int thread_pool_size(ThreadPool* pool) {
+    return pool == NULL ? 1 : pool->worker_count + 1;
+}
+
+// Run function(context, i) for every i in [0, count) and wait for all of them.
+// Tasks may run in any order; each should write only its own results.
+void thread_pool_parallel_for(ThreadPool* pool, int count, TaskFunction function, void* context) {
+    if (count <= 0) return;
+    
+    if (pool == NULL || pool->worker_count == 0 || count == 1) {
+        for (int i = 0; i < count; i++) {
+            function(context, i);
+        }
+        return;
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->function = function;
+    pool->context = context;
+    pool->task_count = count;
+    atomic_store(&pool->next_task, 0);
+    pool->pending_workers = pool->worker_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    
+    thread_pool_run_tasks(pool);
+    
+    // Every worker must check in before the job description can change
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending_workers > 0) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Stop the workers and free the pool
+void free_thread_pool(ThreadPool* pool) {
+    if (pool == NULL) return;
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    
+    for (int i = 0; i < pool->worker_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+    free(pool->threads);
+    free(pool);
+}
+
+// ==================== HEAP ALLOCATION COUNTING ====================
+
+#ifdef COUNT_HEAP_ALLOCATIONS
+// Counts of one thread, written only by it, like the metrics shards
+typedef struct HeapShard {
+    atomic_long allocations;
+    atomic_long bytes;
+    struct HeapShard* next;
+} HeapShard;
+
+static _Atomic(HeapShard*) heap_shards;        // Every thread's shard, kept until exit
+static _Thread_local HeapShard* thread_heap;
+
+// glibc's own allocator, reached by the wrappers below
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+extern void __libc_free(void* pointer);
+
+// Add one allocation to the calling thread's shard. The shard comes from
+// glibc directly and is pushed without a lock, since this runs inside malloc.
+static void count_heap_allocation(size_t size) {
+    HeapShard* shard = thread_heap;
+    if (shard == NULL) {
+        shard = (HeapShard*)__libc_calloc(1, sizeof(HeapShard));
+        if (shard == NULL) return;
+        HeapShard* head = atomic_load_explicit(&heap_shards, memory_order_relaxed);
+        do {
+            shard->next = head;
+        } while (!atomic_compare_exchange_weak_explicit(&heap_shards, &head, shard,
+                                                        memory_order_release, memory_order_relaxed));
+        thread_heap = shard;
+    }
+    atomic_store_explicit(&shard->allocations,
+                          atomic_load_explicit(&shard->allocations, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_store_explicit(&shard->bytes,
+                          atomic_load_explicit(&shard->bytes, memory_order_relaxed) + (long)size,
+                          memory_order_relaxed);
+}
+
+// These replace the C library allocator for the whole process, so
+// allocations made inside libc (strdup, fopen) are counted as well
+void* malloc(size_t size) {
+    count_heap_allocation(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    count_heap_allocation(count * size);
+    return __libc_calloc(count, size);
+}
+
+// Every resize counts: it may move the block
+void* realloc(void* pointer, size_t size) {
+    count_heap_allocation(size);
+    return __libc_realloc(pointer, size);
+}
+
+void free(void* pointer) {
+    __libc_free(pointer);
+}
+#endif
+
+// False unless the allocator is wrapped (counts then stay 0)
+bool heap_counting_enabled() {
+#ifdef COUNT_HEAP_ALLOCATIONS
+    return true;
+#else
+    return false;
+#endif
+}
+
+long heap_allocation_count() {
+    long count = 0;
+#ifdef COUNT_HEAP_ALLOCATIONS
+    for (HeapShard* shard = atomic_load_explicit(&heap_shards, memory_order_acquire);
+         shard != NULL; shard = shard->next) {
+        count += atomic_load_explicit(&shard->allocations, memory_order_relaxed);
+    }
+#endif
+    return count;
+}
+
+long heap_allocated_bytes() {
+    long bytes = 0;
+#ifdef COUNT_HEAP_ALLOCATIONS
+    for (HeapShard* shard = atomic_load_explicit(&heap_shards, memory_order_acquire);
+         shard != NULL; shard = shard->next) {
+        bytes += atomic_load_explicit(&shard->bytes, memory_order_relaxed);
+    }
+#endif
+    return bytes;
+}
+
+// Largest resident set of the process so far, in KB (0 if unknown)
+long peak_rss_kb() {
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;  // Bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// ==================== ARENA ALLOCATOR ====================
+
+// Process-wide counters for the allocation report (readers run in parallel)
+static atomic_long arena_allocations;
+static atomic_long arena_blocks;
+static atomic_long arena_bytes;
+
+void arena_init(Arena* arena) {
+    arena->head = NULL;
+}
+
+// Allocate `size` bytes aligned for any scalar type; never fails (exits on OOM)
+void* arena_alloc(Arena* arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    
+    ArenaBlock* block = arena->head;
+    if (block == NULL || block->size - block->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + block_size);
+        if (block == NULL) {
+            fprintf(stderr, "Memory allocation failed for arena block\n");
+            exit(EXIT_FAILURE);
+        }
+        block->size = block_size;
+        block->used = 0;
+        
+        if (arena->head != NULL && block_size > ARENA_BLOCK_SIZE) {
+            // Oversized block: keep filling the current one afterwards
+            block->next = arena->head->next;
+            arena->head->next = block;
+        } else {
+            block->next = arena->head;
+            arena->head = block;
+        }
+        atomic_fetch_add_explicit(&arena_blocks, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&arena_bytes, (long)block_size, memory_order_relaxed);
+    }
+    
+    void* memory = block->data + block->used;
+    block->used += size;
+    atomic_fetch_add_explicit(&arena_allocations, 1, memory_order_relaxed);
+    return memory;
+}
+
+// Copy `length` bytes of a string into the arena and NUL-terminate it
+char* arena_strndup(Arena* arena, const char* str, size_t length) {
+    char* copy = (char*)arena_alloc(arena, length + 1);
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+// Free every block at once; the arena can be reused afterwards
+void arena_release(Arena* arena) {
+    ArenaBlock* block = arena->head;
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+}
+
+// Allocations served by arenas versus the malloc calls they actually cost
+void print_arena_stats() {
+    long allocations = atomic_load(&arena_allocations);
+    long blocks = atomic_load(&arena_blocks);
+    
+    printf("\nArena allocations: %ld words and k-grams in %ld blocks (%.1f KB)\n",
+           allocations, blocks, atomic_load(&arena_bytes) / 1024.0);
+    if (blocks > 0) {
+        printf("malloc calls avoided: %ld (%.0f allocations per block)\n",
+               allocations - blocks, (double)allocations / blocks);
+    }
+    printf("Token dictionary: %d distinct words shared by all documents\n", token_dictionary_count());
+}
+
+// ==================== METRICS ====================
+
+static atomic_bool g_metrics_enabled;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static MetricsShard* metrics_shards;           // Every thread's shard, kept until exit
+static _Thread_local MetricsShard* thread_metrics;
+static uint64_t metrics_epoch;                 // When metrics were enabled (ns)
+
+static const char* metric_counter_names[METRIC_COUNTER_COUNT] = {
+    "documents_read", "bytes_read", "tokens_read", "tokens_kept", "kgrams",
+    "hash_lookups", "hash_probes", "references_scored", "references_pruned", "requests", "request_batches"
+};
+static const char* metric_counter_help[METRIC_COUNTER_COUNT] = {
+    "Documents read or streamed",
+    "Bytes read from documents",
+    "Words read, before preprocessing",
+    "Words kept after normalization and stopword removal",
+    "K-grams generated",
+    "K-gram and fingerprint table lookups",
+    "Slots examined by table lookups",
+    "References scored against a target",
+    "References skipped by top-K score bounds",
+    "Check requests answered by serve",
+    "Batches of requests scored by serve"
+};
+static const char* metric_timer_names[TIMER_COUNT] = {
+    "read", "preprocess", "kgrams", "stream", "score", "query", "request"
+};
+
+static uint64_t metrics_now() {
+#ifdef _WIN32
+    return (uint64_t)clock() * (1000000000ULL / CLOCKS_PER_SEC);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// Start recording; until then every metrics call returns at once
+void enable_metrics() {
+    metrics_epoch = metrics_now();
+    atomic_store(&g_metrics_enabled, true);
+}
+
+static inline bool metrics_on() {
+    return atomic_load_explicit(&g_metrics_enabled, memory_order_relaxed);
+}
+
+// The calling thread's shard, registered on first use
+static MetricsShard* metrics_shard() {
+    MetricsShard* shard = thread_metrics;
+    if (shard == NULL) {
+        shard = (MetricsShard*)calloc(1, sizeof(MetricsShard));
+        if (shard == NULL) {
+            fprintf(stderr, "Memory allocation failed for metrics\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_lock(&metrics_lock);
+        shard->next = metrics_shards;
+        metrics_shards = shard;
+        pthread_mutex_unlock(&metrics_lock);
+        thread_metrics = shard;
+    }
+    return shard;
+}
+
+// Add to a value only the owning thread writes
+static inline void shard_add(atomic_ullong* value, uint64_t amount) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + amount,
+                          memory_order_relaxed);
+}
+
+void metrics_add(MetricCounter counter, uint64_t amount) {
+    if (!metrics_on()) return;
+    shard_add(&metrics_shard()->counters[counter], amount);
+}
+
+// Timestamp to pass to metrics_timer_stop() (0 when metrics are off)
+uint64_t metrics_timer_start() {
+    return metrics_on() ? metrics_now() : 0;
+}
+
+// Record the time since `start` in the timer's histogram
+void metrics_timer_stop(MetricTimer timer, uint64_t start) {
+    if (start == 0) return;
+    uint64_t elapsed = metrics_now() - start;
+    
+    // Bucket b holds durations below 2^b microseconds; the last one the rest
+    int bucket = 0;
+    for (uint64_t micros = elapsed / 1000; micros > 0 && bucket < LATENCY_BUCKETS - 1; micros >>= 1) {
+        bucket++;
+    }
+    MetricsShard* shard = metrics_shard();
+    shard_add(&shard->latency_buckets[timer][bucket], 1);
+    shard_add(&shard->latency_ns[timer], elapsed);
+}
+
+// Record one table lookup that examined `probes` slots
+static inline void count_hash_probes(unsigned int probes) {
+    if (!metrics_on()) return;
+    MetricsShard* shard = metrics_shard();
+    shard_add(&shard->counters[METRIC_HASH_LOOKUPS], 1);
+    shard_add(&shard->counters[METRIC_HASH_PROBES], probes);
+    shard_add(&shard->probe_lengths[probes < PROBE_HISTOGRAM_SIZE ? probes - 1 : PROBE_HISTOGRAM_SIZE - 1], 1);
+}
+
+static void collect_metrics(MetricsSnapshot* snapshot) {
+    memset(snapshot, 0, sizeof(MetricsSnapshot));
+    pthread_mutex_lock(&metrics_lock);
+    for (MetricsShard* shard = metrics_shards; shard != NULL; shard = shard->next) {
+        for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+            snapshot->counters[i] += atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+        }
+        for (int i = 0; i < PROBE_HISTOGRAM_SIZE; i++) {
+            snapshot->probe_lengths[i] += atomic_load_explicit(&shard->probe_lengths[i], memory_order_relaxed);
+        }
+        for (int t = 0; t < TIMER_COUNT; t++) {
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                snapshot->latency_buckets[t][b] +=
+                    atomic_load_explicit(&shard->latency_buckets[t][b], memory_order_relaxed);
+            }
+            snapshot->latency_ns[t] += atomic_load_explicit(&shard->latency_ns[t], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+    snapshot->uptime = (metrics_now() - metrics_epoch) / 1e9;
+}
+
+// Upper bound of a latency bucket in seconds (2^bucket microseconds)
+static double latency_bucket_bound(int bucket) {
+    return ldexp(1e-6, bucket);
+}
+
+// Upper bound of the bucket holding quantile q; overflows report the last bound
+static double latency_quantile(const uint64_t* buckets, double q) {
+    uint64_t total = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) total += buckets[b];
+    if (total == 0) return 0.0;
+    
+    uint64_t rank = (uint64_t)ceil(q * total);
+    uint64_t seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS - 1; b++) {
+        seen += buckets[b];
+        if (seen >= rank) return latency_bucket_bound(b);
+    }
+    return latency_bucket_bound(LATENCY_BUCKETS - 2);
+}
+
+static void write_metrics_json(FILE* file, const MetricsSnapshot* metrics) {
+    double uptime = metrics->uptime > 0.0 ? metrics->uptime : 1e-9;
+    uint64_t lookups = metrics->counters[METRIC_HASH_LOOKUPS];
+    
+    fprintf(file, "{\n  \"uptime_seconds\": %.6f,\n  \"counters\": {\n", metrics->uptime);
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        fprintf(file, "    \"%s\": %llu%s\n", metric_counter_names[i],
+                (unsigned long long)metrics->counters[i], i + 1 < METRIC_COUNTER_COUNT ? "," : "");
+    }
+    fprintf(file, "  },\n");
+    fprintf(file, "  \"tokens_per_second\": %.1f,\n", metrics->counters[METRIC_TOKENS_READ] / uptime);
+    fprintf(file, "  \"bytes_per_second\": %.1f,\n", metrics->counters[METRIC_BYTES_READ] / uptime);
+    fprintf(file, "  \"mean_probe_length\": %.3f,\n",
+            lookups > 0 ? (double)metrics->counters[METRIC_HASH_PROBES] / lookups : 0.0);
+    fprintf(file, "  \"probe_lengths\": [");
+    for (int i = 0; i < PROBE_HISTOGRAM_SIZE; i++) {
+        fprintf(file, "%s%llu", i > 0 ? ", " : "", (unsigned long long)metrics->probe_lengths[i]);
+    }
+    fprintf(file, "],\n");
+    if (heap_counting_enabled()) {
+        fprintf(file, "  \"heap\": {\"allocations\": %ld, \"bytes\": %ld},\n",
+                heap_allocation_count(), heap_allocated_bytes());
+    } else {
+        fprintf(file, "  \"heap\": null,\n");
+    }
+    fprintf(file, "  \"arena\": {\"allocations\": %ld, \"blocks\": %ld, \"bytes\": %ld},\n",
+            atomic_load(&arena_allocations), atomic_load(&arena_blocks), atomic_load(&arena_bytes));
+    fprintf(file, "  \"peak_rss_kb\": %ld,\n", peak_rss_kb());
+    
+    fprintf(file, "  \"latency_bucket_bounds_seconds\": [");
+    for (int b = 0; b < LATENCY_BUCKETS - 1; b++) {
+        fprintf(file, "%s%g", b > 0 ? ", " : "", latency_bucket_bound(b));
+    }
+    fprintf(file, "],\n  \"stages\": {\n");
+    for (int t = 0; t < TIMER_COUNT; t++) {
+        const uint64_t* buckets = metrics->latency_buckets[t];
+        uint64_t count = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) count += buckets[b];
+        fprintf(file, "    \"%s\": {\"count\": %llu, \"sum_seconds\": %.6f, \"p50_seconds\": %g, "
+                      "\"p90_seconds\": %g, \"p99_seconds\": %g, \"buckets\": [",
+                metric_timer_names[t], (unsigned long long)count, metrics->latency_ns[t] / 1e9,
+                latency_quantile(buckets, 0.5), latency_quantile(buckets, 0.9),
+                latency_quantile(buckets, 0.99));
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            fprintf(file, "%s%llu", b > 0 ? ", " : "", (unsigned long long)buckets[b]);
+        }
+        fprintf(file, "]}%s\n", t + 1 < TIMER_COUNT ? "," : "");
+    }
+    fprintf(file, "  }\n}\n");
+}
+
+static void write_metrics_prometheus(FILE* file, const MetricsSnapshot* metrics) {
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        fprintf(file, "# HELP fods_%s_total %s\n# TYPE fods_%s_total counter\nfods_%s_total %llu\n",
+                metric_counter_names[i], metric_counter_help[i], metric_counter_names[i],
+                metric_counter_names[i], (unsigned long long)metrics->counters[i]);
+    }
+    fprintf(file, "# HELP fods_uptime_seconds Seconds since metrics were enabled\n"
+                  "# TYPE fods_uptime_seconds gauge\nfods_uptime_seconds %.6f\n", metrics->uptime);
+    fprintf(file, "# HELP fods_tokens_per_second Words read per second of uptime\n"
+                  "# TYPE fods_tokens_per_second gauge\nfods_tokens_per_second %.1f\n",
+            metrics->uptime > 0.0 ? metrics->counters[METRIC_TOKENS_READ] / metrics->uptime : 0.0);
+    if (heap_counting_enabled()) {
+        fprintf(file, "# HELP fods_heap_allocations_total Heap allocations\n"
+                      "# TYPE fods_heap_allocations_total counter\nfods_heap_allocations_total %ld\n",
+                heap_allocation_count());
+        fprintf(file, "# HELP fods_heap_allocated_bytes_total Bytes requested from the heap\n"
+                      "# TYPE fods_heap_allocated_bytes_total counter\nfods_heap_allocated_bytes_total %ld\n",
+                heap_allocated_bytes());
+    }
+    fprintf(file, "# HELP fods_arena_allocations_total Allocations served by arenas\n"
+                  "# TYPE fods_arena_allocations_total counter\nfods_arena_allocations_total %ld\n",
+            atomic_load(&arena_allocations));
+    fprintf(file, "# HELP fods_arena_blocks_total Arena blocks allocated\n"
+                  "# TYPE fods_arena_blocks_total counter\nfods_arena_blocks_total %ld\n",
+            atomic_load(&arena_blocks));
+    fprintf(file, "# HELP fods_peak_rss_bytes Peak resident set size\n"
+                  "# TYPE fods_peak_rss_bytes gauge\nfods_peak_rss_bytes %lld\n",
+            (long long)peak_rss_kb() * 1024);
+    
+    fprintf(file, "# HELP fods_hash_probe_length Slots examined per table lookup\n"
+                  "# TYPE fods_hash_probe_length histogram\n");
+    uint64_t cumulative = 0;
+    for (int i = 0; i < PROBE_HISTOGRAM_SIZE - 1; i++) {
+        cumulative += metrics->probe_lengths[i];
+        fprintf(file, "fods_hash_probe_length_bucket{le=\"%d\"} %llu\n", i + 1,
+                (unsigned long long)cumulative);
+    }
+    fprintf(file, "fods_hash_probe_length_bucket{le=\"+Inf\"} %llu\n"
+                  "fods_hash_probe_length_sum %llu\nfods_hash_probe_length_count %llu\n",
+            (unsigned long long)metrics->counters[METRIC_HASH_LOOKUPS],
+            (unsigned long long)metrics->counters[METRIC_HASH_PROBES],
+            (unsigned long long)metrics->counters[METRIC_HASH_LOOKUPS]);
+    
+    fprintf(file, "# HELP fods_stage_duration_seconds Latency of pipeline stages\n"
+                  "# TYPE fods_stage_duration_seconds histogram\n");
+    for (int t = 0; t < TIMER_COUNT; t++) {
+        cumulative = 0;
+        for (int b = 0; b < LATENCY_BUCKETS - 1; b++) {
+            cumulative += metrics->latency_buckets[t][b];
+            fprintf(file, "fods_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                    metric_timer_names[t], latency_bucket_bound(b), (unsigned long long)cumulative);
+        }
+        cumulative += metrics->latency_buckets[t][LATENCY_BUCKETS - 1];
+        fprintf(file, "fods_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+                      "fods_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n"
+                      "fods_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+                metric_timer_names[t], (unsigned long long)cumulative, metric_timer_names[t],
+                metrics->latency_ns[t] / 1e9, metric_timer_names[t], (unsigned long long)cumulative);
+    }
+}
+
+// Write the current metrics to a temporary file and rename it into place, so
+// a collector reading the file never sees half of it
+bool write_metrics(const char* filename, MetricsFormat format) {
+    MetricsSnapshot metrics;
+    collect_metrics(&metrics);
+    
+    size_t length = strlen(filename) + 5;
+    char* temp_file = (char*)malloc(length);
+    if (temp_file == NULL) {
+        fprintf(stderr, "Memory allocation failed for metrics file name\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(temp_file, length, "%s.tmp", filename);
+    
+    FILE* file = fopen(temp_file, "w");
+    bool ok = file != NULL;
+    if (ok) {
+        if (format == METRICS_PROMETHEUS) {
+            write_metrics_prometheus(file, &metrics);
+        } else {
+            write_metrics_json(file, &metrics);
+        }
+        ok = !ferror(file);
+        ok = (fclose(file) == 0) && ok;
+    }
+#ifdef _WIN32
+    // rename() does not replace existing files on Windows
+    if (ok) remove(filename);
+#endif
+    ok = ok && rename(temp_file, filename) == 0;
+    
+    if (!ok) {
+        fprintf(stderr, "Error: Could not write metrics file %s\n", filename);
+        remove(temp_file);
+    }
+    free(temp_file);
+    return ok;
+}
+
+// Periodic metrics dumps during long runs
+static pthread_mutex_t reporter_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reporter_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t reporter_thread;
+static bool reporter_running;
+static bool reporter_stopping;
+static const char* reporter_file;
+static MetricsFormat reporter_format;
+static double reporter_interval;
+
+static void* metrics_reporter_main(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&reporter_lock);
+    while (!reporter_stopping) {
+        struct timespec deadline;
+        timespec_get(&deadline, TIME_UTC);
+        double whole = floor(reporter_interval);
+        deadline.tv_sec += (time_t)whole;
+        deadline.tv_nsec += (long)((reporter_interval - whole) * 1e9);
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        
+        int result = 0;
+        while (!reporter_stopping && result != ETIMEDOUT) {
+            result = pthread_cond_timedwait(&reporter_wake, &reporter_lock, &deadline);
+        }
+        if (reporter_stopping) break;
+        
+        pthread_mutex_unlock(&reporter_lock);
+        write_metrics(reporter_file, reporter_format);
+        pthread_mutex_lock(&reporter_lock);
+    }
+    pthread_mutex_unlock(&reporter_lock);
+    return NULL;
+}
+
+// Rewrite the metrics file every `interval` seconds until stop_metrics_reporter()
+void start_metrics_reporter(const char* filename, MetricsFormat format, double interval) {
+    if (reporter_running || interval <= 0.0) return;
+    reporter_file = filename;
+    reporter_format = format;
+    reporter_interval = interval;
+    reporter_stopping = false;
+    if (pthread_create(&reporter_thread, NULL, metrics_reporter_main, NULL) != 0) {
+        fprintf(stderr, "Note: could not start the metrics reporter; metrics are written at exit only\n");
+        return;
+    }
+    reporter_running = true;
+}
+
+void stop_metrics_reporter() {
+    if (!reporter_running) return;
+    pthread_mutex_lock(&reporter_lock);
+    reporter_stopping = true;
+    pthread_cond_signal(&reporter_wake);
+    pthread_mutex_unlock(&reporter_lock);
+    pthread_join(reporter_thread, NULL);
+    reporter_running = false;
+}
+
+// ==================== TOKEN DICTIONARY ====================
+
+// Process-wide map from each distinct word to a 32-bit ID. A word is stored
+// once however many documents use it; token lists and k-grams hold IDs only.
+// An ID encodes its shard in the low bits and the entry index above them
+// (plus one, so 0 is never a valid ID).
+static DictionaryShard dictionary_shards[DICTIONARY_SHARDS];
+static pthread_once_t dictionary_once = PTHREAD_ONCE_INIT;
+
+static DictionarySlots* create_dictionary_slots(uint32_t mask) {
+    DictionarySlots* table = (DictionarySlots*)calloc(1, sizeof(DictionarySlots) +
+                                                        ((size_t)mask + 1) * sizeof(atomic_uint));
+    if (table == NULL) {
+        fprintf(stderr, "Memory allocation failed for token dictionary\n");
+        exit(EXIT_FAILURE);
+    }
+    table->mask = mask;
+    return table;
+}
+
+static void init_token_dictionary() {
+    for (int i = 0; i < DICTIONARY_SHARDS; i++) {
+        DictionaryShard* shard = &dictionary_shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        atomic_init(&shard->table, create_dictionary_slots(255));
+        shard->count = 0;
+        shard->pages = (DictionaryEntry**)calloc(DICTIONARY_MAX_PAGES, sizeof(DictionaryEntry*));
+        if (shard->pages == NULL) {
+            fprintf(stderr, "Memory allocation failed for token dictionary\n");
+            exit(EXIT_FAILURE);
+        }
+        arena_init(&shard->words);
+    }
+}
+
+static DictionaryEntry* shard_entry(const DictionaryShard* shard, uint32_t index) {
+    return &shard->pages[index / DICTIONARY_PAGE_SIZE][index % DICTIONARY_PAGE_SIZE];
+}
+
+// Entry of an ID returned by intern_token()
+static DictionaryEntry* dictionary_entry(uint32_t id) {
+    uint32_t value = id - 1;
+    return shard_entry(&dictionary_shards[value & (DICTIONARY_SHARDS - 1)],
+                       value >> DICTIONARY_SHARD_BITS);
+}
+
+// Probe a slot table for a word. Returns its entry index + 1, or 0 with
+// *slot set to the empty slot that ended the search.
+static uint32_t dictionary_probe(const DictionaryShard* shard, DictionarySlots* table,
+                                 const char* word, size_t length, uint64_t hash, uint32_t* slot) {
+    uint32_t index = (uint32_t)hash & table->mask;
+    for (;;) {
+        uint32_t value = atomic_load_explicit(&table->slots[index], memory_order_acquire);
+        if (value == 0) {
+            *slot = index;
+            return 0;
+        }
+        const DictionaryEntry* entry = shard_entry(shard, value - 1);
+        if (entry->hash == hash && entry->length == length && memcmp(entry->word, word, length) == 0) {
+            return value;
+        }
+        index = (index + 1) & table->mask;
+    }
+}
+
+// Move a shard to a slot table twice the size (lock held)
+static void dictionary_shard_grow(DictionaryShard* shard) {
+    DictionarySlots* old_table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    DictionarySlots* table = create_dictionary_slots(old_table->mask * 2 + 1);
+    for (uint32_t i = 0; i < shard->count; i++) {
+        uint32_t slot = (uint32_t)shard_entry(shard, i)->hash & table->mask;
+        while (atomic_load_explicit(&table->slots[slot], memory_order_relaxed) != 0) {
+            slot = (slot + 1) & table->mask;
+        }
+        atomic_store_explicit(&table->slots[slot], i + 1, memory_order_relaxed);
+    }
+    table->retired = old_table;
+    atomic_store_explicit(&shard->table, table, memory_order_release);
+}
+
+// ID of a word, adding it on first sight. Safe to call from any thread; the
+// same word always gets the same ID within a run. Words already present are
+// found without locking.
+uint32_t intern_token(const char* word, size_t length) {
+    pthread_once(&dictionary_once, init_token_dictionary);
+    
+    uint64_t hash = token_id_bytes(word, length);
+    uint32_t shard_index = (uint32_t)(hash >> (64 - DICTIONARY_SHARD_BITS));
+    DictionaryShard* shard = &dictionary_shards[shard_index];
+    
+    uint32_t slot = 0;
+    DictionarySlots* table = atomic_load_explicit(&shard->table, memory_order_acquire);
+    uint32_t value = dictionary_probe(shard, table, word, length, hash, &slot);
+    if (value != 0) {
+        return (((value - 1) << DICTIONARY_SHARD_BITS) | shard_index) + 1;
+    }
+    
+    // Not seen yet: look again under the lock, since another thread may be
+    // adding the same word or growing the table
+    pthread_mutex_lock(&shard->lock);
+    table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    value = dictionary_probe(shard, table, word, length, hash, &slot);
+    if (value == 0) {
+        uint32_t index = shard->count;
+        if (index / DICTIONARY_PAGE_SIZE >= DICTIONARY_MAX_PAGES) {
+            fprintf(stderr, "Token dictionary is full\n");
+            exit(EXIT_FAILURE);
+        }
+        DictionaryEntry** page = &shard->pages[index / DICTIONARY_PAGE_SIZE];
+        if (*page == NULL) {
+            *page = (DictionaryEntry*)malloc(DICTIONARY_PAGE_SIZE * sizeof(DictionaryEntry));
+            if (*page == NULL) {
+                fprintf(stderr, "Memory allocation failed for token dictionary\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        DictionaryEntry* entry = &(*page)[index % DICTIONARY_PAGE_SIZE];
+        entry->word = arena_strndup(&shard->words, word, length);
+        entry->hash = hash;
+        entry->length = (uint32_t)length;
+        atomic_init(&entry->normalized, 0);
+        
+        // Publishing the slot makes the finished entry visible to lookups
+        value = index + 1;
+        atomic_store_explicit(&table->slots[slot], value, memory_order_release);
+        shard->count++;
+        
+        // Keep the load factor at most 0.5
+        if (shard->count * 2 > table->mask + 1) {
+            dictionary_shard_grow(shard);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return (((value - 1) << DICTIONARY_SHARD_BITS) | shard_index) + 1;
+}
+
+// Word of a token ID (owned by the dictionary, valid for the whole run)
+const char* token_text(uint32_t id) {
+    return dictionary_entry(id)->word;
+}
+
+// 64-bit hash of a token's word, as token_id() computes it
+uint64_t token_hash(uint32_t id) {
+    return dictionary_entry(id)->hash;
+}
+
+// ID of the normalized form of an entry's word, interned or, for a reader
+// with private tokens, looked up
+static uint32_t normalize_entry_word(const DictionaryEntry* entry, DocumentReader* reader) {
+    size_t length = entry->length;
+    char stack_buffer[MAX_WORD_LENGTH];
+    char* word = length < sizeof(stack_buffer) ? stack_buffer : (char*)malloc(length + 1);
+    if (word == NULL) {
+        fprintf(stderr, "Memory allocation failed for token\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(word, entry->word, length + 1);
+    normalize_token(word);
+    
+    uint32_t normalized = reader != NULL ? reader_token(reader, word, strlen(word)) :
+                                           intern_token(word, strlen(word));
+    if (word != stack_buffer) free(word);
+    return normalized;
+}
+
+// ID of the word normalize_token() makes of a token (possibly the empty
+// word). Each distinct word is normalized once per run.
+uint32_t normalized_token(uint32_t id) {
+    DictionaryEntry* entry = dictionary_entry(id);
+    uint32_t normalized = atomic_load_explicit(&entry->normalized, memory_order_acquire);
+    if (normalized != 0) return normalized;
+    
+    // Racing threads compute the same ID, so either store wins
+    normalized = normalize_entry_word(entry, NULL);
+    atomic_store_explicit(&entry->normalized, normalized, memory_order_release);
+    return normalized;
+}
+
+// Number of distinct words interned so far
+int token_dictionary_count() {
+    pthread_once(&dictionary_once, init_token_dictionary);
+    long count = 0;
+    for (int i = 0; i < DICTIONARY_SHARDS; i++) {
+        pthread_mutex_lock(&dictionary_shards[i].lock);
+        count += dictionary_shards[i].count;
+        pthread_mutex_unlock(&dictionary_shards[i].lock);
+    }
+    return (int)count;
+}
+
+// ID of a word that is already in the dictionary, or 0. Never adds it.
+uint32_t lookup_token(const char* word, size_t length) {
+    pthread_once(&dictionary_once, init_token_dictionary);
+    
+    uint64_t hash = token_id_bytes(word, length);
+    uint32_t shard_index = (uint32_t)(hash >> (64 - DICTIONARY_SHARD_BITS));
+    DictionaryShard* shard = &dictionary_shards[shard_index];
+    uint32_t slot = 0;
+    DictionarySlots* table = atomic_load_explicit(&shard->table, memory_order_acquire);
+    uint32_t value = dictionary_probe(shard, table, word, length, hash, &slot);
+    return value != 0 ? (((value - 1) << DICTIONARY_SHARD_BITS) | shard_index) + 1 : 0;
+}
+
+static PrivateTokens* create_private_tokens() {
+    PrivateTokens* tokens = (PrivateTokens*)calloc(1, sizeof(PrivateTokens));
+    if (tokens != NULL) {
+        tokens->mask = 255;
+        tokens->slots = (uint32_t*)calloc(tokens->mask + 1, sizeof(uint32_t));
+    }
+    if (tokens == NULL || tokens->slots == NULL) {
+        fprintf(stderr, "Memory allocation failed for private tokens\n");
+        exit(EXIT_FAILURE);
+    }
+    arena_init(&tokens->words);
+    return tokens;
+}
+
+static void free_private_tokens(PrivateTokens* tokens) {
+    if (tokens == NULL) return;
+    free(tokens->entries);
+    free(tokens->slots);
+    arena_release(&tokens->words);
+    free(tokens);
+}
+
+static DictionaryEntry* private_entry(const PrivateTokens* tokens, uint32_t id) {
+    return &tokens->entries[(id & ~PRIVATE_TOKEN_BIT) - 1];
+}
+
+// Private ID of a word, adding it to the reader's table on first sight
+static uint32_t private_token(PrivateTokens* tokens, const char* word, size_t length) {
+    uint64_t hash = token_id_bytes(word, length);
+    uint32_t slot = (uint32_t)hash & tokens->mask;
+    while (tokens->slots[slot] != 0) {
+        const DictionaryEntry* entry = &tokens->entries[tokens->slots[slot] - 1];
+        if (entry->hash == hash && entry->length == length && memcmp(entry->word, word, length) == 0) {
+            return tokens->slots[slot] | PRIVATE_TOKEN_BIT;
+        }
+        slot = (slot + 1) & tokens->mask;
+    }
+    
+    if (tokens->count == tokens->capacity) {
+        tokens->capacity = tokens->capacity == 0 ? INITIAL_TOKEN_CAPACITY : tokens->capacity * 2;
+        tokens->entries = (DictionaryEntry*)realloc(tokens->entries,
+                                                    tokens->capacity * sizeof(DictionaryEntry));
+        if (tokens->entries == NULL) {
+            fprintf(stderr, "Memory allocation failed for private tokens\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    DictionaryEntry* entry = &tokens->entries[tokens->count];
+    entry->word = arena_strndup(&tokens->words, word, length);
+    entry->hash = hash;
+    entry->length = (uint32_t)length;
+    atomic_init(&entry->normalized, 0);
+    uint32_t value = ++tokens->count;
+    tokens->slots[slot] = value;
+    
+    // Keep the load factor at most 0.5
+    if (tokens->count * 2 > tokens->mask + 1) {
+        uint32_t mask = tokens->mask * 2 + 1;
+        uint32_t* slots = (uint32_t*)calloc((size_t)mask + 1, sizeof(uint32_t));
+        if (slots == NULL) {
+            fprintf(stderr, "Memory allocation failed for private tokens\n");
+            exit(EXIT_FAILURE);
+        }
+        for (uint32_t i = 0; i < tokens->count; i++) {
+            uint32_t home = (uint32_t)tokens->entries[i].hash & mask;
+            while (slots[home] != 0) home = (home + 1) & mask;
+            slots[home] = i + 1;
+        }
+        free(tokens->slots);
+        tokens->slots = slots;
+        tokens->mask = mask;
+    }
+    return value | PRIVATE_TOKEN_BIT;
+}
+
+// Keep words the dictionary does not know in the reader instead of interning
+// them, so that documents read by a long-running process (server targets) do
+// not grow the dictionary. Their k-grams cannot match any dictionary word's,
+// which is exactly what interning them would give against the references.
+void use_private_tokens(DocumentReader* reader) {
+    if (reader->private_tokens == NULL) {
+        reader->private_tokens = create_private_tokens();
+    }
+}
+
+// ID of a word of a reader's document
+uint32_t reader_token(DocumentReader* reader, const char* word, size_t length) {
+    if (reader->private_tokens == NULL) return intern_token(word, length);
+    uint32_t id = lookup_token(word, length);
+    return id != 0 ? id : private_token(reader->private_tokens, word, length);
+}
+
+// token_text() that also knows the reader's private words
+const char* reader_token_text(const DocumentReader* reader, uint32_t id) {
+    if (id & PRIVATE_TOKEN_BIT) return private_entry(reader->private_tokens, id)->word;
+    return token_text(id);
+}
+
+// token_hash() that also knows the reader's private words
+uint64_t reader_token_hash(const DocumentReader* reader, uint32_t id) {
+    if (id & PRIVATE_TOKEN_BIT) return private_entry(reader->private_tokens, id)->hash;
+    return token_hash(id);
+}
+
+// normalized_token() that keeps new normalized words private as well
+uint32_t reader_normalized_token(DocumentReader* reader, uint32_t id) {
+    if (reader->private_tokens == NULL) return normalized_token(id);
+    
+    bool private_word = (id & PRIVATE_TOKEN_BIT) != 0;
+    DictionaryEntry* entry = private_word ? private_entry(reader->private_tokens, id) : dictionary_entry(id);
+    uint32_t normalized = atomic_load_explicit(&entry->normalized, memory_order_acquire);
+    if (normalized != 0) return normalized;
+    
+    normalized = normalize_entry_word(entry, reader);
+    if (private_word) {
+        // Adding the normalized word may have moved the entries
+        atomic_store_explicit(&private_entry(reader->private_tokens, id)->normalized, normalized,
+                              memory_order_relaxed);
+    } else if (!(normalized & PRIVATE_TOKEN_BIT)) {
+        atomic_store_explicit(&entry->normalized, normalized, memory_order_release);
+    }
+    return normalized;
+}
+
+// ==================== MEMBER 1 FUNCTIONS (EXISTING) ====================
+
+// Create a new DocumentReader instance
+DocumentReader* create_document_reader() {
+    DocumentReader* reader = (DocumentReader*)malloc(sizeof(DocumentReader));
+    if (reader == NULL) {
+        fprintf(stderr, "Memory allocation failed for DocumentReader\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    reader->filename = NULL;
+    reader->token_list.ids = NULL;
+    reader->token_list.starts = NULL;
+    reader->token_list.ends = NULL;
+    reader->token_list.count = 0;
+    reader->token_list.capacity = 0;
+    reader->kgram_list.ids = NULL;
+    arena_init(&reader->kgram_arena);
+    reader->kgram_list.count = 0;
+    reader->kgram_list.k_value = 0;
+    reader->kgram_hash = NULL;
+    reader->kgram_hashes.hashes = NULL;
+    reader->kgram_hashes.count = 0;
+    reader->kgram_hashes.k_value = 0;
+    reader->fingerprint_set = NULL;
+    reader->winnow.hashes = NULL;
+    reader->winnow.positions = NULL;
+    reader->winnow.count = 0;
+    reader->winnow.window = 0;
+    reader->winnow_set = NULL;
+    reader->minhash = NULL;
+    reader->stopwords = NULL;
+    reader->streamed = false;
+    reader->compressed = NULL;
+    reader->compact = false;
+    reader->private_tokens = NULL;
+    
+    return reader;
+}
+
+// Hash function for stopword lookups (FNV-1a)
+static unsigned int stopword_hash(const char* word) {
+    unsigned int hash = 2166136261u;
+    while (*word) {
+        hash ^= (unsigned char)*word++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Load stopwords from file into an immutable open-addressing hash set
+StopwordSet* load_stopwords(const char* stopwords_file) {
+    FILE* file = fopen(stopwords_file, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open stopwords file %s\n", stopwords_file);
+        return NULL;
+    }
+    
+    StopwordSet* set = (StopwordSet*)calloc(1, sizeof(StopwordSet));
+    if (set == NULL) {
+        fprintf(stderr, "Memory allocation failed for StopwordSet\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    // First pass: pack every word into one buffer
+    size_t used = 0, capacity = 4096;
+    int word_count = 0;
+    set->words = (char*)malloc(capacity);
+    if (set->words == NULL) {
+        fprintf(stderr, "Memory allocation failed for stopwords\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    char word[MAX_WORD_LENGTH];
+    while (fscanf(file, "%99s", word) == 1) {
         // Convert to lowercase
-        to_lowercase(token);
+        to_lowercase(word);
+        
+        size_t length = strlen(word) + 1;
+        if (used + length > capacity) {
+            capacity *= 2;
+            set->words = (char*)realloc(set->words, capacity);
+            if (set->words == NULL) {
+                fprintf(stderr, "Memory allocation failed for stopwords\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(set->words + used, word, length);
+        used += length;
+        word_count++;
+    }
+    fclose(file);
+    
+    // Size the table for a load factor of at most 0.5
+    unsigned int table_size = 16;
+    while (table_size < (unsigned int)word_count * 2) {
+        table_size *= 2;
+    }
+    set->mask = table_size - 1;
+    set->slots = (const char**)calloc(table_size, sizeof(char*));
+    set->hashes = (unsigned int*)calloc(table_size, sizeof(unsigned int));
+    if (set->slots == NULL || set->hashes == NULL) {
+        fprintf(stderr, "Memory allocation failed for stopword table\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    // Second pass: insert each packed word (duplicates are skipped)
+    const char* current = set->words;
+    for (int i = 0; i < word_count; i++) {
+        if (!stopword_set_contains(set, current)) {
+            unsigned int hash = stopword_hash(current);
+            unsigned int index = hash & set->mask;
+            while (set->slots[index] != NULL) {
+                index = (index + 1) & set->mask;
+            }
+            set->slots[index] = current;
+            set->hashes[index] = hash;
+            set->count++;
+        }
+        current += strlen(current) + 1;
+    }
+    
+    printf("Loaded %d stopwords\n", set->count);
+    return set;
+}
+
+// Check whether a word is in the stopword set (O(1) expected)
+bool stopword_set_contains(const StopwordSet* set, const char* word) {
+    if (set == NULL || word == NULL) return false;
+    
+    unsigned int hash = stopword_hash(word);
+    unsigned int index = hash & set->mask;
+    
+    while (set->slots[index] != NULL) {
+        if (set->hashes[index] == hash && strcmp(set->slots[index], word) == 0) {
+            return true;
+        }
+        index = (index + 1) & set->mask;
+    }
+    return false;
+}
+
+// Free a stopword set (only after every reader using it is done)
+void free_stopword_set(StopwordSet* set) {
+    if (set == NULL) return;
+    free(set->slots);
+    free(set->hashes);
+    free(set->words);
+    free(set);
+}
+
+// Attach a shared stopword set to a reader
+void set_stopwords(DocumentReader* reader, const StopwordSet* stopwords) {
+    if (reader == NULL) return;
+    reader->stopwords = stopwords;
+}
+
+// Free all tokens of a reader and start an empty token list
+static void reset_token_list(DocumentReader* reader) {
+    free(reader->token_list.ids);
+    free(reader->token_list.starts);
+    free(reader->token_list.ends);
+    reader->token_list.ids = NULL;
+    reader->token_list.starts = NULL;
+    reader->token_list.ends = NULL;
+    reader->token_list.count = 0;
+    reader->token_list.capacity = 0;
+    reader->streamed = false;
+}
+
+// Append a token's dictionary ID and byte range, growing the arrays as needed
+static void append_token(DocumentReader* reader, const char* token, size_t length,
+                         int64_t start, int64_t end) {
+    TokenList* list = &reader->token_list;
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity == 0 ? INITIAL_TOKEN_CAPACITY : list->capacity * 2;
+        list->ids = (uint32_t*)realloc(list->ids, list->capacity * sizeof(uint32_t));
+        list->starts = (int64_t*)realloc(list->starts, list->capacity * sizeof(int64_t));
+        list->ends = (int64_t*)realloc(list->ends, list->capacity * sizeof(int64_t));
+        if (list->ids == NULL || list->starts == NULL || list->ends == NULL) {
+            fprintf(stderr, "Memory allocation failed for tokens\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    list->starts[list->count] = start;
+    list->ends[list->count] = end;
+    list->ids[list->count++] = reader_token(reader, token, length);
+}
+
+// Read document from file, one chunk at a time (no whole-file copy, no token limit)
+void read_document(DocumentReader* reader, const char* filename) {
+    uint64_t timer = metrics_timer_start();
+    TokenStream* stream = (TokenStream*)malloc(sizeof(TokenStream));
+    if (stream == NULL) {
+        fprintf(stderr, "Memory allocation failed for TokenStream\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!open_token_stream(stream, filename)) {
+        fprintf(stderr, "Error: Could not open file %s\n", filename);
+        free(stream);
+        return;
+    }
+    
+    // Free previous filename if exists
+    if (reader->filename != NULL) {
+        free(reader->filename);
+    }
+    
+    // Store filename
+    reader->filename = strdup(filename);
+    
+    // Tokenize the text as it streams in
+    reset_token_list(reader);
+    const char* token;
+    while ((token = next_raw_token(stream)) != NULL) {
+        append_token(reader, token, strlen(token), stream->token_start, stream->token_end);
+    }
+    metrics_add(METRIC_DOCUMENTS_READ, 1);
+    metrics_add(METRIC_BYTES_READ, (uint64_t)stream->next_offset);
+    metrics_add(METRIC_TOKENS_READ, (uint64_t)reader->token_list.count);
+    
+    close_token_stream(stream);
+    free(stream);
+    metrics_timer_stop(TIMER_READ, timer);
+    log_progress("Read %d words from %s\n", reader->token_list.count, filename);
+}
+
+// Open a file for chunked tokenization
+bool open_token_stream(TokenStream* stream, const char* filename) {
+    stream->file = fopen(filename, "rb");  // Binary, so offsets are file bytes
+    if (stream->file == NULL) return false;
+    
+    stream->length = 0;
+    stream->position = 0;
+    stream->buffer_offset = 0;
+    stream->next_offset = 0;
+    stream->normalize = false;
+    stream->token_capacity = MAX_WORD_LENGTH;
+    stream->token = (char*)malloc(stream->token_capacity);
+    if (stream->token == NULL) {
+        fprintf(stderr, "Memory allocation failed for token buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    return true;
+}
+
+// Refill the chunk buffer; false at end of file
+static bool token_stream_refill(TokenStream* stream) {
+    stream->position = 0;
+    do {
+        stream->length = fread(stream->buffer, 1, READ_CHUNK_SIZE, stream->file);
+        if (stream->length == 0) return false;
+        stream->buffer_offset = stream->next_offset;
+        stream->next_offset += stream->length;
+        if (stream->normalize) {
+            // A chunk can normalize to nothing (all digits, say); read on
+            stream->length = normalize_buffer(stream->buffer, stream->length);
+        }
+    } while (stream->length == 0);
+    return true;
+}
+
+static bool is_token_delimiter(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Next whitespace-separated token (NULL at end of file). The returned string
+// is owned by the stream and valid until the next call. Tokens may span chunks.
+const char* next_raw_token(TokenStream* stream) {
+    // Skip delimiters
+    for (;;) {
+        if (stream->position == stream->length && !token_stream_refill(stream)) {
+            return NULL;
+        }
+        if (!is_token_delimiter(stream->buffer[stream->position])) break;
+        stream->position++;
+    }
+    
+    // Copy bytes up to the next delimiter, refilling as needed
+    stream->token_start = stream->buffer_offset + (int64_t)stream->position;
+    size_t token_length = 0;
+    for (;;) {
+        size_t start = stream->position;
+        while (stream->position < stream->length &&
+               !is_token_delimiter(stream->buffer[stream->position])) {
+            stream->position++;
+        }
+        
+        size_t span = stream->position - start;
+        if (token_length + span + 1 > stream->token_capacity) {
+            while (token_length + span + 1 > stream->token_capacity) {
+                stream->token_capacity *= 2;
+            }
+            stream->token = (char*)realloc(stream->token, stream->token_capacity);
+            if (stream->token == NULL) {
+                fprintf(stderr, "Memory allocation failed for token buffer\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(stream->token + token_length, stream->buffer + start, span);
+        token_length += span;
+        stream->token_end = stream->buffer_offset + (int64_t)stream->position;
+        
+        if (stream->position < stream->length || !token_stream_refill(stream)) break;
+    }
+    
+    stream->token[token_length] = '\0';
+    return stream->token;
+}
+
+// Close a token stream
+void close_token_stream(TokenStream* stream) {
+    if (stream->file != NULL) fclose(stream->file);
+    free(stream->token);
+    stream->file = NULL;
+    stream->token = NULL;
+}
+
+// Preprocess text: lowercase, remove punctuation/numbers, remove stopwords
+void preprocess_text(DocumentReader* reader) {
+    if (reader->streamed) return;  // Already normalized and fingerprinted
+    
+    uint64_t timer = metrics_timer_start();
+    int write_index = 0;
+    
+    for (int i = 0; i < reader->token_list.count; i++) {
+        // Convert to lowercase, remove punctuation and numbers (cached per
+        // distinct word by the dictionary)
+        uint32_t id = reader_normalized_token(reader, reader->token_list.ids[i]);
+        const char* token = reader_token_text(reader, id);
+        
+        // Drop empty tokens and stopwords
+        if (token[0] == '\0' || is_stopword(reader, token)) {
+            continue;
+        }
+        
+        // Keep the token and its position in the file
+        reader->token_list.ids[write_index] = id;
+        reader->token_list.starts[write_index] = reader->token_list.starts[i];
+        reader->token_list.ends[write_index] = reader->token_list.ends[i];
+        write_index++;
+    }
+    
+    // Update token count
+    reader->token_list.count = write_index;
+    metrics_add(METRIC_TOKENS_KEPT, (uint64_t)write_index);
+    metrics_timer_stop(TIMER_PREPROCESS, timer);
+    log_progress("After preprocessing: %d tokens remaining\n", write_index);
+}
+
+// Lowercase a token and strip everything but letters and apostrophes in a
+// single pass. ASCII rules, so the result matches to_lowercase() followed by
+// remove_punctuation_numbers() in the C locale without calling into it.
+void normalize_token(char* token) {
+    size_t write_index = 0;
+    for (size_t read_index = 0; token[read_index]; read_index++) {
+        unsigned char c = (unsigned char)token[read_index];
+        unsigned char lower = c | 0x20;
+        if ((unsigned char)(lower - 'a') < 26) {
+            token[write_index++] = (char)lower;
+        } else if (c == '\'') {
+            token[write_index++] = (char)c;
+        }
+    }
+    token[write_index] = '\0';
+}
+
+// Convert string to lowercase
+void to_lowercase(char* str) {
+    for (int i = 0; str[i]; i++) {
+        str[i] = tolower(str[i]);
+    }
+}
+
+// Remove punctuation and numbers from string
+void remove_punctuation_numbers(char* str) {
+    int read_index = 0, write_index = 0;
+    
+    while (str[read_index]) {
+        if (isalpha(str[read_index]) || str[read_index] == '\'') {
+            str[write_index] = str[read_index];
+            write_index++;
+        }
+        read_index++;
+    }
+    
+    str[write_index] = '\0';
+}
+
+// Check if a word is a stopword (hash set lookup)
+bool is_stopword(DocumentReader* reader, const char* word) {
+    return stopword_set_contains(reader->stopwords, word);
+}
+
+// Tokenize text into words
+void tokenize_text(DocumentReader* reader, const char* text) {
+    // Free previous tokens if any
+    reset_token_list(reader);
+    
+    // Tokenize using whitespace as delimiter (no strtok, so readers can run in parallel)
+    const char* delimiters = " \t\n\r";
+    const char* current = text + strspn(text, delimiters);
+    while (*current != '\0') {
+        size_t length = strcspn(current, delimiters);
+        append_token(reader, current, length, current - text, current - text + length);
+        current += length;
+        current += strspn(current, delimiters);
+    }
+}
+
+// Print all tokens (for testing purposes)
+void print_tokens(DocumentReader* reader) {
+    for (int i = 0; i < reader->token_list.count; i++) {
+        printf("%s ", reader_token_text(reader, reader->token_list.ids[i]));
+        if ((i + 1) % 10 == 0) printf("\n");
+    }
+    printf("\n");
+}
+
+// Export tokens to file for other team members
+void export_tokens(DocumentReader* reader, const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not create file %s\n", filename);
+        return;
+    }
+    
+    for (int i = 0; i < reader->token_list.count; i++) {
+        fprintf(file, "%s\n", reader_token_text(reader, reader->token_list.ids[i]));
+    }
+    
+    fclose(file);
+    printf("Tokens exported to %s\n", filename);
+}
+
+// ==================== TEXT NORMALIZATION ====================
+
+// Whole-buffer form of normalize_token(): letters are lowercased, apostrophes
+// and the token delimiters (space, tab, newline, carriage return) are kept,
+// every other byte is dropped and the rest is compacted in place. Splitting
+// the result on whitespace gives the same non-empty tokens as splitting first
+// and normalizing each token.
+size_t normalize_buffer_scalar(char* buffer, size_t length) {
+    size_t write_index = 0;
+    for (size_t read_index = 0; read_index < length; read_index++) {
+        unsigned char c = (unsigned char)buffer[read_index];
+        unsigned char lower = c | 0x20;
+        if ((unsigned char)(lower - 'a') < 26) {
+            buffer[write_index++] = (char)lower;
+        } else if (c == '\'' || c == ' ' || c == '\n' || c == '\t' || c == '\r') {
+            buffer[write_index++] = (char)c;
+        }
+    }
+    return write_index;
+}
+
+#ifdef NORMALIZE_SSE2
+// 16 bytes at a time. Blocks where every byte is kept (most prose) are stored
+// whole; the others are compacted using the keep mask. Writing never passes the
+// block being read, so the buffer can be normalized in place.
+size_t normalize_buffer_sse2(char* buffer, size_t length) {
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i letter_a = _mm_set1_epi8('a');
+    const __m128i letter_span = _mm_set1_epi8(25);
+    size_t read_index = 0, write_index = 0;
+    
+    for (; read_index + 16 <= length; read_index += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(buffer + read_index));
+        __m128i lower = _mm_or_si128(bytes, case_bit);
+        __m128i offset = _mm_sub_epi8(lower, letter_a);
+        __m128i letter = _mm_cmpeq_epi8(_mm_min_epu8(offset, letter_span), offset);
+        __m128i keep = _mm_or_si128(
+            _mm_or_si128(letter, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\''))),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')),
+                                      _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n'))),
+                         _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t')),
+                                      _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\r')))));
+        __m128i out = _mm_or_si128(_mm_and_si128(letter, lower), _mm_andnot_si128(letter, bytes));
+        
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(keep);
+        if (mask == 0xFFFF) {
+            _mm_storeu_si128((__m128i*)(buffer + write_index), out);
+            write_index += 16;
+            continue;
+        }
+        
+        char block[16];
+        _mm_storeu_si128((__m128i*)block, out);
+        while (mask != 0) {
+            buffer[write_index++] = block[__builtin_ctz(mask)];
+            mask &= mask - 1;
+        }
+    }
+    
+    // Tail shorter than a block
+    if (read_index < length) {
+        size_t tail = normalize_buffer_scalar(buffer + read_index, length - read_index);
+        memmove(buffer + write_index, buffer + read_index, tail);
+        write_index += tail;
+    }
+    return write_index;
+}
+#endif
+
+#ifdef NORMALIZE_AVX2
+// Same as the SSE2 kernel, 32 bytes at a time
+__attribute__((target("avx2")))
+size_t normalize_buffer_avx2(char* buffer, size_t length) {
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    const __m256i letter_a = _mm256_set1_epi8('a');
+    const __m256i letter_span = _mm256_set1_epi8(25);
+    size_t read_index = 0, write_index = 0;
+    
+    for (; read_index + 32 <= length; read_index += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)(buffer + read_index));
+        __m256i lower = _mm256_or_si256(bytes, case_bit);
+        __m256i offset = _mm256_sub_epi8(lower, letter_a);
+        __m256i letter = _mm256_cmpeq_epi8(_mm256_min_epu8(offset, letter_span), offset);
+        __m256i keep = _mm256_or_si256(
+            _mm256_or_si256(letter, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\''))),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')),
+                                            _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n'))),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\t')),
+                                            _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\r')))));
+        __m256i out = _mm256_blendv_epi8(bytes, lower, letter);
+        
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(keep);
+        if (mask == 0xFFFFFFFFu) {
+            _mm256_storeu_si256((__m256i*)(buffer + write_index), out);
+            write_index += 32;
+            continue;
+        }
+        
+        char block[32];
+        _mm256_storeu_si256((__m256i*)block, out);
+        while (mask != 0) {
+            buffer[write_index++] = block[__builtin_ctz(mask)];
+            mask &= mask - 1;
+        }
+    }
+    
+    if (read_index < length) {
+        size_t tail = normalize_buffer_scalar(buffer + read_index, length - read_index);
+        memmove(buffer + write_index, buffer + read_index, tail);
+        write_index += tail;
+    }
+    return write_index;
+}
+#endif
+
+// Fastest kernel this CPU supports
+NormalizeKernel select_normalize_kernel(const char** name) {
+#ifdef NORMALIZE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        if (name != NULL) *name = "avx2";
+        return normalize_buffer_avx2;
+    }
+#endif
+#ifdef NORMALIZE_SSE2
+    if (name != NULL) *name = "sse2";
+    return normalize_buffer_sse2;
+#else
+    if (name != NULL) *name = "scalar";
+    return normalize_buffer_scalar;
+#endif
+}
+
+static NormalizeKernel normalize_kernel;
+static pthread_once_t normalize_kernel_once = PTHREAD_ONCE_INIT;
+
+static void init_normalize_kernel() {
+    normalize_kernel = select_normalize_kernel(NULL);
+}
+
+// Normalize a buffer in place with the best available kernel; returns the new length
+size_t normalize_buffer(char* buffer, size_t length) {
+    pthread_once(&normalize_kernel_once, init_normalize_kernel);
+    return normalize_kernel(buffer, length);
+}
+
+// ==================== MEMBER 2 FUNCTIONS (EXISTING) ====================
+
+// Generate k-grams using sliding window technique
+void generate_kgrams(DocumentReader* reader, int k) {
+    if (k <= 0 || k > reader->token_list.count) {
+        fprintf(stderr, "Error: Invalid k value %d for token count %d\n", 
+                k, reader->token_list.count);
+        return;
+    }
+    
+    uint64_t timer = metrics_timer_start();
+    
+    // Free previous k-grams if any
+    free(reader->kgram_list.ids);
+    reader->kgram_list.ids = NULL;
+    
+    if (reader->kgram_hash != NULL) {
+        free_hash_table(reader->kgram_hash);
+        reader->kgram_hash = NULL;
+    }
+    arena_release(&reader->kgram_arena);
+    
+    // Calculate number of k-grams
+    int num_kgrams = reader->token_list.count - k + 1;
+    if (num_kgrams <= 0) {
+        reader->kgram_list.count = 0;
+        return;
+    }
+    
+    // Allocate memory for k-grams (k token IDs each)
+    reader->kgram_list.ids = (uint32_t*)malloc((size_t)num_kgrams * k * sizeof(uint32_t));
+    if (reader->kgram_list.ids == NULL) {
+        fprintf(stderr, "Memory allocation failed for k-grams\n");
+        return;
+    }
+    
+    reader->kgram_list.count = 0;
+    reader->kgram_list.k_value = k;
+    
+    // Create hash table for efficient storage, sized for every k-gram being unique
+    reader->kgram_hash = create_arena_hash_table(num_kgrams, k, &reader->kgram_arena);
+    
+    // Generate k-grams using sliding window
+    for (int i = 0; i < num_kgrams; i++) {
+        // Copy the window's token IDs into the k-gram array
+        uint32_t* kgram = reader->kgram_list.ids + (size_t)i * k;
+        memcpy(kgram, reader->token_list.ids + i, k * sizeof(uint32_t));
+        reader->kgram_list.count++;
+        
+        // Store k-gram in hash table (manages duplicates)
+        hash_table_insert(reader->kgram_hash, kgram);
+    }
+    hash_table_sort_hashes(reader->kgram_hash);
+    metrics_add(METRIC_KGRAMS, (uint64_t)reader->kgram_list.count);
+    metrics_timer_stop(TIMER_KGRAMS, timer);
+    
+    log_progress("Generated %d k-grams with k=%d\n", reader->kgram_list.count, k);
+    log_progress("Unique k-grams in hash table: %d\n", reader->kgram_hash->count);
+}
+
+// Create a hash table able to hold `size` k-grams of k tokens before it has to grow
+HashTable* create_hash_table(int size, int k) {
+    HashTable* ht = (HashTable*)malloc(sizeof(HashTable));
+    if (ht == NULL) return NULL;
+    
+    int capacity = 16;
+    while (capacity * HASH_TABLE_MAX_LOAD < size) {
+        capacity *= 2;
+    }
+    
+    ht->entries = (HashEntry*)calloc(capacity, sizeof(HashEntry));
+    if (ht->entries == NULL) {
+        free(ht);
+        return NULL;
+    }
+    
+    ht->size = capacity;
+    ht->count = 0;
+    ht->k_value = k;
+    ht->arena = NULL;
+    ht->sorted_hashes = NULL;
+    return ht;
+}
+
+// Create a hash table whose k-gram copies are allocated from `arena`, which
+// must outlive the table
+HashTable* create_arena_hash_table(int size, int k, Arena* arena) {
+    HashTable* ht = create_hash_table(size, k);
+    if (ht != NULL) ht->arena = arena;
+    return ht;
+}
+
+// Hash function for k-grams (polynomial over the token IDs, mixed so the
+// low bits index well)
+uint64_t hash_function(const uint32_t* kgram, int k) {
+    uint64_t hash = 5381;
+    for (int j = 0; j < k; j++) {
+        hash = hash * ROLLING_HASH_BASE + kgram[j];
+    }
+    
+    hash = mix64(hash);
+    return hash == 0 ? 1 : hash;  // 0 is reserved for empty slots
+}
+
+// Distance of a slot from the home slot of the entry stored in it
+static unsigned int probe_distance(const HashTable* ht, unsigned int index, uint64_t hash) {
+    return (index - (unsigned int)hash) & (ht->size - 1);
+}
+
+// Robin Hood placement: an entry further from home takes the slot of a closer one
+static void hash_table_place(HashTable* ht, HashEntry entry) {
+    unsigned int mask = ht->size - 1;
+    unsigned int index = (unsigned int)entry.hash & mask;
+    unsigned int distance = 0;
+    
+    for (;;) {
+        HashEntry* slot = &ht->entries[index];
+        if (slot->hash == 0) {
+            *slot = entry;
+            return;
+        }
+        
+        unsigned int slot_distance = probe_distance(ht, index, slot->hash);
+        if (slot_distance < distance) {
+            HashEntry displaced = *slot;
+            *slot = entry;
+            entry = displaced;
+            distance = slot_distance;
+        }
+        
+        index = (index + 1) & mask;
+        distance++;
+    }
+}
+
+// Double the capacity and re-place every entry (hashes are stored, not recomputed)
+static void hash_table_grow(HashTable* ht) {
+    HashEntry* old_entries = ht->entries;
+    int old_size = ht->size;
+    
+    ht->size = old_size * 2;
+    ht->entries = (HashEntry*)calloc(ht->size, sizeof(HashEntry));
+    if (ht->entries == NULL) {
+        fprintf(stderr, "Memory allocation failed for hash table\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int i = 0; i < old_size; i++) {
+        if (old_entries[i].hash != 0) {
+            hash_table_place(ht, old_entries[i]);
+        }
+    }
+    free(old_entries);
+}
+
+// Find the entry for a k-gram whose hash is already known (NULL when absent)
+HashEntry* hash_table_find(HashTable* ht, const uint32_t* kgram, uint64_t hash) {
+    unsigned int mask = ht->size - 1;
+    unsigned int index = (unsigned int)hash & mask;
+    
+    for (unsigned int distance = 0; ; distance++) {
+        HashEntry* slot = &ht->entries[index];
+        
+        // An empty slot, or one closer to home than we are, ends the search
+        if (slot->hash == 0 || probe_distance(ht, index, slot->hash) < distance) {
+            count_hash_probes(distance + 1);
+            return NULL;
+        }
+        if (slot->hash == hash && memcmp(slot->kgram, kgram, ht->k_value * sizeof(uint32_t)) == 0) {
+            count_hash_probes(distance + 1);
+            return slot;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+// Insert a k-gram into hash table (handles duplicates)
+void hash_table_insert(HashTable* ht, const uint32_t* kgram) {
+    if (ht == NULL || kgram == NULL) return;
+    
+    uint64_t hash = hash_function(kgram, ht->k_value);
+    
+    // Check if k-gram already exists
+    HashEntry* existing = hash_table_find(ht, kgram, hash);
+    if (existing != NULL) {
+        existing->count++; // Increment count for duplicate
+        return;
+    }
+    
+    if (ht->count + 1 > ht->size * HASH_TABLE_MAX_LOAD) {
+        hash_table_grow(ht);
+    }
+    if (ht->sorted_hashes != NULL) {
+        free(ht->sorted_hashes);  // A new k-gram makes the sorted copy stale
+        ht->sorted_hashes = NULL;
+    }
+    
+    // Create new entry for new k-gram
+    HashEntry entry;
+    size_t bytes = ht->k_value * sizeof(uint32_t);
+    entry.hash = hash;
+    entry.kgram = (uint32_t*)(ht->arena != NULL ? arena_alloc(ht->arena, bytes) : malloc(bytes));
+    entry.count = 1;
+    if (entry.kgram == NULL) return;
+    memcpy(entry.kgram, kgram, bytes);
+    
+    hash_table_place(ht, entry);
+    ht->count++;
+}
+
+// Check if hash table contains a k-gram
+bool hash_table_contains(HashTable* ht, const uint32_t* kgram) {
+    if (ht == NULL || kgram == NULL) return false;
+    return hash_table_find(ht, kgram, hash_function(kgram, ht->k_value)) != NULL;
+}
+
+// Write a k-gram's words separated by spaces
+static void print_kgram_words(FILE* file, const DocumentReader* reader, const uint32_t* kgram, int k) {
+    for (int j = 0; j < k; j++) {
+        fprintf(file, j == 0 ? "%s" : " %s", reader_token_text(reader, kgram[j]));
+    }
+}
+
+// Print k-grams
+void print_kgrams(DocumentReader* reader) {
+    int max_to_show = 10; // Show first 10 k-grams to avoid clutter
+    int k = reader->kgram_list.k_value;
+    for (int i = 0; i < reader->kgram_list.count && i < max_to_show; i++) {
+        printf("K-gram %d: ", i + 1);
+        print_kgram_words(stdout, reader, reader->kgram_list.ids + (size_t)i * k, k);
+        printf("\n");
+    }
+    if (reader->kgram_list.count > max_to_show) {
+        printf("... and %d more k-grams\n", reader->kgram_list.count - max_to_show);
+    }
+}
+
+// Print hash table statistics
+void print_hash_table_stats(HashTable* ht) {
+    if (ht == NULL) return;
+    
+    int empty_slots = 0;
+    int max_probe_length = 0;
+    long total_probe_length = 0;
+    int histogram[PROBE_HISTOGRAM_SIZE] = {0};
+    
+    // Probe length = slots inspected to find an entry (1 = in its home slot)
+    for (int i = 0; i < ht->size; i++) {
+        if (ht->entries[i].hash == 0) {
+            empty_slots++;
+            continue;
+        }
+        
+        int probe_length = (int)probe_distance(ht, i, ht->entries[i].hash) + 1;
+        total_probe_length += probe_length;
+        if (probe_length > max_probe_length) {
+            max_probe_length = probe_length;
+        }
+        histogram[probe_length < PROBE_HISTOGRAM_SIZE ? probe_length - 1 : PROBE_HISTOGRAM_SIZE - 1]++;
+    }
+    
+    printf("\nHash Table Statistics:\n");
+    printf("Total size: %d\n", ht->size);
+    printf("Unique k-grams: %d\n", ht->count);
+    printf("Load factor: %.2f\n", (float)ht->count / ht->size);
+    printf("Empty slots: %d\n", empty_slots);
+    printf("Average probe length: %.2f\n", ht->count > 0 ? (float)total_probe_length / ht->count : 0.0);
+    printf("Max probe length: %d\n", max_probe_length);
+    printf("Probe length histogram:\n");
+    for (int i = 0; i < PROBE_HISTOGRAM_SIZE; i++) {
+        printf("  %d%s: %d\n", i + 1, i == PROBE_HISTOGRAM_SIZE - 1 ? "+" : "", histogram[i]);
+    }
+}
+
+// Free hash table memory
+void free_hash_table(HashTable* ht) {
+    if (ht == NULL) return;
+    
+    // Arena-backed k-grams are released with their arena
+    for (int i = 0; i < ht->size && ht->arena == NULL; i++) {
+        if (ht->entries[i].hash != 0) {
+            free(ht->entries[i].kgram);
+        }
+    }
+    
+    free(ht->entries);
+    free(ht->sorted_hashes);
+    free(ht);
+}
+
+// Export k-grams to file for Member 3
+void export_kgrams(DocumentReader* reader, const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not create file %s\n", filename);
+        return;
+    }
+    
+    fprintf(file, "K-value: %d\n", reader->kgram_list.k_value);
+    fprintf(file, "Total k-grams: %d\n", reader->kgram_list.count);
+    fprintf(file, "Unique k-grams: %d\n\n", reader->kgram_hash->count);
+    
+    // Export unique k-grams from hash table
+    for (int i = 0; i < reader->kgram_hash->size; i++) {
+        HashEntry* entry = &reader->kgram_hash->entries[i];
+        if (entry->hash != 0) {
+            print_kgram_words(file, reader, entry->kgram, reader->kgram_hash->k_value);
+            fprintf(file, " (count: %d)\n", entry->count);
+        }
+    }
+    
+    fclose(file);
+    printf("K-grams exported to %s\n", filename);
+}
+
+// ==================== SORTED SET INTERSECTION ====================
+
+// Sort k-gram hashes. They are uniformly mixed, so scattering them by their
+// top bits into about one bucket per value leaves each within a few places
+// of its final position, and an insertion sort finishes in linear time.
+static void sort_hashes(uint64_t* values, int count) {
+    if (count < 2) return;
+    int bits = 1;
+    while (bits < 30 && (1 << bits) < count) bits++;
+    int buckets = 1 << bits;
+    int* offsets = (int*)calloc(buckets + 1, sizeof(int));
+    uint64_t* buffer = (uint64_t*)malloc(count * sizeof(uint64_t));
+    if (offsets == NULL || buffer == NULL) {
+        fprintf(stderr, "Memory allocation failed for sorted k-gram hashes\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; i++) {
+        offsets[(values[i] >> (64 - bits)) + 1]++;
+    }
+    for (int b = 0; b < buckets; b++) {
+        offsets[b + 1] += offsets[b];
+    }
+    for (int i = 0; i < count; i++) {
+        buffer[offsets[values[i] >> (64 - bits)]++] = values[i];
+    }
+    for (int i = 0; i < count; i++) {
+        uint64_t value = buffer[i];
+        int j = i;
+        while (j > 0 && values[j - 1] > value) {
+            values[j] = values[j - 1];
+            j--;
+        }
+        values[j] = value;
+    }
+    free(offsets);
+    free(buffer);
+}
+
+// Keep a sorted copy of the table's entry hashes, so two tables can be
+// intersected by merging arrays instead of probing one with the other. Two
+// different k-grams with the same 64-bit hash would count as shared.
+void hash_table_sort_hashes(HashTable* ht) {
+    if (ht == NULL) return;
+    free(ht->sorted_hashes);
+    ht->sorted_hashes = (uint64_t*)malloc((ht->count + 1) * sizeof(uint64_t));
+    if (ht->sorted_hashes == NULL) {
+        fprintf(stderr, "Memory allocation failed for sorted k-gram hashes\n");
+        exit(EXIT_FAILURE);
+    }
+    int count = 0;
+    for (int i = 0; i < ht->size; i++) {
+        if (ht->entries[i].hash != 0) {
+            ht->sorted_hashes[count++] = ht->entries[i].hash;
+        }
+    }
+    sort_hashes(ht->sorted_hashes, count);
+}
+
+// Merge both arrays; the advances are computed rather than branched on
+int intersect_count_scalar(const uint64_t* a, int a_count, const uint64_t* b, int b_count) {
+    int i = 0, j = 0, count = 0;
+    while (i < a_count && j < b_count) {
+        uint64_t x = a[i], y = b[j];
+        count += x == y;
+        i += x <= y;
+        j += y <= x;
+    }
+    return count;
+}
+
+// Look each value of the shorter array up in the longer one: double the step
+// from the last position until it passes the value, then binary search the
+// last step. Costs O(a log(b / a)) instead of O(a + b).
+int intersect_count_galloping(const uint64_t* a, int a_count, const uint64_t* b, int b_count) {
+    int j = 0, count = 0;
+    for (int i = 0; i < a_count && j < b_count; i++) {
+        uint64_t x = a[i];
+        if (b[j] < x) {
+            int low = j, step = 1;
+            while (low + step < b_count && b[low + step] < x) {
+                low += step;
+                step *= 2;
+            }
+            // b[low] < x, and b[high] >= x unless high is the end
+            int high = low + step < b_count ? low + step : b_count;
+            while (low + 1 < high) {
+                int middle = low + (high - low) / 2;
+                if (b[middle] < x) {
+                    low = middle;
+                } else {
+                    high = middle;
+                }
+            }
+            j = high;
+        }
+        if (j < b_count && b[j] == x) {
+            count++;
+            j++;
+        }
+    }
+    return count;
+}
+
+#ifdef INTERSECT_AVX2
+// Compare blocks of four against four: each value of a's block is checked
+// against all rotations of b's block, then the block with the smaller last
+// value moves on (both when equal). A shared value lies in exactly one pair
+// of blocks that meet, so it is counted once.
+__attribute__((target("avx2,popcnt")))
+int intersect_count_avx2(const uint64_t* a, int a_count, const uint64_t* b, int b_count) {
+    int i = 0, j = 0, count = 0;
+    while (i + 4 <= a_count && j + 4 <= b_count) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b + j));
+        __m256i equal = _mm256_cmpeq_epi64(va, vb);
+        equal = _mm256_or_si256(equal, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x39)));
+        equal = _mm256_or_si256(equal, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x4E)));
+        equal = _mm256_or_si256(equal, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x93)));
+        count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(equal)));
+        
+        uint64_t a_last = a[i + 3], b_last = b[j + 3];
+        i += a_last <= b_last ? 4 : 0;
+        j += b_last <= a_last ? 4 : 0;
+    }
+    return count + intersect_count_scalar(a + i, a_count - i, b + j, b_count - j);
+}
+#endif
+
+// Fastest merge kernel this CPU supports
+IntersectKernel select_intersect_kernel(const char** name) {
+#ifdef INTERSECT_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        if (name != NULL) *name = "avx2";
+        return intersect_count_avx2;
+    }
+#endif
+    if (name != NULL) *name = "scalar";
+    return intersect_count_scalar;
+}
+
+static IntersectKernel intersect_kernel;
+static pthread_once_t intersect_kernel_once = PTHREAD_ONCE_INIT;
+
+static void init_intersect_kernel() {
+    intersect_kernel = select_intersect_kernel(NULL);
+}
+
+// Values shared by two ascending arrays of distinct values. Sets of similar
+// size are merged with the best kernel; when one is GALLOP_RATIO times larger
+// its values are galloped over instead.
+int sorted_intersection_count(const uint64_t* a, int a_count, const uint64_t* b, int b_count) {
+    if (a_count > b_count) {
+        return sorted_intersection_count(b, b_count, a, a_count);
+    }
+    if (a_count == 0) return 0;
+    if (b_count / a_count >= GALLOP_RATIO) {
+        return intersect_count_galloping(a, a_count, b, b_count);
+    }
+    pthread_once(&intersect_kernel_once, init_intersect_kernel);
+    return intersect_kernel(a, a_count, b, b_count);
+}
+
+// Intersection and union of two k-gram tables from their sorted hashes.
+// Occurrence counts are not read, so dot_product stays 0. A set so much
+// smaller that a hash lookup per k-gram is cheaper than galloping, or a table
+// without a sorted copy, is probed with hash_table_set_stats() instead.
+SetStats hash_table_sorted_stats(HashTable* set1, HashTable* set2) {
+    if (set1 == NULL || set2 == NULL || set1->sorted_hashes == NULL || set2->sorted_hashes == NULL) {
+        return hash_table_set_stats(set1, set2);
+    }
+    int smaller = set1->count < set2->count ? set1->count : set2->count;
+    int larger = set1->count < set2->count ? set2->count : set1->count;
+    if (smaller > 0 && larger / smaller >= PROBE_RATIO) {
+        return hash_table_set_stats(set1, set2);
+    }
+    SetStats stats = {set1->count, set2->count, 0, 0, 0.0, 0.0};
+    stats.intersection = sorted_intersection_count(set1->sorted_hashes, set1->count,
+                                                   set2->sorted_hashes, set2->count);
+    stats.union_count = stats.size1 + stats.size2 - stats.intersection;
+    return stats;
+}
+
+// ==================== ROLLING HASH K-GRAMS ====================
+
+// Finalizer that spreads entropy over all 64 bits (splitmix64)
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Map a token to a 64-bit hash (FNV-1a, then mixed); the rolling hash is
+// built over these, so fingerprints do not depend on dictionary IDs
+uint64_t token_id(const char* token) {
+    return token_id_bytes(token, strlen(token));
+}
+
+// token_id() of the first `length` bytes of a token
+uint64_t token_id_bytes(const char* token, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)token[i];
+        hash *= 1099511628211ULL;
+    }
+    return mix64(hash);
+}
+
+// Generate k-gram fingerprints with a Rabin-Karp rolling hash (O(1) per window)
+void generate_kgram_fingerprints(DocumentReader* reader, int k) {
+    if (k <= 0 || k > reader->token_list.count) {
+        fprintf(stderr, "Error: Invalid k value %d for token count %d\n", 
+                k, reader->token_list.count);
+        return;
+    }
+    
+    // Free previous fingerprints if any
+    free(reader->kgram_hashes.hashes);
+    reader->kgram_hashes.hashes = NULL;
+    free_fingerprint_table(reader->fingerprint_set);
+    reader->winnow.window = 0;  // Winnowed selection is now stale
+    free(reader->minhash);      // So is the MinHash signature
+    reader->minhash = NULL;
+    free_compressed_fingerprints(reader->compressed);  // And the compressed copy
+    reader->compressed = NULL;
+    
+    if (reader->streamed) {
+        fprintf(stderr, "Error: No tokens kept for %s; stream it again to change k\n",
+                reader->filename ? reader->filename : "document");
+        reader->kgram_hashes.count = 0;
+        reader->fingerprint_set = NULL;
+        return;
+    }
+    
+    uint64_t timer = metrics_timer_start();
+    int num_kgrams = reader->token_list.count - k + 1;
+    reader->kgram_hashes.hashes = (uint64_t*)malloc(num_kgrams * sizeof(uint64_t));
+    if (reader->kgram_hashes.hashes == NULL) {
+        fprintf(stderr, "Memory allocation failed for k-gram fingerprints\n");
+        reader->kgram_hashes.count = 0;
+        reader->fingerprint_set = NULL;
+        return;
+    }
+    reader->kgram_hashes.count = 0;
+    reader->kgram_hashes.k_value = k;
+    reader->fingerprint_set = create_fingerprint_table(FINGERPRINT_TABLE_SIZE);
+    
+    const uint32_t* ids = reader->token_list.ids;
+    
+    // BASE^(k-1), used to drop the outgoing token from the window
+    uint64_t top_power = 1;
+    for (int j = 1; j < k; j++) {
+        top_power *= ROLLING_HASH_BASE;
+    }
+    
+    // Hash of the first window
+    uint64_t rolling = 0;
+    for (int j = 0; j < k; j++) {
+        rolling = rolling * ROLLING_HASH_BASE + reader_token_hash(reader, ids[j]);
+    }
+    
+    for (int i = 0; i < num_kgrams; i++) {
+        if (i > 0) {
+            rolling = (rolling - reader_token_hash(reader, ids[i - 1]) * top_power) * ROLLING_HASH_BASE +
+                      reader_token_hash(reader, ids[i + k - 1]);
+        }
+        
+        uint64_t fingerprint = mix64(rolling);
+        if (fingerprint == 0) fingerprint = 1;  // 0 is reserved for empty slots
+        
+        reader->kgram_hashes.hashes[reader->kgram_hashes.count++] = fingerprint;
+        fingerprint_table_insert(reader->fingerprint_set, fingerprint);
+    }
+    metrics_add(METRIC_KGRAMS, (uint64_t)reader->kgram_hashes.count);
+    metrics_timer_stop(TIMER_KGRAMS, timer);
+    
+    log_progress("Generated %d k-gram fingerprints with k=%d\n", reader->kgram_hashes.count, k);
+    log_progress("Unique fingerprints: %d\n", reader->fingerprint_set->count);
+}
+
+// Number of k-grams produced by whichever representation is populated
+int document_kgram_count(DocumentReader* reader) {
+    if (reader->compact) {
+        return reader->compressed->kgram_count;
+    }
+    if (reader->fingerprint_set != NULL) {
+        return reader->kgram_hashes.count;
+    }
+    return reader->kgram_list.count;
+}
+
+// Number of tokens read, also for documents whose tokens were dropped
+int document_token_count(DocumentReader* reader) {
+    return reader->compact ? reader->compressed->token_count : reader->token_list.count;
+}
+
+// Create a fingerprint table (capacity is rounded up to a power of two)
+FingerprintTable* create_fingerprint_table(int capacity) {
+    FingerprintTable* ft = (FingerprintTable*)malloc(sizeof(FingerprintTable));
+    if (ft == NULL) return NULL;
+    
+    int size = 16;
+    while (size < capacity) size *= 2;
+    
+    ft->keys = (uint64_t*)calloc(size, sizeof(uint64_t));
+    ft->counts = (int*)calloc(size, sizeof(int));
+    if (ft->keys == NULL || ft->counts == NULL) {
+        free(ft->keys);
+        free(ft->counts);
+        free(ft);
+        return NULL;
+    }
+    
+    ft->capacity = size;
+    ft->count = 0;
+    return ft;
+}
+
+// Double the capacity and re-insert every fingerprint
+static void fingerprint_table_grow(FingerprintTable* ft) {
+    int old_capacity = ft->capacity;
+    uint64_t* old_keys = ft->keys;
+    int* old_counts = ft->counts;
+    
+    ft->capacity = old_capacity * 2;
+    ft->keys = (uint64_t*)calloc(ft->capacity, sizeof(uint64_t));
+    ft->counts = (int*)calloc(ft->capacity, sizeof(int));
+    if (ft->keys == NULL || ft->counts == NULL) {
+        fprintf(stderr, "Memory allocation failed for fingerprint table\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    unsigned int mask = ft->capacity - 1;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_keys[i] == 0) continue;
+        unsigned int index = (unsigned int)old_keys[i] & mask;
+        while (ft->keys[index] != 0) {
+            index = (index + 1) & mask;
+        }
+        ft->keys[index] = old_keys[i];
+        ft->counts[index] = old_counts[i];
+    }
+    
+    free(old_keys);
+    free(old_counts);
+}
+
+// Insert a fingerprint (handles duplicates)
+void fingerprint_table_insert(FingerprintTable* ft, uint64_t fingerprint) {
+    if (ft == NULL || fingerprint == 0) return;
+    
+    // Keep the load factor below 0.7
+    if ((ft->count + 1) * 10 > ft->capacity * 7) {
+        fingerprint_table_grow(ft);
+    }
+    
+    unsigned int mask = ft->capacity - 1;
+    unsigned int index = (unsigned int)fingerprint & mask;
+    while (ft->keys[index] != 0) {
+        if (ft->keys[index] == fingerprint) {
+            ft->counts[index]++;  // Increment count for duplicate
+            return;
+        }
+        index = (index + 1) & mask;
+    }
+    
+    ft->keys[index] = fingerprint;
+    ft->counts[index] = 1;
+    ft->count++;
+}
+
+// Check if a fingerprint is in the table
+bool fingerprint_table_contains(FingerprintTable* ft, uint64_t fingerprint) {
+    if (ft == NULL || fingerprint == 0) return false;
+    
+    unsigned int mask = ft->capacity - 1;
+    unsigned int index = (unsigned int)fingerprint & mask;
+    unsigned int probes = 1;
+    while (ft->keys[index] != 0) {
+        if (ft->keys[index] == fingerprint) {
+            count_hash_probes(probes);
+            return true;
+        }
+        index = (index + 1) & mask;
+        probes++;
+    }
+    count_hash_probes(probes);
+    return false;
+}
+
+// Free fingerprint table memory
+void free_fingerprint_table(FingerprintTable* ft) {
+    if (ft == NULL) return;
+    free(ft->keys);
+    free(ft->counts);
+    free(ft);
+}
+
+// Occurrence count of a fingerprint (0 when absent)
+int fingerprint_table_count(FingerprintTable* ft, uint64_t fingerprint) {
+    if (ft == NULL || fingerprint == 0) return 0;
+    
+    unsigned int mask = ft->capacity - 1;
+    unsigned int index = (unsigned int)fingerprint & mask;
+    unsigned int probes = 1;
+    while (ft->keys[index] != 0) {
+        if (ft->keys[index] == fingerprint) {
+            count_hash_probes(probes);
+            return ft->counts[index];
+        }
+        index = (index + 1) & mask;
+        probes++;
+    }
+    count_hash_probes(probes);
+    return 0;
+}
+
+// Intersection, union and count-weighted dot product in one pass over the smaller set
+SetStats fingerprint_set_stats(FingerprintTable* set1, FingerprintTable* set2) {
+    return fingerprint_weighted_stats(set1, set2, NULL);
+}
+
+// fingerprint_set_stats() plus the TF-IDF weighted dot product when idf is given
+SetStats fingerprint_weighted_stats(FingerprintTable* set1, FingerprintTable* set2, const IdfTable* idf) {
+    SetStats stats = {0, 0, 0, 0, 0.0, 0.0};
+    if (set1 == NULL || set2 == NULL) return stats;
+    
+    stats.size1 = set1->count;
+    stats.size2 = set2->count;
+    
+    FingerprintTable* small = set1->count <= set2->count ? set1 : set2;
+    FingerprintTable* large = small == set1 ? set2 : set1;
+    
+    for (int i = 0; i < small->capacity; i++) {
+        if (small->keys[i] == 0) continue;
+        int other = fingerprint_table_count(large, small->keys[i]);
+        if (other > 0) {
+            stats.intersection++;
+            stats.dot_product += (double)small->counts[i] * other;
+            if (idf != NULL) {
+                double weight = idf_weight(idf, small->keys[i]);
+                stats.weighted_dot += (double)small->counts[i] * other * weight * weight;
+            }
+        }
+    }
+    
+    stats.union_count = stats.size1 + stats.size2 - stats.intersection;
+    return stats;
+}
+
+// Count fingerprints present in both tables
+int fingerprint_intersection_count(FingerprintTable* set1, FingerprintTable* set2) {
+    return fingerprint_set_stats(set1, set2).intersection;
+}
+
+// Jaccard similarity between two fingerprint sets
+float fingerprint_jaccard_similarity(FingerprintTable* set1, FingerprintTable* set2) {
+    SetStats stats = fingerprint_set_stats(set1, set2);
+    return jaccard_from_stats(&stats);
+}
+
+// Cosine similarity between two fingerprint sets (binary vectors)
+float fingerprint_cosine_similarity(FingerprintTable* set1, FingerprintTable* set2) {
+    SetStats stats = fingerprint_set_stats(set1, set2);
+    return cosine_from_stats(&stats);
+}
+
+// fingerprint_weighted_stats() for a top-K search: every few keys the
+// intersection is bounded by the matches so far plus the keys left, and the
+// scan gives up (returning false) once that bound cannot score above *floor.
+bool fingerprint_stats_above(FingerprintTable* set1, FingerprintTable* set2, const IdfTable* idf,
+                             _Atomic float* floor, SetStats* stats) {
+    *stats = (SetStats){0, 0, 0, 0, 0.0, 0.0};
+    if (set1 == NULL || set2 == NULL) return true;
+    
+    stats->size1 = set1->count;
+    stats->size2 = set2->count;
+    
+    FingerprintTable* small = set1->count <= set2->count ? set1 : set2;
+    FingerprintTable* large = small == set1 ? set2 : set1;
+    
+    int visited = 0;
+    for (int i = 0; i < small->capacity; i++) {
+        if (small->keys[i] == 0) continue;
+        int other = fingerprint_table_count(large, small->keys[i]);
+        if (other > 0) {
+            stats->intersection++;
+            stats->dot_product += (double)small->counts[i] * other;
+            if (idf != NULL) {
+                double weight = idf_weight(idf, small->keys[i]);
+                stats->weighted_dot += (double)small->counts[i] * other * weight * weight;
+            }
+        }
+        if (++visited % TOP_K_CHECK_INTERVAL == 0 &&
+            combined_score_bound(stats->size1, stats->size2, stats->intersection + small->count - visited,
+                                 idf != NULL) < atomic_load(floor)) {
+            return false;
+        }
+    }
+    
+    stats->union_count = stats->size1 + stats->size2 - stats->intersection;
+    return true;
+}
+
+// ==================== WINNOWING ====================
+
+// Select fingerprints by winnowing: in every window of `window` consecutive
+// k-gram hashes keep the minimum (rightmost on ties), recording each
+// selection once. Any shared run of window+k-1 tokens yields a shared
+// fingerprint, while only about 2/(window+1) of the hashes are kept.
+void winnow_fingerprints(DocumentReader* reader, int window) {
+    if (window <= 0) {
+        fprintf(stderr, "Error: Invalid winnowing window %d\n", window);
+        return;
+    }
+    
+    // Free previous selection if any
+    free(reader->winnow.hashes);
+    free(reader->winnow.positions);
+    free_fingerprint_table(reader->winnow_set);
+    free_compressed_fingerprints(reader->compressed);
+    reader->winnow.hashes = NULL;
+    reader->winnow.positions = NULL;
+    reader->winnow.count = 0;
+    reader->winnow.window = window;
+    reader->compressed = NULL;
+    reader->winnow_set = create_fingerprint_table(FINGERPRINT_TABLE_SIZE);
+    
+    int n = reader->kgram_hashes.count;
+    const uint64_t* hashes = reader->kgram_hashes.hashes;
+    if (n == 0 || hashes == NULL) return;  // Streamed without keeping the order
+    
+    // Monotonic deque of k-gram indices; hashes increase from front to back
+    int* deque = (int*)malloc(n * sizeof(int));
+    reader->winnow.hashes = (uint64_t*)malloc(n * sizeof(uint64_t));
+    reader->winnow.positions = (int*)malloc(n * sizeof(int));
+    if (deque == NULL || reader->winnow.hashes == NULL || reader->winnow.positions == NULL) {
+        fprintf(stderr, "Memory allocation failed for winnowing\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    int head = 0, tail = 0;
+    int last_selected = -1;
+    
+    // A document shorter than one window still gets its minimum selected
+    int first_end = (window <= n) ? window - 1 : n - 1;
+    
+    for (int i = 0; i < n; i++) {
+        // Drop entries that can never be the rightmost minimum again
+        while (tail > head && hashes[deque[tail - 1]] >= hashes[i]) {
+            tail--;
+        }
+        deque[tail++] = i;
+        
+        // Drop entries that slid out of the window
+        while (deque[head] <= i - window) {
+            head++;
+        }
+        
+        if (i >= first_end && deque[head] != last_selected) {
+            last_selected = deque[head];
+            reader->winnow.hashes[reader->winnow.count] = hashes[last_selected];
+            reader->winnow.positions[reader->winnow.count] = last_selected;
+            reader->winnow.count++;
+            fingerprint_table_insert(reader->winnow_set, hashes[last_selected]);
+        }
+    }
+    
+    free(deque);
+    
+    log_progress("Winnowing selected %d of %d fingerprints (window=%d)\n",
+                 reader->winnow.count, n, window);
+}
+
+// ==================== MULTI-K FINGERPRINTS ====================
+
+// Fingerprints for every k in [k_min, k_max] in one pass over the tokens.
+// With prefix hashes P(i) = P(i-1) * BASE + h(token i), the rolling hash of
+// the k tokens ending at i is P(i) - P(i-k) * BASE^k, so each extra k costs
+// one multiply and subtract per token. The values equal those of
+// generate_kgram_fingerprints() for the same k.
+void generate_kgram_range(DocumentReader* reader, int k_min, int k_max, KGramRange* range) {
+    uint64_t timer = metrics_timer_start();
+    int width = k_max - k_min + 1;
+    range->k_min = k_min;
+    range->k_max = k_max;
+    range->sets = (FingerprintTable**)malloc(width * sizeof(FingerprintTable*));
+    uint64_t* powers = (uint64_t*)malloc((k_max + 1) * sizeof(uint64_t));
+    uint64_t* prefix = (uint64_t*)calloc(k_max + 1, sizeof(uint64_t));  // Ring of the last k_max + 1
+    if (range->sets == NULL || powers == NULL || prefix == NULL) {
+        fprintf(stderr, "Memory allocation failed for k-gram range\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int w = 0; w < width; w++) {
+        range->sets[w] = create_fingerprint_table(FINGERPRINT_TABLE_SIZE);
+    }
+    powers[0] = 1;
+    for (int k = 1; k <= k_max; k++) {
+        powers[k] = powers[k - 1] * ROLLING_HASH_BASE;
+    }
+    
+    const uint32_t* ids = reader->token_list.ids;
+    int count = reader->token_list.count;
+    uint64_t current = 0;
+    uint64_t kgrams = 0;
+    for (int i = 0; i < count; i++) {
+        current = current * ROLLING_HASH_BASE + reader_token_hash(reader, ids[i]);
+        prefix[i % (k_max + 1)] = current;
+        
+        for (int k = k_min; k <= k_max && k <= i + 1; k++) {
+            // P(i - k) is 0 before the first token
+            uint64_t before = i >= k ? prefix[(i - k) % (k_max + 1)] : 0;
+            uint64_t fingerprint = mix64(current - before * powers[k]);
+            if (fingerprint == 0) fingerprint = 1;  // 0 is reserved for empty slots
+            fingerprint_table_insert(range->sets[k - k_min], fingerprint);
+            kgrams++;
+        }
+    }
+    
+    free(powers);
+    free(prefix);
+    metrics_add(METRIC_KGRAMS, kgrams);
+    metrics_timer_stop(TIMER_KGRAMS, timer);
+    log_progress("Generated fingerprints for k=%d..%d: %llu k-grams\n", k_min, k_max,
+                 (unsigned long long)kgrams);
+}
+
+void free_kgram_range(KGramRange* range) {
+    if (range->sets == NULL) return;
+    for (int k = range->k_min; k <= range->k_max; k++) {
+        free_fingerprint_table(range->sets[k - range->k_min]);
+    }
+    free(range->sets);
+    range->sets = NULL;
+}
+
+// ==================== STREAMING INGESTION ====================
+
+// Single pass from file to fingerprints: each chunk is normalized in bulk,
+// split into tokens, stopword-filtered, mapped to a token ID and folded into a
+// rolling k-gram hash over a ring buffer of the last k IDs. No token text
+// or token list is kept, and the fingerprints only go into the set, so memory
+// grows with the distinct k-grams rather than the file's words. keep_order
+// also keeps every fingerprint in document order, which winnowing needs.
+void ingest_document_stream(DocumentReader* reader, const char* filename, int k, bool keep_order) {
+    if (k <= 0) {
+        fprintf(stderr, "Error: Invalid k value %d\n", k);
+        return;
+    }
+    
+    uint64_t timer = metrics_timer_start();
+    TokenStream* stream = (TokenStream*)malloc(sizeof(TokenStream));
+    uint64_t* window = (uint64_t*)malloc(k * sizeof(uint64_t));
+    if (stream == NULL || window == NULL) {
+        fprintf(stderr, "Memory allocation failed for streaming ingestion\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!open_token_stream(stream, filename)) {
+        fprintf(stderr, "Error: Could not open file %s\n", filename);
+        free(stream);
+        free(window);
+        return;
+    }
+    stream->normalize = true;  // Chunks arrive lowercased and stripped
+    
+    if (reader->filename != NULL) {
+        free(reader->filename);
+    }
+    reader->filename = strdup(filename);
+    
+    // Drop any previous tokens and fingerprints
+    reset_token_list(reader);
+    free(reader->kgram_hashes.hashes);
+    reader->kgram_hashes.hashes = NULL;
+    free_fingerprint_table(reader->fingerprint_set);
+    free(reader->minhash);
+    reader->minhash = NULL;
+    free_compressed_fingerprints(reader->compressed);
+    reader->compressed = NULL;
+    reader->winnow.window = 0;
+    
+    size_t hash_capacity = 0;
+    reader->kgram_hashes.count = 0;
+    reader->kgram_hashes.k_value = k;
+    reader->fingerprint_set = create_fingerprint_table(FINGERPRINT_TABLE_SIZE);
+    
+    // BASE^(k-1), used to drop the outgoing token from the window
+    uint64_t top_power = 1;
+    for (int j = 1; j < k; j++) {
+        top_power *= ROLLING_HASH_BASE;
+    }
+    
+    uint64_t rolling = 0;
+    int words = 0, kept = 0;
+    char* token;
+    
+    while ((token = (char*)next_raw_token(stream)) != NULL) {
+        words++;
+        if (is_stopword(reader, token)) continue;
+        
+        // Same hash as generate_kgram_fingerprints() over the same tokens
+        uint64_t id = token_id(token);
+        int slot = kept % k;
+        if (kept >= k) {
+            rolling -= window[slot] * top_power;
+        }
+        rolling = rolling * ROLLING_HASH_BASE + id;
+        window[slot] = id;
+        kept++;
+        
+        if (kept < k) continue;
+        
+        uint64_t fingerprint = mix64(rolling);
+        if (fingerprint == 0) fingerprint = 1;  // 0 is reserved for empty slots
+        
+        if (reader->kgram_hashes.count == INT32_MAX) {
+            fprintf(stderr, "Error: %s has too many k-grams\n", filename);
+            break;
+        }
+        if (keep_order) {
+            if ((size_t)reader->kgram_hashes.count == hash_capacity) {
+                hash_capacity = hash_capacity == 0 ? INITIAL_TOKEN_CAPACITY : hash_capacity * 2;
+                reader->kgram_hashes.hashes = (uint64_t*)realloc(reader->kgram_hashes.hashes,
+                                                                 hash_capacity * sizeof(uint64_t));
+                if (reader->kgram_hashes.hashes == NULL) {
+                    fprintf(stderr, "Memory allocation failed for k-gram fingerprints\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            reader->kgram_hashes.hashes[reader->kgram_hashes.count] = fingerprint;
+        }
+        reader->kgram_hashes.count++;
+        fingerprint_table_insert(reader->fingerprint_set, fingerprint);
+    }
+    
+    metrics_add(METRIC_DOCUMENTS_READ, 1);
+    metrics_add(METRIC_BYTES_READ, (uint64_t)stream->next_offset);
+    metrics_add(METRIC_TOKENS_READ, (uint64_t)words);
+    metrics_add(METRIC_TOKENS_KEPT, (uint64_t)kept);
+    metrics_add(METRIC_KGRAMS, (uint64_t)reader->kgram_hashes.count);
+    
+    close_token_stream(stream);
+    free(stream);
+    free(window);
+    
+    // Only the count of kept tokens is recorded
+    reader->token_list.count = kept;
+    reader->streamed = true;
+    metrics_timer_stop(TIMER_STREAM, timer);
+    
+    log_progress("Streamed %d words from %s: %d tokens kept, %d k-gram fingerprints\n",
+                 words, filename, kept, reader->kgram_hashes.count);
+}
+
+// ==================== MINHASH AND LSH ====================
+
+// Seed of the i-th MinHash permutation
+static uint64_t minhash_seed(int i) {
+    return mix64((uint64_t)(i + 1) * 0x9E3779B97F4A7C15ULL);
+}
+
+// Compute a MINHASH_SIZE signature from the document's unique k-gram fingerprints
+void compute_minhash_signature(DocumentReader* reader) {
+    if (reader->minhash == NULL) {
+        reader->minhash = (uint64_t*)malloc(MINHASH_SIZE * sizeof(uint64_t));
+        if (reader->minhash == NULL) {
+            fprintf(stderr, "Memory allocation failed for MinHash signature\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    uint64_t seeds[MINHASH_SIZE];
+    for (int i = 0; i < MINHASH_SIZE; i++) {
+        seeds[i] = minhash_seed(i);
+        reader->minhash[i] = UINT64_MAX;
+    }
+    
+    FingerprintTable* set = reader->fingerprint_set;
+    if (set == NULL) return;  // Empty documents keep an all-max signature
+    
+    for (int slot = 0; slot < set->capacity; slot++) {
+        uint64_t fingerprint = set->keys[slot];
+        if (fingerprint == 0) continue;
+        
+        for (int i = 0; i < MINHASH_SIZE; i++) {
+            uint64_t value = mix64(fingerprint ^ seeds[i]);
+            if (value < reader->minhash[i]) {
+                reader->minhash[i] = value;
+            }
+        }
+    }
+}
+
+// Estimated Jaccard similarity: fraction of matching signature positions
+float minhash_similarity(const uint64_t* signature1, const uint64_t* signature2) {
+    if (signature1 == NULL || signature2 == NULL) return 0.0;
+    
+    int matches = 0;
+    for (int i = 0; i < MINHASH_SIZE; i++) {
+        if (signature1[i] == signature2[i] && signature1[i] != UINT64_MAX) {
+            matches++;
+        }
+    }
+    return (float)matches / MINHASH_SIZE;
+}
+
+// Hash one band of a signature into a non-zero key that includes the band number
+static uint64_t lsh_band_key(const uint64_t* signature, int band) {
+    uint64_t key = mix64((uint64_t)band + 1);
+    for (int r = 0; r < LSH_ROWS; r++) {
+        key = mix64(key ^ signature[band * LSH_ROWS + r]);
+    }
+    return key == 0 ? 1 : key;
+}
+
+// Create an empty LSH index for signatures over k-gram fingerprints
+LshIndex* create_lsh_index(int k) {
+    LshIndex* index = (LshIndex*)calloc(1, sizeof(LshIndex));
+    if (index == NULL) {
+        fprintf(stderr, "Memory allocation failed for LSH index\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    index->k_value = k;
+    index->capacity = 1024;
+    index->keys = (uint64_t*)calloc(index->capacity, sizeof(uint64_t));
+    index->heads = (int*)malloc(index->capacity * sizeof(int));
+    index->posting_capacity = 1024;
+    index->posting_doc = (int*)malloc(index->posting_capacity * sizeof(int));
+    index->posting_next = (int*)malloc(index->posting_capacity * sizeof(int));
+    if (index->keys == NULL || index->heads == NULL ||
+        index->posting_doc == NULL || index->posting_next == NULL) {
+        fprintf(stderr, "Memory allocation failed for LSH index\n");
+        exit(EXIT_FAILURE);
+    }
+    return index;
+}
+
+// Find the slot holding a band key, or the empty slot where it belongs
+static int lsh_find_slot(LshIndex* index, uint64_t key) {
+    unsigned int mask = index->capacity - 1;
+    unsigned int slot = (unsigned int)key & mask;
+    while (index->keys[slot] != 0 && index->keys[slot] != key) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Double the slot table and re-insert every band key
+static void lsh_index_grow(LshIndex* index) {
+    int old_capacity = index->capacity;
+    uint64_t* old_keys = index->keys;
+    int* old_heads = index->heads;
+    
+    index->capacity *= 2;
+    index->keys = (uint64_t*)calloc(index->capacity, sizeof(uint64_t));
+    index->heads = (int*)malloc(index->capacity * sizeof(int));
+    if (index->keys == NULL || index->heads == NULL) {
+        fprintf(stderr, "Memory allocation failed for LSH index\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_keys[i] == 0) continue;
+        int slot = lsh_find_slot(index, old_keys[i]);
+        index->keys[slot] = old_keys[i];
+        index->heads[slot] = old_heads[i];
+    }
+    
+    free(old_keys);
+    free(old_heads);
+}
+
+// Add a document's signature to every band bucket
+void lsh_index_add(LshIndex* index, const uint64_t* signature, int doc_id) {
+    if (index == NULL || signature == NULL) return;
+    
+    for (int band = 0; band < LSH_BANDS; band++) {
+        // Keep the load factor below 0.7
+        if ((index->used + 1) * 10 > index->capacity * 7) {
+            lsh_index_grow(index);
+        }
+        if (index->posting_count == index->posting_capacity) {
+            index->posting_capacity *= 2;
+            index->posting_doc = (int*)realloc(index->posting_doc,
+                                               index->posting_capacity * sizeof(int));
+            index->posting_next = (int*)realloc(index->posting_next,
+                                                index->posting_capacity * sizeof(int));
+            if (index->posting_doc == NULL || index->posting_next == NULL) {
+                fprintf(stderr, "Memory allocation failed for LSH postings\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        
+        uint64_t key = lsh_band_key(signature, band);
+        int slot = lsh_find_slot(index, key);
+        if (index->keys[slot] == 0) {
+            index->keys[slot] = key;
+            index->heads[slot] = -1;
+            index->used++;
+        }
+        
+        int posting = index->posting_count++;
+        index->posting_doc[posting] = doc_id;
+        index->posting_next[posting] = index->heads[slot];
+        index->heads[slot] = posting;
+    }
+}
+
+// Collect every document sharing at least one band with the signature.
+// `candidates` must hold doc_count entries; returns the number written.
+int lsh_index_query(LshIndex* index, const uint64_t* signature, int doc_count, int* candidates) {
+    if (index == NULL || signature == NULL || doc_count == 0) return 0;
+    
+    bool* seen = (bool*)calloc(doc_count, sizeof(bool));
+    if (seen == NULL) {
+        fprintf(stderr, "Memory allocation failed for LSH query\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    int found = 0;
+    for (int band = 0; band < LSH_BANDS; band++) {
+        int slot = lsh_find_slot(index, lsh_band_key(signature, band));
+        if (index->keys[slot] == 0) continue;
+        
+        for (int p = index->heads[slot]; p != -1; p = index->posting_next[p]) {
+            int doc = index->posting_doc[p];
+            if (doc < doc_count && !seen[doc]) {
+                seen[doc] = true;
+                candidates[found++] = doc;
+            }
+        }
+    }
+    
+    free(seen);
+    return found;
+}
+
+// Free LSH index memory
+void free_lsh_index(LshIndex* index) {
+    if (index == NULL) return;
+    free(index->keys);
+    free(index->heads);
+    free(index->posting_doc);
+    free(index->posting_next);
+    free(index);
+}
+
+// ==================== INVERTED INDEX ====================
+
+// Create an empty inverted index for fingerprints built with these settings
+InvertedIndex* create_inverted_index(int k, int engine, int winnow_window) {
+    InvertedIndex* index = (InvertedIndex*)calloc(1, sizeof(InvertedIndex));
+    if (index == NULL) {
+        fprintf(stderr, "Memory allocation failed for inverted index\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    index->capacity = FINGERPRINT_TABLE_SIZE;
+    index->keys = (uint64_t*)calloc(index->capacity, sizeof(uint64_t));
+    index->heads = (int*)malloc(index->capacity * sizeof(int));
+    index->posting_capacity = FINGERPRINT_TABLE_SIZE;
+    index->posting_doc = (int*)malloc(index->posting_capacity * sizeof(int));
+    index->posting_count = (int*)malloc(index->posting_capacity * sizeof(int));
+    index->posting_next = (int*)malloc(index->posting_capacity * sizeof(int));
+    index->doc_capacity = INITIAL_REFERENCE_CAPACITY;
+    index->doc_sizes = (int*)calloc(index->doc_capacity, sizeof(int));
+    if (index->keys == NULL || index->heads == NULL || index->posting_doc == NULL ||
+        index->posting_count == NULL || index->posting_next == NULL || index->doc_sizes == NULL) {
+        fprintf(stderr, "Memory allocation failed for inverted index\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    index->k_value = k;
+    index->engine = engine;
+    index->winnow_window = winnow_window;
+    return index;
+}
+
+// Find the slot holding a fingerprint, or the empty slot where it would go
+static int inverted_find_slot(const InvertedIndex* index, uint64_t key) {
+    unsigned int mask = index->capacity - 1;
+    unsigned int slot = (unsigned int)key & mask;
+    while (index->keys[slot] != 0 && index->keys[slot] != key) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Double the slot table and re-insert every fingerprint
+static void inverted_index_grow(InvertedIndex* index) {
+    int old_capacity = index->capacity;
+    uint64_t* old_keys = index->keys;
+    int* old_heads = index->heads;
+    
+    index->capacity *= 2;
+    index->keys = (uint64_t*)calloc(index->capacity, sizeof(uint64_t));
+    index->heads = (int*)malloc(index->capacity * sizeof(int));
+    if (index->keys == NULL || index->heads == NULL) {
+        fprintf(stderr, "Memory allocation failed for inverted index\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_keys[i] == 0) continue;
+        int slot = inverted_find_slot(index, old_keys[i]);
+        index->keys[slot] = old_keys[i];
+        index->heads[slot] = old_heads[i];
+    }
+    
+    free(old_keys);
+    free(old_heads);
+}
+
+// Add one posting per unique fingerprint of a reference
+void inverted_index_add(InvertedIndex* index, FingerprintTable* set, int doc_id) {
+    if (index == NULL) return;
+    
+    while (doc_id >= index->doc_capacity) {
+        int old_capacity = index->doc_capacity;
+        index->doc_capacity *= 2;
+        index->doc_sizes = (int*)realloc(index->doc_sizes, index->doc_capacity * sizeof(int));
+        if (index->doc_sizes == NULL) {
+            fprintf(stderr, "Memory allocation failed for inverted index\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(index->doc_sizes + old_capacity, 0, (index->doc_capacity - old_capacity) * sizeof(int));
+    }
+    if (set == NULL) return;
+    index->doc_sizes[doc_id] = set->count;
+    
+    // Reserve room for every posting up front
+    if (index->posting_total + set->count > index->posting_capacity) {
+        while (index->posting_total + set->count > index->posting_capacity) {
+            index->posting_capacity *= 2;
+        }
+        index->posting_doc = (int*)realloc(index->posting_doc, index->posting_capacity * sizeof(int));
+        index->posting_count = (int*)realloc(index->posting_count, index->posting_capacity * sizeof(int));
+        index->posting_next = (int*)realloc(index->posting_next, index->posting_capacity * sizeof(int));
+        if (index->posting_doc == NULL || index->posting_count == NULL || index->posting_next == NULL) {
+            fprintf(stderr, "Memory allocation failed for inverted index postings\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    for (int i = 0; i < set->capacity; i++) {
+        if (set->keys[i] == 0) continue;
+        
+        // Keep the load factor below 0.7
+        if ((index->used + 1) * 10 > index->capacity * 7) {
+            inverted_index_grow(index);
+        }
+        
+        int slot = inverted_find_slot(index, set->keys[i]);
+        if (index->keys[slot] == 0) {
+            index->keys[slot] = set->keys[i];
+            index->heads[slot] = -1;
+            index->used++;
+        }
+        
+        int posting = index->posting_total++;
+        index->posting_doc[posting] = doc_id;
+        index->posting_count[posting] = set->counts[i];
+        index->posting_next[posting] = index->heads[slot];
+        index->heads[slot] = posting;
+    }
+}
+
+// Overlap statistics of the target against every indexed reference in one
+// pass over the target's fingerprints: each posting list hit adds to its
+// reference's intersection and dot product. `stats` holds doc_count entries
+// and matches fingerprint_set_stats(target, reference) for each reference.
+void inverted_index_score(InvertedIndex* index, FingerprintTable* target, int doc_count,
+                          const IdfTable* idf, SetStats* stats) {
+    int target_size = target != NULL ? target->count : 0;
+    for (int d = 0; d < doc_count; d++) {
+        stats[d].size1 = target_size;
+        stats[d].size2 = d < index->indexed_count ? index->doc_sizes[d] : 0;
+        stats[d].intersection = 0;
+        stats[d].dot_product = 0.0;
+        stats[d].weighted_dot = 0.0;
+    }
+    
+    if (target != NULL) {
+        for (int i = 0; i < target->capacity; i++) {
+            if (target->keys[i] == 0) continue;
+            
+            int slot = inverted_find_slot(index, target->keys[i]);
+            if (index->keys[slot] == 0) continue;
+            
+            double weight = idf != NULL ? idf_weight(idf, target->keys[i]) : 0.0;
+            for (int p = index->heads[slot]; p != -1; p = index->posting_next[p]) {
+                int doc = index->posting_doc[p];
+                if (doc >= doc_count) continue;
+                double product = (double)target->counts[i] * index->posting_count[p];
+                stats[doc].intersection++;
+                stats[doc].dot_product += product;
+                stats[doc].weighted_dot += product * weight * weight;
+            }
+        }
+    }
+    
+    for (int d = 0; d < doc_count; d++) {
+        stats[d].union_count = stats[d].size1 + stats[d].size2 - stats[d].intersection;
+    }
+}
+
+// Free inverted index memory
+void free_inverted_index(InvertedIndex* index) {
+    if (index == NULL) return;
+    free(index->keys);
+    free(index->heads);
+    free(index->posting_doc);
+    free(index->posting_count);
+    free(index->posting_next);
+    free(index->doc_sizes);
+    free(index);
+}
+
+// ==================== TF-IDF WEIGHTING ====================
+
+// Create an empty document frequency table for k-grams built with these settings
+IdfTable* create_idf_table(int k, int engine, int winnow_window) {
+    IdfTable* idf = (IdfTable*)calloc(1, sizeof(IdfTable));
+    if (idf == NULL) {
+        fprintf(stderr, "Memory allocation failed for IdfTable\n");
+        exit(EXIT_FAILURE);
+    }
+    idf->document_frequency = create_fingerprint_table(FINGERPRINT_TABLE_SIZE);
+    idf->k_value = k;
+    idf->engine = engine;
+    idf->winnow_window = winnow_window;
+    return idf;
+}
+
+// Count one reference's distinct fingerprints (each adds 1 to its frequency)
+void idf_table_add_fingerprints(IdfTable* idf, FingerprintTable* set) {
+    if (set == NULL) return;
+    for (int i = 0; i < set->capacity; i++) {
+        if (set->keys[i] != 0) {
+            fingerprint_table_insert(idf->document_frequency, set->keys[i]);
+        }
+    }
+    idf->documents++;
+}
+
+// Count one reference's distinct string k-grams, keyed by their 64-bit hash
+void idf_table_add_kgrams(IdfTable* idf, HashTable* ht) {
+    if (ht == NULL) return;
+    for (int i = 0; i < ht->size; i++) {
+        if (ht->entries[i].hash != 0) {
+            fingerprint_table_insert(idf->document_frequency, ht->entries[i].hash);
+        }
+    }
+    idf->documents++;
+}
+
+// Smoothed inverse document frequency: ln((N + 1) / (df + 1)) + 1, so a
+// k-gram in every reference still counts a little and unseen ones count most
+double idf_weight(const IdfTable* idf, uint64_t key) {
+    int frequency = fingerprint_table_count(idf->document_frequency, key);
+    return log((double)(idf->documents + 1) / (frequency + 1)) + 1.0;
+}
+
+// Length of a document's TF-IDF vector (term frequency = occurrence count)
+double fingerprint_tfidf_norm(FingerprintTable* set, const IdfTable* idf) {
+    if (set == NULL) return 0.0;
+    double sum = 0.0;
+    for (int i = 0; i < set->capacity; i++) {
+        if (set->keys[i] == 0) continue;
+        double weight = set->counts[i] * idf_weight(idf, set->keys[i]);
+        sum += weight * weight;
+    }
+    return sqrt(sum);
+}
+
+double hash_table_tfidf_norm(HashTable* ht, const IdfTable* idf) {
+    if (ht == NULL) return 0.0;
+    double sum = 0.0;
+    for (int i = 0; i < ht->size; i++) {
+        if (ht->entries[i].hash == 0) continue;
+        double weight = ht->entries[i].count * idf_weight(idf, ht->entries[i].hash);
+        sum += weight * weight;
+    }
+    return sqrt(sum);
+}
+
+// Weighted cosine from the shared part (stats->weighted_dot) and both lengths
+float tfidf_cosine(const SetStats* stats, double norm1, double norm2) {
+    if (norm1 <= 0.0 || norm2 <= 0.0) {
+        return 0.0;
+    }
+    return (float)(stats->weighted_dot / (norm1 * norm2));
+}
+
+void free_idf_table(IdfTable* idf) {
+    if (idf == NULL) return;
+    free_fingerprint_table(idf->document_frequency);
+    free(idf);
+}
+
+// ==================== SUFFIX ARRAY ENGINE ====================
+
+// Suffix array of text[0, n) over symbols in [0, alphabet_size), by prefix
+// doubling with two counting-sort passes per round: O(n log n).
+int* build_suffix_array(const int* text, int n, int alphabet_size) {
+    int* suffix_array = (int*)malloc((n + 1) * sizeof(int));
+    int* rank = (int*)malloc((n + 1) * sizeof(int));
+    int* next_rank = (int*)malloc((n + 1) * sizeof(int));
+    int* order = (int*)malloc((n + 1) * sizeof(int));
+    int buckets = (n > alphabet_size ? n : alphabet_size) + 1;
+    int* counts = (int*)malloc(buckets * sizeof(int));
+    if (suffix_array == NULL || rank == NULL || next_rank == NULL || order == NULL || counts == NULL) {
+        fprintf(stderr, "Memory allocation failed for suffix array\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    // Round 0: sort by the first symbol
+    memset(counts, 0, buckets * sizeof(int));
+    for (int i = 0; i < n; i++) counts[text[i]]++;
+    for (int b = 1; b < buckets; b++) counts[b] += counts[b - 1];
+    for (int i = n - 1; i >= 0; i--) suffix_array[--counts[text[i]]] = i;
+    for (int i = 0; i < n; i++) rank[i] = text[i];
+    
+    for (int h = 1; h < n; h *= 2) {
+        // Order by the second half: suffixes too short to have one come first
+        int filled = 0;
+        for (int i = n - h; i < n; i++) order[filled++] = i;
+        for (int j = 0; j < n; j++) {
+            if (suffix_array[j] >= h) order[filled++] = suffix_array[j] - h;
+        }
+        
+        // Stable counting sort by the first half
+        memset(counts, 0, buckets * sizeof(int));
+        for (int i = 0; i < n; i++) counts[rank[i]]++;
+        for (int b = 1; b < buckets; b++) counts[b] += counts[b - 1];
+        for (int j = n - 1; j >= 0; j--) suffix_array[--counts[rank[order[j]]]] = order[j];
+        
+        // Re-rank; stop once every suffix has its own rank
+        next_rank[suffix_array[0]] = 0;
+        int classes = 1;
+        for (int j = 1; j < n; j++) {
+            int a = suffix_array[j - 1], b = suffix_array[j];
+            int a_second = a + h < n ? rank[a + h] : -1;
+            int b_second = b + h < n ? rank[b + h] : -1;
+            if (rank[a] != rank[b] || a_second != b_second) classes++;
+            next_rank[b] = classes - 1;
+        }
+        memcpy(rank, next_rank, n * sizeof(int));
+        if (classes == n) break;
+    }
+    
+    free(rank);
+    free(next_rank);
+    free(order);
+    free(counts);
+    return suffix_array;
+}
+
+// LCP array (Kasai): lcp[j] is the common prefix length of the suffixes at
+// suffix_array[j - 1] and suffix_array[j]; lcp[0] is 0. O(n).
+int* build_lcp_array(const int* text, const int* suffix_array, int n) {
+    int* lcp = (int*)calloc(n + 1, sizeof(int));
+    int* position = (int*)malloc((n + 1) * sizeof(int));
+    if (lcp == NULL || position == NULL) {
+        fprintf(stderr, "Memory allocation failed for LCP array\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int j = 0; j < n; j++) position[suffix_array[j]] = j;
+    
+    int length = 0;
+    for (int i = 0; i < n; i++) {
+        int j = position[i];
+        if (j == 0) {
+            length = 0;
+            continue;
+        }
+        int previous = suffix_array[j - 1];
+        while (i + length < n && previous + length < n && text[i + length] == text[previous + length]) {
+            length++;
+        }
+        lcp[j] = length;
+        if (length > 0) length--;
+    }
+    
+    free(position);
+    return lcp;
+}
+
+static int compare_token_ids(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Map a token ID to its rank among the sorted distinct IDs (binary search)
+static int token_rank(const uint32_t* distinct, int count, uint32_t id) {
+    int low = 0, high = count - 1;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (distinct[middle] < id) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+// Longest common token run and target coverage between two documents.
+// The target and reference token IDs are ranked densely and joined with a
+// unique separator into one text, whose generalized suffix array and LCP
+// array give, for every target position, the longest prefix that also
+// starts somewhere in the reference (two sweeps over the suffix array,
+// carrying the minimum LCP since the last reference suffix). Runs of at
+// least k tokens are merged to count the covered target tokens.
+PassageStats suffix_array_passage_stats(DocumentReader* target, DocumentReader* reference, int k) {
+    PassageStats stats = {target->token_list.count, 0, 0, 0, 0};
+    int target_count = target->token_list.count;
+    int reference_count = reference->token_list.count;
+    if (target_count == 0 || reference_count == 0 ||
+        target->token_list.ids == NULL || reference->token_list.ids == NULL) {
+        return stats;
+    }
+    
+    // Dense ranks 1..distinct; 0 is the separator
+    int n = target_count + 1 + reference_count;
+    uint32_t* distinct = (uint32_t*)malloc(n * sizeof(uint32_t));
+    int* text = (int*)malloc(n * sizeof(int));
+    int* matched = (int*)calloc(target_count, sizeof(int));
+    int* matched_reference = (int*)malloc(target_count * sizeof(int));
+    if (distinct == NULL || text == NULL || matched == NULL || matched_reference == NULL) {
+        fprintf(stderr, "Memory allocation failed for suffix array engine\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    memcpy(distinct, target->token_list.ids, target_count * sizeof(uint32_t));
+    memcpy(distinct + target_count, reference->token_list.ids, reference_count * sizeof(uint32_t));
+    qsort(distinct, target_count + reference_count, sizeof(uint32_t), compare_token_ids);
+    int distinct_count = 0;
+    for (int i = 0; i < target_count + reference_count; i++) {
+        if (distinct_count == 0 || distinct[distinct_count - 1] != distinct[i]) {
+            distinct[distinct_count++] = distinct[i];
+        }
+    }
+    
+    for (int i = 0; i < target_count; i++) {
+        text[i] = 1 + token_rank(distinct, distinct_count, target->token_list.ids[i]);
+    }
+    text[target_count] = 0;
+    for (int i = 0; i < reference_count; i++) {
+        text[target_count + 1 + i] = 1 + token_rank(distinct, distinct_count, reference->token_list.ids[i]);
+    }
+    
+    int* suffix_array = build_suffix_array(text, n, distinct_count + 1);
+    int* lcp = build_lcp_array(text, suffix_array, n);
+    
+    // Forward sweep: nearest reference suffix sorted before each target suffix.
+    // The separator is unique, so no common prefix runs past the target's end.
+    int run = 0, source = -1;
+    for (int j = 0; j < n; j++) {
+        if (lcp[j] < run) run = lcp[j];
+        int position = suffix_array[j];
+        if (position < target_count) {
+            if (run > matched[position]) {
+                matched[position] = run;
+                matched_reference[position] = source;
+            }
+        } else if (position > target_count) {
+            run = n;
+            source = position - target_count - 1;
+        }
+    }
+    
+    // Backward sweep: nearest reference suffix sorted after it
+    run = 0;
+    source = -1;
+    for (int j = n - 1; j >= 0; j--) {
+        int position = suffix_array[j];
+        if (position < target_count) {
+            if (run > matched[position]) {
+                matched[position] = run;
+                matched_reference[position] = source;
+            }
+        } else if (position > target_count) {
+            run = n;
+            source = position - target_count - 1;
+        }
+        if (lcp[j] < run) run = lcp[j];
+    }
+    
+    // Longest run, and the union of runs of at least k tokens
+    int reach = 0;
+    for (int i = 0; i < target_count; i++) {
+        if (matched[i] > stats.longest) {
+            stats.longest = matched[i];
+            stats.longest_target = i;
+            stats.longest_reference = matched_reference[i];
+        }
+        if (matched[i] >= k && i + matched[i] > reach) {
+            reach = i + matched[i];
+        }
+        if (i < reach) stats.covered++;
+    }
+    
+    free(distinct);
+    free(text);
+    free(matched);
+    free(matched_reference);
+    free(suffix_array);
+    free(lcp);
+    return stats;
+}
+
+// ==================== MATCH LOCALIZATION ====================
+
+// Append a passage to a match list
+static void match_list_append(MatchList* matches, MatchSpan span) {
+    if (matches->count == matches->capacity) {
+        matches->capacity = matches->capacity == 0 ? 16 : matches->capacity * 2;
+        matches->spans = (MatchSpan*)realloc(matches->spans, matches->capacity * sizeof(MatchSpan));
+        if (matches->spans == NULL) {
+            fprintf(stderr, "Memory allocation failed for matches\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    matches->spans[matches->count++] = span;
+    matches->covered_tokens += span.length;
+}
+
+// Find the passages the target shares with a reference by seed-and-extend.
+// Reference k-gram positions are chained by fingerprint; each target k-gram
+// whose fingerprint occurs in the reference is a seed, verified and extended
+// token by token at up to MAX_SEED_CANDIDATES reference positions. The
+// longest extension becomes a maximal span and the scan resumes after it, so
+// the work is linear in the two documents. Both readers need k-gram
+// fingerprints for k and their token lists (not available for streamed readers).
+void locate_matches(DocumentReader* target, DocumentReader* reference, int k, MatchList* matches) {
+    matches->count = 0;
+    matches->covered_tokens = 0;
+    
+    const TokenList* t = &target->token_list;
+    const TokenList* r = &reference->token_list;
+    if (target->kgram_hashes.k_value != k || reference->kgram_hashes.k_value != k ||
+        target->kgram_hashes.count == 0 || reference->kgram_hashes.count == 0 ||
+        t->ids == NULL || r->ids == NULL || t->starts == NULL || r->starts == NULL) {
+        return;
+    }
+    
+    // Chain the reference's k-gram positions by fingerprint, in document order
+    int reference_kgrams = reference->kgram_hashes.count;
+    int capacity = 16;
+    while (capacity < reference_kgrams * 2) {
+        capacity *= 2;
+    }
+    uint64_t* keys = (uint64_t*)calloc(capacity, sizeof(uint64_t));
+    int* heads = (int*)malloc(capacity * sizeof(int));
+    int* next = (int*)malloc(reference_kgrams * sizeof(int));
+    if (keys == NULL || heads == NULL || next == NULL) {
+        fprintf(stderr, "Memory allocation failed for match localization\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    unsigned int mask = capacity - 1;
+    for (int j = reference_kgrams - 1; j >= 0; j--) {
+        uint64_t key = reference->kgram_hashes.hashes[j];
+        unsigned int slot = (unsigned int)key & mask;
+        while (keys[slot] != 0 && keys[slot] != key) {
+            slot = (slot + 1) & mask;
+        }
+        if (keys[slot] == 0) {
+            keys[slot] = key;
+            heads[slot] = -1;
+        }
+        next[j] = heads[slot];
+        heads[slot] = j;
+    }
+    
+    int target_kgrams = target->kgram_hashes.count;
+    int i = 0;
+    while (i < target_kgrams) {
+        uint64_t key = target->kgram_hashes.hashes[i];
+        unsigned int slot = (unsigned int)key & mask;
+        while (keys[slot] != 0 && keys[slot] != key) {
+            slot = (slot + 1) & mask;
+        }
+        
+        int best_length = 0, best_position = -1;
+        if (keys[slot] != 0) {
+            int tried = 0;
+            for (int j = heads[slot]; j != -1 && tried < MAX_SEED_CANDIDATES; j = next[j], tried++) {
+                // Verify the seed (fingerprints can collide) and extend it
+                int length = 0;
+                while (i + length < t->count && j + length < r->count &&
+                       t->ids[i + length] == r->ids[j + length]) {
+                    length++;
+                }
+                if (length >= k && length > best_length) {
+                    best_length = length;
+                    best_position = j;
+                }
+            }
+        }
+        
+        if (best_length == 0) {
+            i++;
+            continue;
+        }
+        
+        MatchSpan span;
+        span.target_token = i;
+        span.reference_token = best_position;
+        span.length = best_length;
+        span.target_start = t->starts[i];
+        span.target_end = t->ends[i + best_length - 1];
+        span.reference_start = r->starts[best_position];
+        span.reference_end = r->ends[best_position + best_length - 1];
+        match_list_append(matches, span);
+        
+        i += best_length;
+    }
+    
+    free(keys);
+    free(heads);
+    free(next);
+}
+
+// Free the passages of a match list
+void free_match_list(MatchList* matches) {
+    free(matches->spans);
+    matches->spans = NULL;
+    matches->count = 0;
+    matches->capacity = 0;
+    matches->covered_tokens = 0;
+}
+
+// ==================== PERSISTENT REFERENCE INDEX ====================
+
+// Fingerprint with its occurrence count, used while sorting for the index
+typedef struct {
+    uint64_t fingerprint;
+    uint32_t count;
+} FingerprintCount;
+
+static int compare_fingerprint_counts(const void* a, const void* b) {
+    uint64_t x = ((const FingerprintCount*)a)->fingerprint;
+    uint64_t y = ((const FingerprintCount*)b)->fingerprint;
+    return (x > y) - (x < y);
+}
+
+// Pad the file with zeros up to an 8-byte boundary
+static bool write_padding(FILE* file, uint64_t* offset) {
+    static const char zeros[8] = {0};
+    size_t pad = (size_t)((8 - (*offset % 8)) % 8);
+    if (pad > 0 && fwrite(zeros, 1, pad, file) != pad) return false;
+    *offset += pad;
+    return true;
+}
+
+// Index file being written. Documents are appended in order; the document
+// table, the names and the final header follow in index_writer_finish().
+typedef struct {
+    FILE* file;
+    const char* path;
+    IndexHeader header;
+    IndexDocEntry* entries;
+    int capacity;
+    char* names;                 // Concatenated NUL-terminated names
+    size_t names_size;
+    size_t names_capacity;
+    uint64_t offset;
+    bool ok;
+} IndexWriter;
+
+static bool index_writer_open(IndexWriter* writer, const char* index_file, int k) {
+    memset(writer, 0, sizeof(IndexWriter));
+    writer->file = fopen(index_file, "wb");
+    if (writer->file == NULL) {
+        fprintf(stderr, "Error: Could not create index file %s\n", index_file);
+        return false;
+    }
+    writer->path = index_file;
+    memcpy(writer->header.magic, INDEX_MAGIC, sizeof(writer->header.magic));
+    writer->header.version = INDEX_VERSION;
+    writer->header.k_value = (uint32_t)k;
+    
+    // Header is rewritten once all offsets are known
+    writer->ok = fwrite(&writer->header, sizeof(IndexHeader), 1, writer->file) == 1;
+    writer->offset = sizeof(IndexHeader);
+    return true;
+}
+
+// Append one document: its sorted unique fingerprints and their counts
+static void index_writer_add(IndexWriter* writer, const char* name, const uint64_t* fingerprints,
+                             const uint32_t* counts, int unique_count, int kgram_count) {
+    int doc = (int)writer->header.doc_count;
+    if (doc == writer->capacity) {
+        int capacity = writer->capacity > 0 ? writer->capacity * 2 : INITIAL_REFERENCE_CAPACITY;
+        IndexDocEntry* grown = (IndexDocEntry*)realloc(writer->entries, capacity * sizeof(IndexDocEntry));
+        if (grown == NULL) {
+            fprintf(stderr, "Memory allocation failed for index entries\n");
+            exit(EXIT_FAILURE);
+        }
+        writer->entries = grown;
+        writer->capacity = capacity;
+    }
+    
+    size_t length = strlen(name) + 1;
+    if (writer->names_size + length > writer->names_capacity) {
+        size_t capacity = writer->names_capacity > 0 ? writer->names_capacity * 2 : 1024;
+        while (capacity < writer->names_size + length) capacity *= 2;
+        char* grown = (char*)realloc(writer->names, capacity);
+        if (grown == NULL) {
+            fprintf(stderr, "Memory allocation failed for index names\n");
+            exit(EXIT_FAILURE);
+        }
+        writer->names = grown;
+        writer->names_capacity = capacity;
+    }
+    memcpy(writer->names + writer->names_size, name, length);
+    
+    IndexDocEntry* entry = &writer->entries[doc];
+    memset(entry, 0, sizeof(IndexDocEntry));
+    entry->fingerprints_offset = writer->offset;
+    entry->unique_count = (uint32_t)unique_count;
+    entry->kgram_count = (uint32_t)kgram_count;
+    entry->name_offset = (uint32_t)writer->names_size;
+    writer->names_size += length;
+    writer->header.doc_count++;
+    
+    size_t n = (size_t)unique_count;
+    writer->ok = writer->ok && fwrite(fingerprints, sizeof(uint64_t), n, writer->file) == n;
+    writer->offset += (uint64_t)n * sizeof(uint64_t);
+    
+    entry->counts_offset = writer->offset;
+    writer->ok = writer->ok && fwrite(counts, sizeof(uint32_t), n, writer->file) == n;
+    writer->offset += (uint64_t)n * sizeof(uint32_t);
+    writer->ok = writer->ok && write_padding(writer->file, &writer->offset);
+}
+
+// Write the document table, the names and the final header, then close the
+// file. On success writer->offset holds the file size.
+static bool index_writer_finish(IndexWriter* writer) {
+    FILE* file = writer->file;
+    IndexHeader* header = &writer->header;
+    bool ok = writer->ok;
+    
+    header->docs_offset = writer->offset;
+    ok = ok && fwrite(writer->entries, sizeof(IndexDocEntry), header->doc_count, file) == header->doc_count;
+    writer->offset += (uint64_t)header->doc_count * sizeof(IndexDocEntry);
+    
+    header->names_offset = writer->offset;
+    ok = ok && fwrite(writer->names, 1, writer->names_size, file) == writer->names_size;
+    writer->offset += writer->names_size;
+    header->file_size = writer->offset;
+    
+    ok = ok && fseek(file, 0, SEEK_SET) == 0;
+    ok = ok && fwrite(header, sizeof(IndexHeader), 1, file) == 1;
+    ok = (fclose(file) == 0) && ok;
+    free(writer->entries);
+    free(writer->names);
+    
+    if (!ok) {
+        fprintf(stderr, "Error: Failed writing index file %s\n", writer->path);
+    }
+    return ok;
+}
+
+// One reference fingerprinted for the index, sorted by fingerprint
+typedef struct {
+    uint64_t* fingerprints;
+    uint32_t* counts;
+    int unique_count;
+    int kgram_count;
+} IndexedDocument;
+
+// Shared state for fingerprinting a batch of references in parallel
+typedef struct {
+    char** files;                // First file of the current batch
+    const StopwordSet* stopwords;
+    int k;
+    IndexedDocument* results;    // One entry per file in the batch
+} IndexBatchContext;
+
+// Read, preprocess and fingerprint one reference of a batch (thread pool task)
+static void index_document_task(void* context, int i) {
+    IndexBatchContext* batch = (IndexBatchContext*)context;
+    
+    DocumentReader* reader = create_document_reader();
+    set_stopwords(reader, batch->stopwords);
+    ingest_document_stream(reader, batch->files[i], batch->k, false);
+    
+    // Collect and sort the unique fingerprints
+    FingerprintTable* set = reader->fingerprint_set;
+    int unique = set != NULL ? set->count : 0;
+    FingerprintCount* sorted = (FingerprintCount*)malloc((unique + 1) * sizeof(FingerprintCount));
+    uint64_t* fingerprints = (uint64_t*)malloc((unique + 1) * sizeof(uint64_t));
+    uint32_t* counts = (uint32_t*)malloc((unique + 1) * sizeof(uint32_t));
+    if (sorted == NULL || fingerprints == NULL || counts == NULL) {
+        fprintf(stderr, "Memory allocation failed for index fingerprints\n");
+        exit(EXIT_FAILURE);
+    }
+    int n = 0;
+    for (int slot = 0; set != NULL && slot < set->capacity; slot++) {
+        if (set->keys[slot] != 0) {
+            sorted[n].fingerprint = set->keys[slot];
+            sorted[n].count = (uint32_t)set->counts[slot];
+            n++;
+        }
+    }
+    qsort(sorted, n, sizeof(FingerprintCount), compare_fingerprint_counts);
+    for (int j = 0; j < n; j++) {
+        fingerprints[j] = sorted[j].fingerprint;
+        counts[j] = sorted[j].count;
+    }
+    free(sorted);
+    
+    batch->results[i].fingerprints = fingerprints;
+    batch->results[i].counts = counts;
+    batch->results[i].unique_count = n;
+    batch->results[i].kgram_count = reader->kgram_hashes.count;
+    free_document_reader(reader);
+}
+
+// Read, preprocess and fingerprint every reference, then write them to an
+// index file. Layout: header, per-document sorted fingerprints and counts,
+// the IndexDocEntry table, then the document names. report prints the file
+// written (segments are reported by the caller under their final name).
+bool build_reference_index(const char* index_file, char** files, int file_count,
+                           const StopwordSet* stopwords, int k, ThreadPool* pool, bool report) {
+    IndexWriter writer;
+    if (!index_writer_open(&writer, index_file, k)) {
+        return false;
+    }
+    
+    bool parallel = thread_pool_size(pool) > 1;
+    if (parallel) set_progress_output(false);
+    
+    // Fingerprint references in parallel batches, then append them in order
+    int batch_size = thread_pool_size(pool) * 4;
+    IndexBatchContext batch = {files, stopwords, k, NULL};
+    batch.results = (IndexedDocument*)calloc(batch_size, sizeof(IndexedDocument));
+    if (batch.results == NULL) {
+        fprintf(stderr, "Memory allocation failed for index batch\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int i = 0; i < file_count && writer.ok; i++) {
+        int slot = i % batch_size;
+        if (slot == 0) {
+            batch.files = files + i;
+            int count = file_count - i < batch_size ? file_count - i : batch_size;
+            thread_pool_parallel_for(pool, count, index_document_task, &batch);
+        }
+        IndexedDocument* document = &batch.results[slot];
+        index_writer_add(&writer, files[i], document->fingerprints, document->counts,
+                         document->unique_count, document->kgram_count);
+        free(document->fingerprints);
+        free(document->counts);
+        document->fingerprints = NULL;
+        document->counts = NULL;
+    }
+    
+    // Release results left over if writing stopped early
+    for (int i = 0; i < batch_size; i++) {
+        free(batch.results[i].fingerprints);
+        free(batch.results[i].counts);
+    }
+    free(batch.results);
+    if (parallel) set_progress_output(true);
+    
+    if (!index_writer_finish(&writer)) {
+        return false;
+    }
+    if (report) {
+        printf("Index %s written: %d references, %llu bytes\n",
+               index_file, file_count, (unsigned long long)writer.offset);
+    }
+    return true;
+}
+
+// Map a whole file read-only (falls back to reading it on Windows)
+static void* map_file(const char* filename, size_t* size) {
+#ifdef _WIN32
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) return NULL;
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    void* data = malloc(file_size > 0 ? file_size : 1);
+    if (data == NULL || fread(data, 1, file_size, file) != (size_t)file_size) {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    *size = (size_t)file_size;
+    return data;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    
+    void* data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+    
+    *size = (size_t)info.st_size;
+    return data;
+#endif
+}
+
+static void unmap_file(void* data, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    free(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+// Map an index file and validate its layout; nothing is parsed or copied
+MappedIndex* open_reference_index(const char* index_file) {
+    size_t size = 0;
+    void* data = map_file(index_file, &size);
+    if (data == NULL) {
+        fprintf(stderr, "Error: Could not map index file %s\n", index_file);
+        return NULL;
+    }
+    
+    const IndexHeader* header = (const IndexHeader*)data;
+    bool valid = size >= sizeof(IndexHeader) &&
+                 memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->version == INDEX_VERSION &&
+                 header->file_size == size &&
+                 header->docs_offset % 8 == 0 &&
+                 header->docs_offset + (uint64_t)header->doc_count * sizeof(IndexDocEntry) <= size &&
+                 header->names_offset <= size;
+    
+    const IndexDocEntry* docs = (const IndexDocEntry*)((const char*)data + header->docs_offset);
+    for (uint32_t i = 0; valid && i < header->doc_count; i++) {
+        valid = docs[i].fingerprints_offset % 8 == 0 &&
+                docs[i].fingerprints_offset + (uint64_t)docs[i].unique_count * sizeof(uint64_t) <= size &&
+                docs[i].counts_offset + (uint64_t)docs[i].unique_count * sizeof(uint32_t) <= size &&
+                header->names_offset + docs[i].name_offset < size;
+    }
+    
+    if (!valid) {
+        fprintf(stderr, "Error: %s is not a valid reference index\n", index_file);
+        unmap_file(data, size);
+        return NULL;
+    }
+    
+    MappedIndex* index = (MappedIndex*)malloc(sizeof(MappedIndex));
+    if (index == NULL) {
+        fprintf(stderr, "Memory allocation failed for MappedIndex\n");
+        exit(EXIT_FAILURE);
+    }
+    index->data = data;
+    index->size = size;
+    index->header = header;
+    index->docs = docs;
+    index->names = (const char*)data + header->names_offset;
+    return index;
+}
+
+// Name of an indexed reference document
+const char* index_document_name(const MappedIndex* index, int doc) {
+    return index->names + index->docs[doc].name_offset;
+}
+
+// Sorted unique fingerprints of an indexed reference document
+const uint64_t* index_document_fingerprints(const MappedIndex* index, int doc) {
+    return (const uint64_t*)((const char*)index->data + index->docs[doc].fingerprints_offset);
+}
+
+// Occurrence counts matching index_document_fingerprints()
+const uint32_t* index_document_counts(const MappedIndex* index, int doc) {
+    return (const uint32_t*)((const char*)index->data + index->docs[doc].counts_offset);
+}
+
+// Set statistics between a fingerprint set and an indexed fingerprint array
+SetStats index_set_stats(FingerprintTable* set, const uint64_t* fingerprints,
+                         const uint32_t* counts, int count) {
+    SetStats stats = {0, 0, 0, 0, 0.0, 0.0};
+    if (set == NULL) return stats;
+    
+    stats.size1 = set->count;
+    stats.size2 = count;
+    for (int i = 0; i < count; i++) {
+        int other = fingerprint_table_count(set, fingerprints[i]);
+        if (other > 0) {
+            stats.intersection++;
+            stats.dot_product += (double)counts[i] * other;
+        }
+    }
+    stats.union_count = stats.size1 + stats.size2 - stats.intersection;
+    return stats;
+}
+
+// Score a fingerprinted target against every indexed reference
+// (same 60% Jaccard + 40% cosine combination as compare_documents)
+void query_reference_index(const MappedIndex* index, DocumentReader* target, float* scores) {
+    uint64_t timer = metrics_timer_start();
+    for (uint32_t i = 0; i < index->header->doc_count; i++) {
+        SetStats stats = index_set_stats(target->fingerprint_set,
+                                         index_document_fingerprints(index, i),
+                                         index_document_counts(index, i),
+                                         (int)index->docs[i].unique_count);
+        scores[i] = (jaccard_from_stats(&stats) * 0.6) + (cosine_from_stats(&stats) * 0.4);
+    }
+    metrics_add(METRIC_REFERENCES_SCORED, index->header->doc_count);
+    metrics_timer_stop(TIMER_QUERY, timer);
+}
+
+// Unmap an index file
+void close_reference_index(MappedIndex* index) {
+    if (index == NULL) return;
+    unmap_file(index->data, index->size);
+    free(index);
+}
+
+// ==================== COMPRESSED FINGERPRINTS ====================
+
+// Index of the lowest set bit of a nonzero word
+static inline int lowest_set_bit(uint64_t word) {
+#ifdef __GNUC__
+    return __builtin_ctzll(word);
+#else
+    int bit = 0;
+    while ((word & 1) == 0) {
+        word >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+// Store value (less than 2^width) as field i of a bit-packed array
+static void pack_bits(uint64_t* words, uint64_t i, int width, uint64_t value) {
+    if (width == 0) return;
+    uint64_t bit = i * (uint64_t)width;
+    int shift = (int)(bit % 64);
+    words[bit / 64] |= value << shift;
+    if (shift + width > 64) {
+        words[bit / 64 + 1] |= value >> (64 - shift);
+    }
+}
+
+static inline uint64_t unpack_bits(const uint64_t* words, uint64_t i, int width) {
+    if (width == 0) return 0;
+    uint64_t bit = i * (uint64_t)width;
+    int shift = (int)(bit % 64);
+    uint64_t value = words[bit / 64] >> shift;
+    if (shift + width > 64) {
+        value |= words[bit / 64 + 1] << (64 - shift);
+    }
+    return width == 64 ? value : value & ((1ULL << width) - 1);
+}
+
+static uint64_t* allocate_bit_array(uint64_t bits) {
+    uint64_t* words = (uint64_t*)calloc(bits / 64 + 1, sizeof(uint64_t));
+    if (words == NULL) {
+        fprintf(stderr, "Memory allocation failed for compressed fingerprints\n");
+        exit(EXIT_FAILURE);
+    }
+    return words;
+}
+
+// Sort a fingerprint set and pack it in Elias-Fano form
+CompressedFingerprints* compress_fingerprints(FingerprintTable* set) {
+    CompressedFingerprints* compressed = (CompressedFingerprints*)calloc(1, sizeof(CompressedFingerprints));
+    if (compressed == NULL) {
+        fprintf(stderr, "Memory allocation failed for compressed fingerprints\n");
+        exit(EXIT_FAILURE);
+    }
+    int n = set != NULL ? set->count : 0;
+    
+    FingerprintCount* sorted = (FingerprintCount*)malloc((n + 1) * sizeof(FingerprintCount));
+    if (sorted == NULL) {
+        fprintf(stderr, "Memory allocation failed for compressed fingerprints\n");
+        exit(EXIT_FAILURE);
+    }
+    int max_count = 1;
+    for (int i = 0, j = 0; set != NULL && i < set->capacity; i++) {
+        if (set->keys[i] == 0) continue;
+        sorted[j].fingerprint = set->keys[i];
+        sorted[j].count = (uint32_t)set->counts[i];
+        if (set->counts[i] > max_count) max_count = set->counts[i];
+        j++;
+    }
+    qsort(sorted, n, sizeof(FingerprintCount), compare_fingerprint_counts);
+    
+    // Low parts take about log2(universe / n) bits, which leaves about two
+    // high-part bits per value
+    uint64_t max = n > 0 ? sorted[n - 1].fingerprint : 0;
+    int low_bits = 0;
+    while (low_bits < 63 && n > 0 && (max >> (low_bits + 1)) >= (uint64_t)n) {
+        low_bits++;
+    }
+    uint64_t buckets = (max >> low_bits) + 1;
+    int count_bits = 0;
+    while (count_bits < 32 && ((uint64_t)(max_count - 1) >> count_bits) != 0) {
+        count_bits++;
+    }
+    
+    compressed->count = n;
+    compressed->low_bits = low_bits;
+    compressed->count_bits = count_bits;
+    compressed->high_length = (uint64_t)n + buckets;
+    compressed->low = allocate_bit_array((uint64_t)n * low_bits);
+    compressed->high = allocate_bit_array(compressed->high_length);
+    compressed->counts = allocate_bit_array((uint64_t)n * count_bits);
+    compressed->skip_count = (int)(buckets / EF_SKIP_QUANTUM) + 1;
+    compressed->skips = (int*)malloc(compressed->skip_count * sizeof(int));
+    if (compressed->skips == NULL) {
+        fprintf(stderr, "Memory allocation failed for compressed fingerprints\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    uint64_t low_mask = low_bits == 0 ? 0 : (~0ULL >> (64 - low_bits));
+    int next_skip = 0;
+    for (int i = 0; i < n; i++) {
+        uint64_t high = sorted[i].fingerprint >> low_bits;
+        while ((uint64_t)next_skip * EF_SKIP_QUANTUM <= high) {
+            compressed->skips[next_skip++] = i;
+        }
+        uint64_t bit = (uint64_t)i + high;
+        compressed->high[bit / 64] |= 1ULL << (bit % 64);
+        pack_bits(compressed->low, i, low_bits, sorted[i].fingerprint & low_mask);
+        pack_bits(compressed->counts, i, count_bits, sorted[i].count - 1);
+    }
+    while (next_skip < compressed->skip_count) {
+        compressed->skips[next_skip++] = n;
+    }
+    free(sorted);
+    
+    compressed->bytes = sizeof(CompressedFingerprints) +
+        ((uint64_t)n * low_bits / 64 + 1 + compressed->high_length / 64 + 1 +
+         (uint64_t)n * count_bits / 64 + 1) * sizeof(uint64_t) + compressed->skip_count * sizeof(int);
+    return compressed;
+}
+
+// Position in a compressed set; value is valid while index < count
+typedef struct {
+    const CompressedFingerprints* set;
+    int index;
+    uint64_t bit;         // Position of the current value's 1 in the high bits
+    uint64_t value;
+} CompressedCursor;
+
+// Move to the first value whose high-part 1 is at or after `from`
+static void cursor_scan(CompressedCursor* cursor, uint64_t from) {
+    const CompressedFingerprints* set = cursor->set;
+    uint64_t word = from / 64;
+    uint64_t bits = set->high[word] & (~0ULL << (from % 64));
+    while (bits == 0) {
+        bits = set->high[++word];
+    }
+    cursor->bit = word * 64 + lowest_set_bit(bits);
+    cursor->value = ((cursor->bit - cursor->index) << set->low_bits) |
+        unpack_bits(set->low, cursor->index, set->low_bits);
+}
+
+static void cursor_start(CompressedCursor* cursor, const CompressedFingerprints* set) {
+    cursor->set = set;
+    cursor->index = 0;
+    cursor->bit = 0;
+    cursor->value = 0;
+    if (set->count > 0) cursor_scan(cursor, 0);
+}
+
+static inline void cursor_next(CompressedCursor* cursor) {
+    if (++cursor->index < cursor->set->count) {
+        cursor_scan(cursor, cursor->bit + 1);
+    }
+}
+
+// Advance to the first value not below target. Whole blocks of buckets are
+// skipped through the skip pointers, so a seek costs about the same however
+// far it goes.
+static void cursor_seek(CompressedCursor* cursor, uint64_t target) {
+    const CompressedFingerprints* set = cursor->set;
+    if (cursor->index >= set->count || cursor->value >= target) return;
+    uint64_t block = (target >> set->low_bits) / EF_SKIP_QUANTUM;
+    if (block >= (uint64_t)set->skip_count) {
+        cursor->index = set->count;
+        return;
+    }
+    int first = set->skips[block];
+    if (first > cursor->index) {
+        // Value `first` is the first with a 1 at or after this position
+        cursor->index = first;
+        if (first >= set->count) return;
+        cursor_scan(cursor, block * EF_SKIP_QUANTUM + first);
+    }
+    while (cursor->index < set->count && cursor->value < target) {
+        cursor_next(cursor);
+    }
+}
+
+static inline int cursor_count(const CompressedCursor* cursor) {
+    return (int)unpack_bits(cursor->set->counts, cursor->index, cursor->set->count_bits) + 1;
+}
+
+// Same statistics as fingerprint_weighted_stats(), from a merge of the two
+// sorted sets. The side that is behind seeks to the other's value, which
+// gallops over long runs of values the other set does not have.
+SetStats compressed_weighted_stats(const CompressedFingerprints* set1, const CompressedFingerprints* set2,
+                                   const IdfTable* idf) {
+    SetStats stats;
+    compressed_stats_above(set1, set2, idf, NULL, &stats);
+    return stats;
+}
+
+// compressed_weighted_stats() for a top-K search, giving up like
+// fingerprint_stats_above() once the values left in the shorter remainder
+// cannot lift the score above *floor (NULL never gives up)
+bool compressed_stats_above(const CompressedFingerprints* set1, const CompressedFingerprints* set2,
+                            const IdfTable* idf, _Atomic float* floor, SetStats* stats) {
+    *stats = (SetStats){0, 0, 0, 0, 0.0, 0.0};
+    if (set1 == NULL || set2 == NULL) return true;
+    stats->size1 = set1->count;
+    stats->size2 = set2->count;
+    
+    CompressedCursor a, b;
+    cursor_start(&a, set1);
+    cursor_start(&b, set2);
+    int steps = 0;
+    while (a.index < set1->count && b.index < set2->count) {
+        if (a.value < b.value) {
+            cursor_seek(&a, b.value);
+        } else if (b.value < a.value) {
+            cursor_seek(&b, a.value);
+        } else {
+            stats->intersection++;
+            double product = (double)cursor_count(&a) * cursor_count(&b);
+            stats->dot_product += product;
+            if (idf != NULL) {
+                double weight = idf_weight(idf, a.value);
+                stats->weighted_dot += product * weight * weight;
+            }
+            cursor_next(&a);
+            cursor_next(&b);
+        }
+        if (floor != NULL && ++steps % TOP_K_CHECK_INTERVAL == 0) {
+            int left1 = set1->count - a.index, left2 = set2->count - b.index;
+            int bound = stats->intersection + (left1 < left2 ? left1 : left2);
+            if (combined_score_bound(stats->size1, stats->size2, bound, idf != NULL) < atomic_load(floor)) {
+                return false;
+            }
+        }
+    }
+    stats->union_count = stats->size1 + stats->size2 - stats->intersection;
+    return true;
+}
+
+// Decode a compressed set back into a fingerprint table (for index updates)
+FingerprintTable* expand_compressed_fingerprints(const CompressedFingerprints* set) {
+    FingerprintTable* table = create_fingerprint_table(set->count * 2 + 1);
+    CompressedCursor cursor;
+    cursor_start(&cursor, set);
+    while (cursor.index < set->count) {
+        int count = cursor_count(&cursor);
+        for (int c = 0; c < count; c++) {
+            fingerprint_table_insert(table, cursor.value);
+        }
+        cursor_next(&cursor);
+    }
+    return table;
+}
+
+// Drop everything a compressed reference no longer needs: tokens, k-grams,
+// fingerprint tables and winnowing. Only the filename, the MinHash signature
+// and the compressed set stay.
+void compact_document(DocumentReader* reader) {
+    if (reader == NULL || reader->compact || reader->compressed == NULL) return;
+    reader->compressed->token_count = reader->token_list.count;
+    reader->compressed->kgram_count = document_kgram_count(reader);
+    
+    reset_token_list(reader);
+    free(reader->kgram_list.ids);
+    reader->kgram_list.ids = NULL;
+    reader->kgram_list.count = 0;
+    if (reader->kgram_hash != NULL) {
+        free_hash_table(reader->kgram_hash);
+        reader->kgram_hash = NULL;
+    }
+    arena_release(&reader->kgram_arena);
+    free(reader->kgram_hashes.hashes);
+    reader->kgram_hashes.hashes = NULL;
+    reader->kgram_hashes.count = 0;
+    free_fingerprint_table(reader->fingerprint_set);
+    reader->fingerprint_set = NULL;
+    free(reader->winnow.hashes);
+    free(reader->winnow.positions);
+    reader->winnow.hashes = NULL;
+    reader->winnow.positions = NULL;
+    reader->winnow.count = 0;
+    free_fingerprint_table(reader->winnow_set);
+    reader->winnow_set = NULL;
+    reader->compact = true;
+}
+
+void free_compressed_fingerprints(CompressedFingerprints* set) {
+    if (set == NULL) return;
+    free(set->low);
+    free(set->high);
+    free(set->skips);
+    free(set->counts);
+    free(set);
+}
+
+// ==================== SEGMENTED REFERENCE INDEX ====================
+
+// Whether a file is a segment manifest rather than a single index file
+bool is_index_manifest(const char* filename) {
+    char magic[sizeof(MANIFEST_MAGIC)] = {0};
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) return false;
+    size_t length = fread(magic, 1, sizeof(magic) - 1, file);
+    fclose(file);
+    return length == sizeof(magic) - 1 && memcmp(magic, MANIFEST_MAGIC, length) == 0;
+}
+
+// Segment files sit next to the manifest: INDEX.seg1, INDEX.seg2, ...
+static char* segment_file_name(const char* manifest_file, int id) {
+    size_t length = strlen(manifest_file) + 16;
+    char* file = (char*)malloc(length);
+    if (file == NULL) {
+        fprintf(stderr, "Memory allocation failed for segment name\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(file, length, "%s.seg%d", manifest_file, id);
+    return file;
+}
+
+// The manifest names segments relative to its own directory
+static char* manifest_relative_path(const char* manifest_file, const char* name) {
+    const char* slash = strrchr(manifest_file, '/');
+    size_t dir_length = slash != NULL ? (size_t)(slash - manifest_file) + 1 : 0;
+    char* path = (char*)malloc(dir_length + strlen(name) + 1);
+    if (path == NULL) {
+        fprintf(stderr, "Memory allocation failed for segment path\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(path, manifest_file, dir_length);
+    strcpy(path + dir_length, name);
+    return path;
+}
+
+static const char* file_base_name(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash != NULL ? slash + 1 : path;
+}
+
+// Lock INDEX.lock, which processes take exclusively to update the manifest
+// and shared while they map its segments. Returns the descriptor to pass to
+// unlock_index, or -1 if the lock could not be taken.
+static int lock_index(const SegmentedIndex* index, bool exclusive) {
+#ifndef _WIN32
+    size_t length = strlen(index->manifest_file) + 6;
+    char* lock_file = (char*)malloc(length);
+    if (lock_file == NULL) {
+        fprintf(stderr, "Memory allocation failed for lock file name\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(lock_file, length, "%s.lock", index->manifest_file);
+    int fd = open(lock_file, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 && !exclusive) {
+        fd = open(lock_file, O_RDONLY);
+    }
+    free(lock_file);
+    if (fd < 0) return -1;
+    
+    while (flock(fd, exclusive ? LOCK_EX : LOCK_SH) != 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+#else
+    // Windows builds serialize updates within the process only
+    (void)index;
+    (void)exclusive;
+    return 0;
+#endif
+}
+
+static void unlock_index(int fd) {
+#ifndef _WIN32
+    if (fd >= 0) close(fd);
+#else
+    (void)fd;
+#endif
+}
+
+// Segment of a snapshot by id, or NULL
+static IndexSegment* find_index_segment(const IndexSnapshot* snapshot, int id) {
+    for (int i = 0; i < snapshot->segment_count; i++) {
+        if (snapshot->segments[i]->id == id) return snapshot->segments[i];
+    }
+    return NULL;
+}
+
+// Map one segment file; it starts with no references
+static IndexSegment* open_index_segment(const char* file, int id) {
+    MappedIndex* mapped = open_reference_index(file);
+    if (mapped == NULL) return NULL;
+    
+    IndexSegment* segment = (IndexSegment*)malloc(sizeof(IndexSegment));
+    if (segment == NULL) {
+        fprintf(stderr, "Memory allocation failed for IndexSegment\n");
+        exit(EXIT_FAILURE);
+    }
+    segment->id = id;
+    segment->file = strdup(file);
+    segment->index = mapped;
+    atomic_init(&segment->references, 0);
+    return segment;
+}
+
+// Drop a snapshot's reference; the last one unmaps the segment
+static void release_index_segment(IndexSegment* segment) {
+    if (atomic_fetch_sub(&segment->references, 1) == 1) {
+        close_reference_index(segment->index);
+        free(segment->file);
+        free(segment);
+    }
+}
+
+// New empty snapshot; the caller holds its only reference
+static IndexSnapshot* create_index_snapshot(int k) {
+    IndexSnapshot* snapshot = (IndexSnapshot*)calloc(1, sizeof(IndexSnapshot));
+    if (snapshot == NULL) {
+        fprintf(stderr, "Memory allocation failed for IndexSnapshot\n");
+        exit(EXIT_FAILURE);
+    }
+    snapshot->k_value = k;
+    atomic_init(&snapshot->references, 1);
+    return snapshot;
+}
+
+static void snapshot_add_segment(IndexSnapshot* snapshot, IndexSegment* segment) {
+    IndexSegment** grown = (IndexSegment**)realloc(snapshot->segments,
+                                                   (snapshot->segment_count + 1) * sizeof(IndexSegment*));
+    if (grown == NULL) {
+        fprintf(stderr, "Memory allocation failed for index segments\n");
+        exit(EXIT_FAILURE);
+    }
+    snapshot->segments = grown;
+    snapshot->segments[snapshot->segment_count++] = segment;
+    atomic_fetch_add(&segment->references, 1);
+}
+
+// Binary search for a name; returns its position or where it would be inserted
+static int find_tombstone_position(const IndexSnapshot* snapshot, const char* name, bool* found) {
+    int low = 0;
+    int high = snapshot->tombstone_count;
+    *found = false;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        int order = strcmp(snapshot->tombstones[middle].name, name);
+        if (order == 0) {
+            *found = true;
+            return middle;
+        }
+        if (order < 0) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+// Hide a name in segments older than before_segment. A name keeps only its
+// newest tombstone, which hides everything the older ones did.
+static void snapshot_set_tombstone(IndexSnapshot* snapshot, const char* name, int before_segment) {
+    bool found = false;
+    int position = find_tombstone_position(snapshot, name, &found);
+    if (found) {
+        Tombstone* tombstone = &snapshot->tombstones[position];
+        if (tombstone->before_segment < before_segment) {
+            tombstone->before_segment = before_segment;
+        }
+        return;
+    }
+    
+    Tombstone* grown = (Tombstone*)realloc(snapshot->tombstones,
+                                           (snapshot->tombstone_count + 1) * sizeof(Tombstone));
+    if (grown == NULL) {
+        fprintf(stderr, "Memory allocation failed for index tombstones\n");
+        exit(EXIT_FAILURE);
+    }
+    snapshot->tombstones = grown;
+    memmove(&grown[position + 1], &grown[position],
+            (snapshot->tombstone_count - position) * sizeof(Tombstone));
+    grown[position].name = strdup(name);
+    grown[position].before_segment = before_segment;
+    snapshot->tombstone_count++;
+}
+
+// Snapshot sharing the segments of another one, ready to be modified
+static IndexSnapshot* copy_index_snapshot(const IndexSnapshot* source) {
+    IndexSnapshot* snapshot = create_index_snapshot(source->k_value);
+    for (int i = 0; i < source->segment_count; i++) {
+        snapshot_add_segment(snapshot, source->segments[i]);
+    }
+    for (int i = 0; i < source->tombstone_count; i++) {
+        snapshot_set_tombstone(snapshot, source->tombstones[i].name, source->tombstones[i].before_segment);
+    }
+    return snapshot;
+}
+
+// Whether a document of a segment has not been removed or replaced
+static bool index_document_live(const IndexSnapshot* snapshot, const IndexSegment* segment, int doc) {
+    bool found = false;
+    int position = find_tombstone_position(snapshot, index_document_name(segment->index, doc), &found);
+    return !found || segment->id >= snapshot->tombstones[position].before_segment;
+}
+
+// Replace the manifest atomically: write a temporary file, then rename it
+static bool write_index_manifest(const SegmentedIndex* index, const IndexSnapshot* snapshot) {
+    size_t length = strlen(index->manifest_file) + 5;
+    char* temp_file = (char*)malloc(length);
+    if (temp_file == NULL) {
+        fprintf(stderr, "Memory allocation failed for manifest name\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(temp_file, length, "%s.tmp", index->manifest_file);
+    
+    FILE* file = fopen(temp_file, "w");
+    bool ok = file != NULL;
+    ok = ok && fprintf(file, "%s %d\nk %d\nnext %d\n", MANIFEST_MAGIC, MANIFEST_VERSION,
+                       snapshot->k_value, index->next_segment) > 0;
+    for (int i = 0; ok && i < snapshot->segment_count; i++) {
+        ok = fprintf(file, "segment %d %s\n", snapshot->segments[i]->id,
+                     file_base_name(snapshot->segments[i]->file)) > 0;
+    }
+    for (int i = 0; ok && i < snapshot->tombstone_count; i++) {
+        ok = fprintf(file, "tombstone %d %s\n", snapshot->tombstones[i].before_segment,
+                     snapshot->tombstones[i].name) > 0;
+    }
+    if (file != NULL) {
+        ok = (fclose(file) == 0) && ok;
+    }
+#ifdef _WIN32
+    // rename() does not replace existing files on Windows
+    if (ok) remove(index->manifest_file);
+#endif
+    ok = ok && rename(temp_file, index->manifest_file) == 0;
+    
+    if (!ok) {
+        fprintf(stderr, "Error: Could not write index manifest %s\n", index->manifest_file);
+        remove(temp_file);
+    }
+    free(temp_file);
+    return ok;
+}
+
+// Read the manifest lines into a snapshot, mapping every segment the current
+// snapshot does not have mapped already
+static bool load_index_manifest(SegmentedIndex* index, FILE* file, IndexSnapshot* snapshot) {
+    char line[MAX_MANIFEST_LINE];
+    int version = 0;
+    if (fgets(line, sizeof(line), file) == NULL ||
+        sscanf(line, MANIFEST_MAGIC " %d", &version) != 1 || version != MANIFEST_VERSION) {
+        fprintf(stderr, "Error: %s is not a valid index manifest\n", index->manifest_file);
+        return false;
+    }
+    
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        int value = 0;
+        int name_offset = 0;
+        
+        if (sscanf(line, "k %d", &value) == 1) {
+            snapshot->k_value = value;
+        } else if (sscanf(line, "next %d", &value) == 1) {
+            index->next_segment = value;
+        } else if (sscanf(line, "segment %d %n", &value, &name_offset) == 1 && name_offset > 0) {
+            char* path = manifest_relative_path(index->manifest_file, line + name_offset);
+            IndexSegment* segment = index->current != snapshot ?
+                                    find_index_segment(index->current, value) : NULL;
+            if (segment == NULL || strcmp(segment->file, path) != 0) {
+                segment = open_index_segment(path, value);
+            }
+            free(path);
+            if (segment == NULL) {
+                ok = false;
+            } else {
+                snapshot_add_segment(snapshot, segment);
+                if (segment->index->header->k_value != (uint32_t)snapshot->k_value) {
+                    fprintf(stderr, "Error: Segment %s was built with k=%u, index uses k=%d\n",
+                            segment->file, segment->index->header->k_value, snapshot->k_value);
+                    ok = false;
+                }
+            }
+        } else if (sscanf(line, "tombstone %d %n", &value, &name_offset) == 1 && name_offset > 0) {
+            snapshot_set_tombstone(snapshot, line + name_offset, value);
+        } else if (line[0] != '\0') {
+            fprintf(stderr, "Error: Unexpected line in index manifest %s: %s\n",
+                    index->manifest_file, line);
+            ok = false;
+        }
+    }
+    
+    if (ok && snapshot->k_value <= 0) {
+        fprintf(stderr, "Error: Index manifest %s has no k value\n", index->manifest_file);
+        ok = false;
+    }
+    return ok;
+}
+
+// Open the index described by a manifest file. With create, a missing
+// manifest starts a new empty index for the given k.
+SegmentedIndex* open_segmented_index(const char* manifest_file, int k, bool create) {
+    SegmentedIndex* index = (SegmentedIndex*)calloc(1, sizeof(SegmentedIndex));
+    if (index == NULL) {
+        fprintf(stderr, "Memory allocation failed for SegmentedIndex\n");
+        exit(EXIT_FAILURE);
+    }
+    index->manifest_file = strdup(manifest_file);
+    pthread_mutex_init(&index->update_lock, NULL);
+    pthread_mutex_init(&index->snapshot_lock, NULL);
+    pthread_cond_init(&index->compaction_done, NULL);
+    index->current = create_index_snapshot(k);
+    index->next_segment = 1;
+    index->compacting = false;
+    
+    // Segments are mapped under a shared lock, so compaction cannot remove
+    // them between reading the manifest and opening them
+    int lock = lock_index(index, create);
+    FILE* file = fopen(manifest_file, "r");
+    bool ok;
+    if (file != NULL) {
+        ok = load_index_manifest(index, file, index->current);
+        fclose(file);
+    } else if (create) {
+        ok = write_index_manifest(index, index->current);
+    } else {
+        fprintf(stderr, "Error: Could not open index manifest %s\n", manifest_file);
+        ok = false;
+    }
+    unlock_index(lock);
+    
+    if (!ok) {
+        close_segmented_index(index);
+        return NULL;
+    }
+    return index;
+}
+
+// Take a reference to the current snapshot; it stays valid until released,
+// whatever updates happen meanwhile
+IndexSnapshot* acquire_index_snapshot(SegmentedIndex* index) {
+    pthread_mutex_lock(&index->snapshot_lock);
+    IndexSnapshot* snapshot = index->current;
+    atomic_fetch_add(&snapshot->references, 1);
+    pthread_mutex_unlock(&index->snapshot_lock);
+    return snapshot;
+}
+
+// Drop a reference; the last one releases the snapshot's segments
+void release_index_snapshot(IndexSnapshot* snapshot) {
+    if (snapshot == NULL || atomic_fetch_sub(&snapshot->references, 1) != 1) return;
+    
+    for (int i = 0; i < snapshot->segment_count; i++) {
+        release_index_segment(snapshot->segments[i]);
+    }
+    for (int i = 0; i < snapshot->tombstone_count; i++) {
+        free(snapshot->tombstones[i].name);
+    }
+    free(snapshot->segments);
+    free(snapshot->tombstones);
+    free(snapshot);
+}
+
+// Record a snapshot in the manifest and make it current (update_lock held).
+// Takes over the caller's reference.
+static bool publish_index_snapshot(SegmentedIndex* index, IndexSnapshot* snapshot) {
+    if (!write_index_manifest(index, snapshot)) {
+        release_index_snapshot(snapshot);
+        return false;
+    }
+    pthread_mutex_lock(&index->snapshot_lock);
+    IndexSnapshot* previous = index->current;
+    index->current = snapshot;
+    pthread_mutex_unlock(&index->snapshot_lock);
+    
+    release_index_snapshot(previous);
+    return true;
+}
+
+// Lock the index for an update (update_lock held) and reload the manifest,
+// which other processes may have changed. Returns the lock for unlock_index,
+// or -1 on failure.
+static int begin_index_update(SegmentedIndex* index) {
+    int lock = lock_index(index, true);
+    if (lock < 0) {
+        fprintf(stderr, "Error: Could not lock index %s\n", index->manifest_file);
+        return -1;
+    }
+    
+    FILE* file = fopen(index->manifest_file, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open index manifest %s\n", index->manifest_file);
+        unlock_index(lock);
+        return -1;
+    }
+    IndexSnapshot* snapshot = create_index_snapshot(index->current->k_value);
+    bool ok = load_index_manifest(index, file, snapshot);
+    fclose(file);
+    if (!ok) {
+        release_index_snapshot(snapshot);
+        unlock_index(lock);
+        return -1;
+    }
+    
+    pthread_mutex_lock(&index->snapshot_lock);
+    IndexSnapshot* previous = index->current;
+    index->current = snapshot;
+    pthread_mutex_unlock(&index->snapshot_lock);
+    release_index_snapshot(previous);
+    return lock;
+}
+
+// Reserve the next segment id by creating its file exclusively, so no other
+// process writes the same segment (index locked). Returns the file name.
+static char* claim_segment_file(SegmentedIndex* index, int* id) {
+    for (;;) {
+        char* file = segment_file_name(index->manifest_file, index->next_segment);
+        FILE* claimed = fopen(file, "wbx");
+        if (claimed != NULL) {
+            fclose(claimed);
+            *id = index->next_segment++;
+            return file;
+        }
+        if (errno != EEXIST) {
+            fprintf(stderr, "Error: Could not create index segment %s\n", file);
+            free(file);
+            return NULL;
+        }
+        // Left behind by an update that did not finish
+        free(file);
+        index->next_segment++;
+    }
+}
+
+// Private name a new segment is built under before it gets its id
+static char* temporary_segment_name(const char* manifest_file) {
+    size_t length = strlen(manifest_file) + 32;
+    char* file = (char*)malloc(length);
+    if (file == NULL) {
+        fprintf(stderr, "Memory allocation failed for segment name\n");
+        exit(EXIT_FAILURE);
+    }
+#ifndef _WIN32
+    snprintf(file, length, "%s.add%ld.tmp", manifest_file, (long)getpid());
+#else
+    snprintf(file, length, "%s.add%ld.tmp", manifest_file, (long)_getpid());
+#endif
+    return file;
+}
+
+// Number of documents a query of the snapshot scores
+int index_snapshot_document_count(const IndexSnapshot* snapshot) {
+    int count = 0;
+    for (int i = 0; i < snapshot->segment_count; i++) {
+        const IndexSegment* segment = snapshot->segments[i];
+        for (int doc = 0; doc < (int)segment->index->header->doc_count; doc++) {
+            if (index_document_live(snapshot, segment, doc)) count++;
+        }
+    }
+    return count;
+}
+
+// Score a fingerprinted target against every live document, oldest segment
+// first. scores needs index_snapshot_document_count() entries; returns the
+// number written.
+int query_index_snapshot(const IndexSnapshot* snapshot, DocumentReader* target, IndexScore* scores) {
+    int count = 0;
+    for (int i = 0; i < snapshot->segment_count; i++) {
+        const IndexSegment* segment = snapshot->segments[i];
+        int doc_count = (int)segment->index->header->doc_count;
+        float* segment_scores = (float*)calloc(doc_count + 1, sizeof(float));
+        if (segment_scores == NULL) {
+            fprintf(stderr, "Memory allocation failed for scores\n");
+            exit(EXIT_FAILURE);
+        }
+        query_reference_index(segment->index, target, segment_scores);
+        
+        for (int doc = 0; doc < doc_count; doc++) {
+            if (index_document_live(snapshot, segment, doc)) {
+                scores[count].name = index_document_name(segment->index, doc);
+                scores[count].score = segment_scores[doc];
+                count++;
+            }
+        }
+        free(segment_scores);
+    }
+    return count;
+}
+
+// Tombstone older copies of the documents in a new segment, so that adding a
+// file again replaces it
+static void hide_replaced_documents(IndexSnapshot* snapshot, const IndexSegment* added) {
+    int added_count = (int)added->index->header->doc_count;
+    const char** names = (const char**)malloc((added_count + 1) * sizeof(const char*));
+    if (names == NULL) {
+        fprintf(stderr, "Memory allocation failed for segment names\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int doc = 0; doc < added_count; doc++) {
+        names[doc] = index_document_name(added->index, doc);
+    }
+    qsort(names, added_count, sizeof(const char*), compare_paths);
+    
+    for (int i = 0; i < snapshot->segment_count; i++) {
+        const IndexSegment* segment = snapshot->segments[i];
+        for (int doc = 0; doc < (int)segment->index->header->doc_count; doc++) {
+            const char* name = index_document_name(segment->index, doc);
+            if (bsearch(&name, names, added_count, sizeof(const char*), compare_paths) != NULL &&
+                index_document_live(snapshot, segment, doc)) {
+                snapshot_set_tombstone(snapshot, name, added->id);
+            }
+        }
+    }
+    free(names);
+}
+
+static void start_compaction_locked(SegmentedIndex* index);
+
+// Fingerprint references into a new segment and publish it. Only the new
+// documents are processed; queries see them as soon as this returns.
+bool add_index_segment(SegmentedIndex* index, char** files, int file_count,
+                       const StopwordSet* stopwords, ThreadPool* pool) {
+    pthread_mutex_lock(&index->update_lock);
+    
+    // Build under a private name without the index lock, so that other
+    // processes can update the index meanwhile; the id is taken on publishing
+    char* temp_file = temporary_segment_name(index->manifest_file);
+    bool built = build_reference_index(temp_file, files, file_count, stopwords,
+                                       index->current->k_value, pool, false);
+    int lock = built ? begin_index_update(index) : -1;
+    int id = 0;
+    char* file = lock >= 0 ? claim_segment_file(index, &id) : NULL;
+    IndexSegment* segment = NULL;
+    if (file != NULL) {
+#ifdef _WIN32
+        remove(file);
+#endif
+        if (rename(temp_file, file) == 0) {
+            segment = open_index_segment(file, id);
+        }
+        if (segment != NULL) {
+            printf("Segment %s written: %d references, %llu bytes\n", file,
+                   (int)segment->index->header->doc_count, (unsigned long long)segment->index->size);
+        }
+    }
+    
+    bool ok = false;
+    if (segment != NULL) {
+        // Only updates replace the current snapshot, and they hold both locks
+        IndexSnapshot* snapshot = copy_index_snapshot(index->current);
+        hide_replaced_documents(snapshot, segment);
+        snapshot_add_segment(snapshot, segment);
+        
+        ok = publish_index_snapshot(index, snapshot);
+        if (ok && snapshot->segment_count > MAX_INDEX_SEGMENTS) {
+            start_compaction_locked(index);
+        }
+    }
+    if (!ok && file != NULL) {
+        remove(file);
+    }
+    remove(temp_file);
+    
+    if (lock >= 0) unlock_index(lock);
+    pthread_mutex_unlock(&index->update_lock);
+    free(file);
+    free(temp_file);
+    return ok;
+}
+
+// Hide documents by name in all existing segments. Returns how many live
+// documents were removed, or -1 if the manifest could not be updated.
+int remove_index_documents(SegmentedIndex* index, char** names, int name_count) {
+    pthread_mutex_lock(&index->update_lock);
+    int lock = begin_index_update(index);
+    if (lock < 0) {
+        pthread_mutex_unlock(&index->update_lock);
+        return -1;
+    }
+    
+    IndexSnapshot* snapshot = copy_index_snapshot(index->current);
+    int removed = 0;
+    for (int n = 0; n < name_count; n++) {
+        int live = 0;
+        for (int i = 0; i < snapshot->segment_count; i++) {
+            const IndexSegment* segment = snapshot->segments[i];
+            for (int doc = 0; doc < (int)segment->index->header->doc_count; doc++) {
+                if (strcmp(index_document_name(segment->index, doc), names[n]) == 0 &&
+                    index_document_live(snapshot, segment, doc)) {
+                    live++;
+                }
+            }
+        }
+        if (live > 0) {
+            snapshot_set_tombstone(snapshot, names[n], index->next_segment);
+            removed += live;
+        }
+    }
+    
+    if (removed == 0) {
+        release_index_snapshot(snapshot);
+    } else if (!publish_index_snapshot(index, snapshot)) {
+        removed = -1;
+    }
+    unlock_index(lock);
+    pthread_mutex_unlock(&index->update_lock);
+    return removed;
+}
+
+// Whether a snapshot still lists every segment of a base snapshot
+static bool snapshot_has_segments(const IndexSnapshot* snapshot, const IndexSnapshot* base) {
+    for (int i = 0; i < base->segment_count; i++) {
+        if (find_index_segment(snapshot, base->segments[i]->id) == NULL) return false;
+    }
+    return true;
+}
+
+// Write the live documents of a base snapshot to segment id, then publish it
+// in place of the base segments. Updates made meanwhile are kept: their
+// segments and tombstones have ids above the merged one. If another process
+// compacted the base segments first, the merged segment is dropped. Clears
+// compacting.
+static bool merge_index_segments(SegmentedIndex* index, IndexSnapshot* base, int id) {
+    char* file = segment_file_name(index->manifest_file, id);
+    IndexWriter writer;
+    bool ok = index_writer_open(&writer, file, base->k_value);
+    int merged = 0;
+    
+    for (int i = 0; ok && i < base->segment_count; i++) {
+        const IndexSegment* segment = base->segments[i];
+        for (int doc = 0; doc < (int)segment->index->header->doc_count; doc++) {
+            if (!index_document_live(base, segment, doc)) continue;
+            index_writer_add(&writer, index_document_name(segment->index, doc),
+                             index_document_fingerprints(segment->index, doc),
+                             index_document_counts(segment->index, doc),
+                             (int)segment->index->docs[doc].unique_count,
+                             (int)segment->index->docs[doc].kgram_count);
+            merged++;
+        }
+    }
+    ok = ok && index_writer_finish(&writer);
+    IndexSegment* segment = ok ? open_index_segment(file, id) : NULL;
+    
+    pthread_mutex_lock(&index->update_lock);
+    int lock = segment != NULL ? begin_index_update(index) : -1;
+    bool published = false;
+    ok = false;
+    if (lock >= 0 && snapshot_has_segments(index->current, base)) {
+        IndexSnapshot* current = index->current;
+        IndexSnapshot* snapshot = create_index_snapshot(base->k_value);
+        snapshot_add_segment(snapshot, segment);
+        for (int i = 0; i < current->segment_count; i++) {
+            if (current->segments[i]->id > id) {
+                snapshot_add_segment(snapshot, current->segments[i]);
+            }
+        }
+        for (int i = 0; i < current->tombstone_count; i++) {
+            if (current->tombstones[i].before_segment > id) {
+                snapshot_set_tombstone(snapshot, current->tombstones[i].name,
+                                       current->tombstones[i].before_segment);
+            }
+        }
+        published = true;
+        ok = publish_index_snapshot(index, snapshot);
+        if (ok) {
+            // Removed while the index is locked, so that other processes
+            // open the new manifest instead. Snapshots still in use keep
+            // the old segments mapped.
+            for (int i = 0; i < base->segment_count; i++) {
+                remove(base->segments[i]->file);
+            }
+        }
+    }
+    if (lock >= 0) unlock_index(lock);
+    
+    if (segment != NULL && !published) {
+        close_reference_index(segment->index);
+        free(segment->file);
+        free(segment);
+    }
+    if (ok) {
+        printf("Compacted %d segments into %s: %d references\n",
+               base->segment_count, file, merged);
+    } else {
+        remove(file);
+    }
+    release_index_snapshot(base);
+    free(file);
+    
+    // Cleared last: the program may exit as soon as nothing is compacting
+    index->compacting = false;
+    pthread_cond_broadcast(&index->compaction_done);
+    pthread_mutex_unlock(&index->update_lock);
+    return ok;
+}
+
+// Claim the compaction and reserve its segment id (update_lock held, index
+// locked). Sets the base snapshot, or NULL if there is nothing to compact;
+// returns false if the id could not be reserved.
+static bool begin_compaction(SegmentedIndex* index, IndexSnapshot** base, int* id) {
+    IndexSnapshot* current = index->current;
+    *base = NULL;
+    if (current->segment_count <= 1 && current->tombstone_count == 0) {
+        return true;
+    }
+    char* file = claim_segment_file(index, id);
+    if (file == NULL) return false;
+    
+    // Record the reserved id, so that tombstones other processes add
+    // meanwhile apply after the merged segment
+    if (!write_index_manifest(index, current)) {
+        remove(file);
+        free(file);
+        return false;
+    }
+    free(file);
+    index->compacting = true;
+    atomic_fetch_add(&current->references, 1);
+    *base = current;
+    return true;
+}
+
+// Merge all segments into one, dropping removed and replaced documents.
+// Queries keep running on the old segments until the merged one is published.
+bool compact_segmented_index(SegmentedIndex* index) {
+    pthread_mutex_lock(&index->update_lock);
+    while (index->compacting) {
+        pthread_cond_wait(&index->compaction_done, &index->update_lock);
+    }
+    int id = 0;
+    IndexSnapshot* base = NULL;
+    int lock = begin_index_update(index);
+    bool ok = lock >= 0 && begin_compaction(index, &base, &id);
+    if (lock >= 0) unlock_index(lock);
+    pthread_mutex_unlock(&index->update_lock);
+    
+    if (base == NULL) return ok;
+    return merge_index_segments(index, base, id);
+}
+
+// Work item of a background compaction thread
+typedef struct {
+    SegmentedIndex* index;
+    IndexSnapshot* base;
+    int id;
+} CompactionTask;
+
+static void* compaction_thread(void* argument) {
+    CompactionTask task = *(CompactionTask*)argument;
+    free(argument);
+    merge_index_segments(task.index, task.base, task.id);
+    return NULL;
+}
+
+// Start compacting on a detached thread unless one is running (update_lock
+// held, index locked)
+static void start_compaction_locked(SegmentedIndex* index) {
+    if (index->compacting) return;
+    
+    CompactionTask* task = (CompactionTask*)malloc(sizeof(CompactionTask));
+    if (task == NULL) {
+        fprintf(stderr, "Memory allocation failed for compaction task\n");
+        exit(EXIT_FAILURE);
+    }
+    task->index = index;
+    if (!begin_compaction(index, &task->base, &task->id) || task->base == NULL) {
+        free(task);
+        return;
+    }
+    
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, compaction_thread, task) != 0) {
+        // Compaction only saves space and query time; try again on a later update
+        char* file = segment_file_name(index->manifest_file, task->id);
+        remove(file);
+        free(file);
+        index->compacting = false;
+        release_index_snapshot(task->base);
+        free(task);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+// Compact in the background; updates and queries continue meanwhile
+void start_background_compaction(SegmentedIndex* index) {
+    pthread_mutex_lock(&index->update_lock);
+    int lock = begin_index_update(index);
+    if (lock >= 0) {
+        start_compaction_locked(index);
+        unlock_index(lock);
+    }
+    pthread_mutex_unlock(&index->update_lock);
+}
+
+// Block until a running background compaction has finished
+void wait_for_compaction(SegmentedIndex* index) {
+    pthread_mutex_lock(&index->update_lock);
+    while (index->compacting) {
+        pthread_cond_wait(&index->compaction_done, &index->update_lock);
+    }
+    pthread_mutex_unlock(&index->update_lock);
+}
+
+// Wait for compaction, then release the index
+void close_segmented_index(SegmentedIndex* index) {
+    if (index == NULL) return;
+    wait_for_compaction(index);
+    release_index_snapshot(index->current);
+    pthread_cond_destroy(&index->compaction_done);
+    pthread_mutex_destroy(&index->snapshot_lock);
+    pthread_mutex_destroy(&index->update_lock);
+    free(index->manifest_file);
+    free(index);
+}
+
+// ==================== CORPUS DEDUPLICATION ====================
+
+// Shared state for all-pairs scoring; each block of rows owns its output list
+typedef struct {
+    DocumentReader** readers;
+    int count;
+    ComparisonEngine engine;
+    InvertedIndex* index;
+    float threshold;
+    DuplicatePair** block_pairs;
+    int* block_counts;
+} DedupContext;
+
+static FingerprintTable* dedup_fingerprint_set(const DedupContext* dedup, int doc) {
+    DocumentReader* reader = dedup->readers[doc];
+    if (reader == NULL) return NULL;
+    return dedup->engine == ENGINE_WINNOWING ? reader->winnow_set : reader->fingerprint_set;
+}
+
+// One block of rows of the sparse shared-k-gram matrix (thread pool task).
+// For each row document, its fingerprints' posting lists are walked and the
+// shared count of every later document is accumulated in a dense array;
+// only the documents touched are visited again, reset and turned into pairs.
+static void dedup_block_task(void* context, int block) {
+    DedupContext* dedup = (DedupContext*)context;
+    InvertedIndex* index = dedup->index;
+    int first_row = block * DEDUP_BLOCK_ROWS;
+    int last_row = first_row + DEDUP_BLOCK_ROWS < dedup->count ? first_row + DEDUP_BLOCK_ROWS : dedup->count;
+    
+    int* shared = (int*)calloc(dedup->count, sizeof(int));
+    int* touched = (int*)malloc(dedup->count * sizeof(int));
+    DuplicatePair* pairs = NULL;
+    int pair_count = 0, pair_capacity = 0;
+    if (shared == NULL || touched == NULL) {
+        fprintf(stderr, "Memory allocation failed for deduplication\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int row = first_row; row < last_row; row++) {
+        FingerprintTable* set = dedup_fingerprint_set(dedup, row);
+        if (set == NULL || set->count == 0) continue;
+        
+        int touched_count = 0;
+        for (int i = 0; i < set->capacity; i++) {
+            if (set->keys[i] == 0) continue;
+            int slot = inverted_find_slot(index, set->keys[i]);
+            for (int p = index->heads[slot]; p != -1; p = index->posting_next[p]) {
+                int column = index->posting_doc[p];
+                if (column <= row) continue;  // Each pair once, from its lower row
+                if (shared[column]++ == 0) touched[touched_count++] = column;
+            }
+        }
+        
+        for (int t = 0; t < touched_count; t++) {
+            int column = touched[t];
+            SetStats stats = {set->count, index->doc_sizes[column], shared[column], 0, 0.0, 0.0};
+            stats.union_count = stats.size1 + stats.size2 - stats.intersection;
+            shared[column] = 0;
+            
+            float jaccard = jaccard_from_stats(&stats);
+            float cosine = cosine_from_stats(&stats);
+            float score = jaccard * 0.6 + cosine * 0.4;
+            if (score < dedup->threshold) continue;
+            
+            if (pair_count == pair_capacity) {
+                pair_capacity = pair_capacity == 0 ? 16 : pair_capacity * 2;
+                pairs = (DuplicatePair*)realloc(pairs, pair_capacity * sizeof(DuplicatePair));
+                if (pairs == NULL) {
+                    fprintf(stderr, "Memory allocation failed for duplicate pairs\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            DuplicatePair pair = {row, column, stats.intersection, jaccard, cosine, score};
+            pairs[pair_count++] = pair;
+        }
+    }
+    
+    free(shared);
+    free(touched);
+    dedup->block_pairs[block] = pairs;
+    dedup->block_counts[block] = pair_count;
+}
+
+// All-pairs similarity of a batch as a sparse matrix product: an inverted
+// index from fingerprint to documents is built once, then blocks of
+// DEDUP_BLOCK_ROWS rows are scored in parallel. Only pairs sharing at least
+// one k-gram are ever visited and only those scoring at least `threshold`
+// are kept. Returns the pairs (caller frees) in row order.
+DuplicatePair* find_duplicate_pairs(DocumentReader** readers, int count, ComparisonEngine engine,
+                                    float threshold, ThreadPool* pool, int* pair_count) {
+    DedupContext dedup = {readers, count, engine, NULL, threshold, NULL, NULL};
+    dedup.index = create_inverted_index(0, engine, 0);
+    for (int doc = 0; doc < count; doc++) {
+        inverted_index_add(dedup.index, dedup_fingerprint_set(&dedup, doc), doc);
+    }
+    dedup.index->indexed_count = count;
+    
+    int blocks = (count + DEDUP_BLOCK_ROWS - 1) / DEDUP_BLOCK_ROWS;
+    dedup.block_pairs = (DuplicatePair**)calloc(blocks + 1, sizeof(DuplicatePair*));
+    dedup.block_counts = (int*)calloc(blocks + 1, sizeof(int));
+    if (dedup.block_pairs == NULL || dedup.block_counts == NULL) {
+        fprintf(stderr, "Memory allocation failed for deduplication\n");
+        exit(EXIT_FAILURE);
+    }
+    thread_pool_parallel_for(pool, blocks, dedup_block_task, &dedup);
+    
+    // Concatenate the blocks in row order
+    int total = 0;
+    for (int b = 0; b < blocks; b++) {
+        total += dedup.block_counts[b];
+    }
+    DuplicatePair* pairs = (DuplicatePair*)malloc((total + 1) * sizeof(DuplicatePair));
+    if (pairs == NULL) {
+        fprintf(stderr, "Memory allocation failed for duplicate pairs\n");
+        exit(EXIT_FAILURE);
+    }
+    total = 0;
+    for (int b = 0; b < blocks; b++) {
+        if (dedup.block_counts[b] > 0) {
+            memcpy(pairs + total, dedup.block_pairs[b], dedup.block_counts[b] * sizeof(DuplicatePair));
+        }
+        total += dedup.block_counts[b];
+        free(dedup.block_pairs[b]);
+    }
+    
+    free(dedup.block_pairs);
+    free(dedup.block_counts);
+    free_inverted_index(dedup.index);
+    *pair_count = total;
+    return pairs;
+}
+
+// ==================== SERVER ====================
+
+#ifndef _WIN32
+static volatile sig_atomic_t g_server_stop = 0;
+
+static void request_server_stop(int signal_number) {
+    (void)signal_number;
+    g_server_stop = 1;
+}
+
+// Requests of one batch and their targets
+typedef struct {
+    CheckServer* server;
+    ServerRequest** requests;
+    DocumentReader** targets;
+    double* target_norms;
+    bool* candidates;         // Request b, reference i: candidates[b * references + i]
+    int request_count;
+} ServerBatch;
+
+// Read and fingerprint one target, then pick its LSH candidates or score it
+// through the inverted index (thread pool task)
+static void server_ingest_task(void* context, int b) {
+    ServerBatch* batch = (ServerBatch*)context;
+    CheckServer* server = batch->server;
+    PlagiarismChecker* checker = server->checker;
+    ServerRequest* request = batch->requests[b];
+    int reference_count = checker->reference_count;
+    
+    DocumentReader* target = create_document_reader();
+    set_stopwords(target, server->stopwords);
+    use_private_tokens(target);  // The server runs indefinitely; targets must not grow the dictionary
+    batch->targets[b] = target;
+    IngestContext ingest = {checker, NULL, NULL, server->k_value, server->stream};
+    ingest_document(&ingest, target, request->target_file);
+    if (target->filename == NULL) {
+        request->failed = true;
+        return;
+    }
+    batch->target_norms[b] = target_tfidf_norm(checker, target);
+    
+    bool* candidates = &batch->candidates[(size_t)b * reference_count];
+    if (checker->use_lsh) {
+        int* found = (int*)malloc((reference_count + 1) * sizeof(int));
+        if (found == NULL) {
+            fprintf(stderr, "Memory allocation failed for LSH query\n");
+            exit(EXIT_FAILURE);
+        }
+        int found_count = lsh_index_query(checker->lsh_index, target->minhash, reference_count, found);
+        for (int c = 0; c < found_count; c++) {
+            candidates[found[c]] = true;
+        }
+        free(found);
+    } else {
+        memset(candidates, 1, reference_count * sizeof(bool));
+    }
+    
+    if (checker->inverted_index != NULL) {
+        // One pass over the target scores every reference
+        SetStats* stats = (SetStats*)malloc((reference_count + 1) * sizeof(SetStats));
+        if (stats == NULL) {
+            fprintf(stderr, "Memory allocation failed for request\n");
+            exit(EXIT_FAILURE);
+        }
+        inverted_index_score(checker->inverted_index, engine_fingerprint_set(checker, target), reference_count,
+                             checker->use_tfidf ? checker->idf : NULL, stats);
+        for (int i = 0; i < reference_count; i++) {
+            if (!candidates[i]) continue;
+            float cosine_sim = checker->use_tfidf ?
+                tfidf_cosine(&stats[i], batch->target_norms[b], checker->tfidf_norms[i]) :
+                cosine_from_stats(&stats[i]);
+            request->scores[i] = (jaccard_from_stats(&stats[i]) * 0.6) + (cosine_sim * 0.4);
+        }
+        metrics_add(METRIC_REFERENCES_SCORED, (uint64_t)reference_count);
+        free(stats);
+    }
+}
+
+// Score one (request, reference) pair of the batch (thread pool task)
+static void server_score_task(void* context, int task) {
+    ServerBatch* batch = (ServerBatch*)context;
+    PlagiarismChecker* checker = batch->server->checker;
+    int b = task / checker->reference_count;
+    int i = task % checker->reference_count;
+    ServerRequest* request = batch->requests[b];
+    if (request->failed || !batch->candidates[(size_t)b * checker->reference_count + i]) return;
+    request->scores[i] = score_reference(checker, batch->targets[b], batch->target_norms[b], i);
+}
+
+// Score a batch of requests: targets are read in parallel, then every
+// (request, reference) pair is a task for the pool
+static void score_request_batch(CheckServer* server, ServerRequest** requests, int request_count) {
+    PlagiarismChecker* checker = server->checker;
+    int reference_count = checker->reference_count;
+    ServerBatch batch;
+    batch.server = server;
+    batch.requests = requests;
+    batch.request_count = request_count;
+    batch.targets = (DocumentReader**)calloc(request_count, sizeof(DocumentReader*));
+    batch.target_norms = (double*)calloc(request_count, sizeof(double));
+    batch.candidates = (bool*)calloc((size_t)request_count * reference_count + 1, sizeof(bool));
+    if (batch.targets == NULL || batch.target_norms == NULL || batch.candidates == NULL) {
+        fprintf(stderr, "Memory allocation failed for request batch\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    thread_pool_parallel_for(checker->pool, request_count, server_ingest_task, &batch);
+    if (checker->inverted_index == NULL) {
+        thread_pool_parallel_for(checker->pool, request_count * reference_count, server_score_task, &batch);
+    }
+    
+    for (int b = 0; b < request_count; b++) {
+        float total = 0.0;
+        for (int i = 0; i < reference_count; i++) {
+            total += requests[b]->scores[i];
+        }
+        requests[b]->overall = reference_count > 0 ? total / reference_count : 0.0;
+        free_document_reader(batch.targets[b]);
+    }
+    free(batch.targets);
+    free(batch.target_norms);
+    free(batch.candidates);
+}
+
+// Take up to max_batch queued requests at a time and answer them. Requests
+// arriving while a batch is scored form the next batch.
+static void* server_dispatch_main(void* arg) {
+    CheckServer* server = (CheckServer*)arg;
+    ServerRequest** batch = (ServerRequest**)malloc(server->max_batch * sizeof(ServerRequest*));
+    if (batch == NULL) {
+        fprintf(stderr, "Memory allocation failed for request batch\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    pthread_mutex_lock(&server->lock);
+    for (;;) {
+        while (server->queue_head == NULL && !server->stopping) {
+            pthread_cond_wait(&server->request_ready, &server->lock);
+        }
+        if (server->queue_head == NULL) break;  // Stopping and drained
         
-        // Remove punctuation and numbers
-        remove_punctuation_numbers(token);
+        int count = 0;
+        while (server->queue_head != NULL && count < server->max_batch) {
+            batch[count++] = server->queue_head;
+            server->queue_head = server->queue_head->next;
+        }
+        if (server->queue_head == NULL) server->queue_tail = NULL;
+        pthread_mutex_unlock(&server->lock);
         
-        // Check if token is empty after processing
-        if (strlen(token) == 0) {
-            free(token);
-            continue;
+        score_request_batch(server, batch, count);
+        metrics_add(METRIC_REQUEST_BATCHES, 1);
+        metrics_add(METRIC_REQUESTS, (uint64_t)count);
+        for (int b = 0; b < count; b++) {
+            metrics_timer_stop(TIMER_REQUEST, batch[b]->received);
         }
         
-        // Remove stopwords
-        if (is_stopword(reader, token)) {
-            free(token);
+        pthread_mutex_lock(&server->lock);
+        for (int b = 0; b < count; b++) {
+            batch[b]->done = true;
+        }
+        server->requests += count;
+        server->batches++;
+        pthread_cond_broadcast(&server->request_done);
+    }
+    pthread_mutex_unlock(&server->lock);
+    free(batch);
+    return NULL;
+}
+
+// Queue one request and wait for the dispatcher to answer it. Returns false
+// when the server is stopping.
+static bool submit_request(CheckServer* server, ServerRequest* request) {
+    pthread_mutex_lock(&server->lock);
+    if (server->stopping) {
+        pthread_mutex_unlock(&server->lock);
+        return false;
+    }
+    request->next = NULL;
+    if (server->queue_tail != NULL) {
+        server->queue_tail->next = request;
+    } else {
+        server->queue_head = request;
+    }
+    server->queue_tail = request;
+    pthread_cond_signal(&server->request_ready);
+    while (!request->done) {
+        pthread_cond_wait(&server->request_done, &server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+    return true;
+}
+
+// Client socket handed to a connection thread
+typedef struct {
+    CheckServer* server;
+    int fd;
+} ServerConnection;
+
+// Forget a client socket that is about to be closed
+static void remove_server_connection(CheckServer* server, int fd) {
+    pthread_mutex_lock(&server->lock);
+    for (int c = 0; c < server->connection_count; c++) {
+        if (server->connections[c] == fd) {
+            server->connections[c] = server->connections[--server->connection_count];
+            break;
+        }
+    }
+    pthread_cond_signal(&server->connection_closed);
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Answer one client's requests, one per line:
+//   CHECK <path>  ->  OK <references> <overall>, then "<score> <reference>" per reference
+//   QUIT          ->  closes the connection
+// Errors are answered with a single ERROR line.
+static void* server_connection_main(void* arg) {
+    ServerConnection* connection = (ServerConnection*)arg;
+    CheckServer* server = connection->server;
+    PlagiarismChecker* checker = server->checker;
+    int fd = connection->fd;
+    free(connection);
+    
+    FILE* in = fdopen(fd, "r");
+    int out_fd = dup(fd);
+    FILE* out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    char line[MAX_REQUEST_LINE];
+    while (in != NULL && out != NULL && fgets(line, sizeof(line), in) != NULL) {
+        size_t length = strlen(line);
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        if (length == 0) continue;
+        if (strcmp(line, "QUIT") == 0) break;
+        if (strncmp(line, "CHECK ", 6) != 0 || line[6] == '\0') {
+            fprintf(out, "ERROR Unknown request\n");
+            if (fflush(out) != 0) break;
             continue;
         }
         
-        // Keep the token
-        reader->token_list.tokens[write_index] = token;
-        write_index++;
+        ServerRequest request = {0};
+        request.target_file = line + 6;
+        request.received = metrics_timer_start();
+        request.scores = (float*)calloc(checker->reference_count + 1, sizeof(float));
+        if (request.scores == NULL) {
+            fprintf(stderr, "Memory allocation failed for request\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!submit_request(server, &request)) {
+            fprintf(out, "ERROR Server is stopping\n");
+        } else if (request.failed) {
+            fprintf(out, "ERROR Could not read %s\n", request.target_file);
+        } else {
+            fprintf(out, "OK %d %.4f\n", checker->reference_count, request.overall);
+            for (int i = 0; i < checker->reference_count; i++) {
+                fprintf(out, "%.4f %s\n", request.scores[i], checker->reference_docs[i]->filename != NULL ?
+                        checker->reference_docs[i]->filename : "-");
+            }
+        }
+        free(request.scores);
+        if (fflush(out) != 0) break;
     }
     
-    // Update token count
-    reader->token_list.count = write_index;
-    printf("After preprocessing: %d tokens remaining\n", write_index);
+    // Deregister before closing so the stopping server never shuts down a reused descriptor
+    remove_server_connection(server, fd);
+    if (out != NULL) fclose(out);
+    else if (out_fd >= 0) close(out_fd);
+    if (in != NULL) fclose(in);
+    else close(fd);
+    return NULL;
 }
 
-// Convert string to lowercase
-void to_lowercase(char* str) {
-    for (int i = 0; str[i]; i++) {
-        str[i] = tolower(str[i]);
+// Register a client socket and start its connection thread
+static void start_server_connection(CheckServer* server, int fd) {
+    ServerConnection* connection = (ServerConnection*)malloc(sizeof(ServerConnection));
+    if (connection == NULL) {
+        fprintf(stderr, "Memory allocation failed for connection\n");
+        exit(EXIT_FAILURE);
+    }
+    connection->server = server;
+    connection->fd = fd;
+    
+    pthread_mutex_lock(&server->lock);
+    if (server->connection_count == server->connection_capacity) {
+        server->connection_capacity *= 2;
+        server->connections = (int*)realloc(server->connections, server->connection_capacity * sizeof(int));
+        if (server->connections == NULL) {
+            fprintf(stderr, "Memory allocation failed for connections\n");
+            exit(EXIT_FAILURE);
+        }
     }
+    server->connections[server->connection_count++] = fd;
+    pthread_mutex_unlock(&server->lock);
+    
+    pthread_t thread;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attributes, server_connection_main, connection) != 0) {
+        fprintf(stderr, "Warning: Could not start a connection thread\n");
+        remove_server_connection(server, fd);
+        close(fd);
+        free(connection);
+    }
+    pthread_attr_destroy(&attributes);
 }
 
-// Remove punctuation and numbers from string
-void remove_punctuation_numbers(char* str) {
-    int read_index = 0, write_index = 0;
+// Bind and listen on a Unix domain socket, replacing a stale socket file
+static int open_server_socket(const char* socket_path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
     
-    while (str[read_index]) {
-        if (isalpha(str[read_index]) || str[read_index] == '\'') {
-            str[write_index] = str[read_index];
-            write_index++;
-        }
-        read_index++;
+    struct stat info;
+    if (stat(socket_path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        unlink(socket_path);
     }
     
-    str[write_index] = '\0';
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Error: Could not listen on %s: %s\n", socket_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
 }
+#endif
 
-// Check if a word is a stopword (using array as simple hash set)
-bool is_stopword(DocumentReader* reader, const char* word) {
-    for (int i = 0; i < reader->stopwords_count; i++) {
-        if (strcmp(reader->stopwords[i], word) == 0) {
-            return true;
-        }
+// Answer check requests on a Unix domain socket with a prepared checker until
+// SIGINT or SIGTERM. Connection threads queue requests; a dispatcher scores
+// them in batches on the checker's thread pool, so the references are never
+// re-read and concurrent requests share one parallel pass.
+int serve_check_requests(PlagiarismChecker* checker, const StopwordSet* stopwords, const char* socket_path,
+                         int k_value, bool stream, int max_batch) {
+#ifdef _WIN32
+    (void)checker; (void)stopwords; (void)k_value; (void)stream; (void)max_batch;
+    fprintf(stderr, "Error: serve needs Unix domain sockets, which this platform lacks: %s\n", socket_path);
+    return EXIT_FAILURE;
+#else
+    int listen_fd = open_server_socket(socket_path);
+    if (listen_fd < 0) return EXIT_FAILURE;
+    
+    CheckServer server;
+    memset(&server, 0, sizeof(server));
+    server.checker = checker;
+    server.stopwords = stopwords;
+    server.k_value = k_value;
+    server.stream = stream;
+    server.max_batch = max_batch;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.request_ready, NULL);
+    pthread_cond_init(&server.request_done, NULL);
+    pthread_cond_init(&server.connection_closed, NULL);
+    server.connection_capacity = INITIAL_REFERENCE_CAPACITY;
+    server.connections = (int*)malloc(server.connection_capacity * sizeof(int));
+    if (server.connections == NULL) {
+        fprintf(stderr, "Memory allocation failed for connections\n");
+        exit(EXIT_FAILURE);
     }
-    return false;
+    
+    pthread_t dispatcher;
+    if (pthread_create(&dispatcher, NULL, server_dispatch_main, &server) != 0) {
+        fprintf(stderr, "Error: Could not start the request dispatcher\n");
+        close(listen_fd);
+        unlink(socket_path);
+        free(server.connections);
+        return EXIT_FAILURE;
+    }
+    
+    // Clients that disconnect early must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    g_server_stop = 0;
+    signal(SIGINT, request_server_stop);
+    signal(SIGTERM, request_server_stop);
+    printf("Listening on %s\n", socket_path);
+    fflush(stdout);
+    
+    while (!g_server_stop) {
+        struct pollfd listener = {listen_fd, POLLIN, 0};
+        if (poll(&listener, 1, SERVER_POLL_MS) <= 0) continue;
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd >= 0) start_server_connection(&server, fd);
+    }
+    
+    // Stop accepting, answer what is queued, then wake idle clients
+    close(listen_fd);
+    unlink(socket_path);
+    pthread_mutex_lock(&server.lock);
+    server.stopping = true;
+    pthread_cond_signal(&server.request_ready);
+    pthread_mutex_unlock(&server.lock);
+    pthread_join(dispatcher, NULL);
+    
+    pthread_mutex_lock(&server.lock);
+    for (int c = 0; c < server.connection_count; c++) {
+        shutdown(server.connections[c], SHUT_RDWR);
+    }
+    while (server.connection_count > 0) {
+        pthread_cond_wait(&server.connection_closed, &server.lock);
+    }
+    pthread_mutex_unlock(&server.lock);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    
+    printf("Answered %ld requests in %ld batches\n", server.requests, server.batches);
+    pthread_mutex_destroy(&server.lock);
+    pthread_cond_destroy(&server.request_ready);
+    pthread_cond_destroy(&server.request_done);
+    pthread_cond_destroy(&server.connection_closed);
+    free(server.connections);
+    return 0;
+#endif
 }
 
-// Tokenize text into words
-void tokenize_text(DocumentReader* reader, const char* text) {
-    // Free previous tokens if any
-    for (int i = 0; i < reader->token_list.count; i++) {
-        free(reader->token_list.tokens[i]);
+// ==================== MEMBER 3 FUNCTIONS (NEW) ====================
+
+// Create a new PlagiarismChecker instance
+PlagiarismChecker* create_plagiarism_checker() {
+    PlagiarismChecker* checker = (PlagiarismChecker*)malloc(sizeof(PlagiarismChecker));
+    if (checker == NULL) {
+        fprintf(stderr, "Memory allocation failed for PlagiarismChecker\n");
+        exit(EXIT_FAILURE);
     }
-    free(reader->token_list.tokens);
     
-    // Allocate memory for tokens
-    reader->token_list.tokens = (char**)malloc(MAX_TOKENS * sizeof(char*));
-    if (reader->token_list.tokens == NULL) {
-        fprintf(stderr, "Memory allocation failed for tokens\n");
+    checker->engine = ENGINE_STRING_KGRAMS;
+    checker->k_value = 0;
+    checker->winnow_window = DEFAULT_WINNOW_WINDOW;
+    checker->use_lsh = false;
+    checker->lsh_index = NULL;
+    checker->use_inverted_index = false;
+    checker->inverted_index = NULL;
+    checker->find_matches = false;
+    checker->pool = NULL;
+    checker->target_doc = NULL;
+    checker->reference_count = 0;
+    checker->reference_capacity = INITIAL_REFERENCE_CAPACITY;
+    checker->overall_similarity = 0.0;
+    checker->print_comparisons = true;
+    checker->use_tfidf = false;
+    checker->idf = NULL;
+    checker->norms_documents = -1;
+    checker->target_norm = 0.0;
+    checker->compact_references = false;
+    
+    // Initialize similarity scores to 0
+    checker->reference_docs = (DocumentReader**)calloc(checker->reference_capacity, sizeof(DocumentReader*));
+    checker->similarity_scores = (float*)calloc(checker->reference_capacity, sizeof(float));
+    checker->matches = (MatchList*)calloc(checker->reference_capacity, sizeof(MatchList));
+    checker->tfidf_norms = (double*)calloc(checker->reference_capacity, sizeof(double));
+    if (checker->reference_docs == NULL || checker->similarity_scores == NULL || checker->matches == NULL ||
+        checker->tfidf_norms == NULL) {
+        fprintf(stderr, "Memory allocation failed for PlagiarismChecker\n");
         exit(EXIT_FAILURE);
     }
     
-    reader->token_list.count = 0;
+    return checker;
+}
+
+// Select the comparison engine used by compare_documents()
+void set_comparison_engine(PlagiarismChecker* checker, ComparisonEngine engine) {
+    if (checker == NULL) return;
+    checker->engine = engine;
+}
+
+// Set the winnowing window size used by ENGINE_WINNOWING
+void set_winnow_window(PlagiarismChecker* checker, int window) {
+    if (checker == NULL || window <= 0) return;
+    checker->winnow_window = window;
+}
+
+// Restrict exact scoring to LSH candidates
+void set_lsh_enabled(PlagiarismChecker* checker, bool enabled) {
+    if (checker == NULL) return;
+    checker->use_lsh = enabled;
+}
+
+// Score through an inverted index over the references (hash engines only)
+void set_inverted_index_enabled(PlagiarismChecker* checker, bool enabled) {
+    if (checker == NULL) return;
+    checker->use_inverted_index = enabled;
+}
+
+// Record the matched passages (with byte offsets) of every scored reference
+void set_match_localization(PlagiarismChecker* checker, bool enabled) {
+    if (checker == NULL) return;
+    checker->find_matches = enabled;
+}
+
+// Share a thread pool for building k-grams and scoring references
+void set_thread_pool(PlagiarismChecker* checker, ThreadPool* pool) {
+    if (checker == NULL) return;
+    checker->pool = pool;
+}
+
+// Weight cosine similarity by TF-IDF: k-gram counts times corpus-level
+// inverse document frequency (string, rolling and winnow engines)
+void set_tfidf_enabled(PlagiarismChecker* checker, bool enabled) {
+    if (checker == NULL) return;
+    checker->use_tfidf = enabled;
+}
+
+// Keep references as sorted, Elias-Fano packed fingerprints and drop their
+// tokens and hash tables (rolling and winnow engines)
+void set_compact_references(PlagiarismChecker* checker, bool enabled) {
+    if (checker == NULL) return;
+    checker->compact_references = enabled;
+}
+
+// Print the details of each comparison (benchmarks turn this off)
+void set_comparison_output(PlagiarismChecker* checker, bool enabled) {
+    if (checker == NULL) return;
+    checker->print_comparisons = enabled;
+}
+
+// Make sure a document has the k-gram representation the checker's engine needs
+void build_document_kgrams(PlagiarismChecker* checker, DocumentReader* reader, int k) {
+    // Compact references were fingerprinted once and cannot be rebuilt
+    if (reader->compact) return;
+    if (checker->engine == ENGINE_STRING_KGRAMS || checker->engine == ENGINE_SUFFIX_ARRAY) {
+        if (checker->engine == ENGINE_STRING_KGRAMS &&
+            (reader->kgram_hash == NULL || reader->kgram_list.k_value != k)) {
+            generate_kgrams(reader, k);
+        }
+        // Fingerprints are still needed to seed LSH or match localization
+        if (!checker->use_lsh && !(checker->find_matches && !reader->streamed)) return;
+    }
     
-    // Copy the text for tokenization (strtok modifies the original)
-    char* text_copy = strdup(text);
-    if (text_copy == NULL) {
-        fprintf(stderr, "Memory allocation failed for text copy\n");
-        return;
+    // Fingerprints back every hash engine and the MinHash signature
+    if (reader->streamed) {
+        // Streamed readers keep no tokens; re-stream the file for a new k,
+        // or to get the fingerprints in order for winnowing
+        bool keep_order = checker->engine == ENGINE_WINNOWING;
+        if ((reader->kgram_hashes.k_value != k || (keep_order && reader->kgram_hashes.hashes == NULL)) &&
+            reader->filename != NULL) {
+            char* filename = strdup(reader->filename);
+            ingest_document_stream(reader, filename, k, keep_order);
+            free(filename);
+        }
+    } else if (reader->fingerprint_set == NULL || reader->kgram_hashes.k_value != k) {
+        generate_kgram_fingerprints(reader, k);
+    }
+    
+    if (checker->engine == ENGINE_WINNOWING && reader->fingerprint_set != NULL &&
+        reader->winnow.window != checker->winnow_window) {
+        winnow_fingerprints(reader, checker->winnow_window);
     }
     
-    // Tokenize using whitespace as delimiter
-    char* token = strtok(text_copy, " \t\n\r");
-    while (token != NULL && reader->token_list.count < MAX_TOKENS) {
-        reader->token_list.tokens[reader->token_list.count] = strdup(token);
-        reader->token_list.count++;
-        token = strtok(NULL, " \t\n\r");
+    if (checker->use_lsh && reader->minhash == NULL) {
+        compute_minhash_signature(reader);
     }
     
-    free(text_copy);
+    // Compact references are compared with the target's compressed copy
+    if (checker->compact_references && reader->compressed == NULL) {
+        reader->compressed = compress_fingerprints(engine_fingerprint_set(checker, reader));
+    }
 }
 
-// Print all tokens (for testing purposes)
-void print_tokens(DocumentReader* reader) {
-    for (int i = 0; i < reader->token_list.count; i++) {
-        printf("%s ", reader->token_list.tokens[i]);
-        if ((i + 1) % 10 == 0) printf("\n");
+// Fingerprint set compared by the checker's engine (NULL for string k-grams)
+FingerprintTable* engine_fingerprint_set(PlagiarismChecker* checker, DocumentReader* reader) {
+    if (checker->engine == ENGINE_WINNOWING) {
+        return reader->winnow_set;
+    }
+    if (checker->engine == ENGINE_ROLLING_HASH) {
+        return reader->fingerprint_set;
+    }
+    return NULL;
+}
+
+// Parse an engine name from the command line
+bool parse_comparison_engine(const char* name, ComparisonEngine* engine) {
+    if (strcmp(name, "strings") == 0) {
+        *engine = ENGINE_STRING_KGRAMS;
+    } else if (strcmp(name, "rolling") == 0) {
+        *engine = ENGINE_ROLLING_HASH;
+    } else if (strcmp(name, "winnow") == 0) {
+        *engine = ENGINE_WINNOWING;
+    } else if (strcmp(name, "suffix") == 0) {
+        *engine = ENGINE_SUFFIX_ARRAY;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Add target document to checker
+void add_target_document(PlagiarismChecker* checker, DocumentReader* target) {
+    if (checker == NULL || target == NULL) return;
+    checker->target_doc = target;
+}
+
+// Add reference document to checker
+void add_reference_document(PlagiarismChecker* checker, DocumentReader* reference) {
+    if (checker == NULL || reference == NULL) return;
+    
+    // Grow the reference arrays when full
+    if (checker->reference_count == checker->reference_capacity) {
+        checker->reference_capacity *= 2;
+        checker->reference_docs = (DocumentReader**)realloc(checker->reference_docs,
+            checker->reference_capacity * sizeof(DocumentReader*));
+        checker->similarity_scores = (float*)realloc(checker->similarity_scores,
+            checker->reference_capacity * sizeof(float));
+        checker->matches = (MatchList*)realloc(checker->matches,
+            checker->reference_capacity * sizeof(MatchList));
+        checker->tfidf_norms = (double*)realloc(checker->tfidf_norms,
+            checker->reference_capacity * sizeof(double));
+        if (checker->reference_docs == NULL || checker->similarity_scores == NULL ||
+            checker->matches == NULL || checker->tfidf_norms == NULL) {
+            fprintf(stderr, "Memory allocation failed for reference documents\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    checker->reference_docs[checker->reference_count] = reference;
+    checker->similarity_scores[checker->reference_count] = 0.0;
+    memset(&checker->matches[checker->reference_count], 0, sizeof(MatchList));
+    checker->reference_count++;
+}
+
+// Intersection, union and count-weighted dot product of two hash tables.
+// Walks the smaller table's slots once and probes the larger one with the
+// stored hash, so no k-gram is rehashed.
+SetStats hash_table_set_stats(HashTable* set1, HashTable* set2) {
+    return hash_table_weighted_stats(set1, set2, NULL);
+}
+
+// hash_table_set_stats() plus the TF-IDF weighted dot product when idf is given
+SetStats hash_table_weighted_stats(HashTable* set1, HashTable* set2, const IdfTable* idf) {
+    SetStats stats = {0, 0, 0, 0, 0.0, 0.0};
+    if (set1 == NULL || set2 == NULL) return stats;
+    
+    stats.size1 = set1->count;
+    stats.size2 = set2->count;
+    
+    HashTable* small = set1->count <= set2->count ? set1 : set2;
+    HashTable* large = small == set1 ? set2 : set1;
+    
+    for (int i = 0; i < small->size; i++) {
+        HashEntry* entry = &small->entries[i];
+        if (entry->hash == 0) continue;
+        
+        HashEntry* other = hash_table_find(large, entry->kgram, entry->hash);
+        if (other != NULL) {
+            stats.intersection++;
+            stats.dot_product += (double)entry->count * other->count;
+            if (idf != NULL) {
+                double weight = idf_weight(idf, entry->hash);
+                stats.weighted_dot += (double)entry->count * other->count * weight * weight;
+            }
+        }
+    }
+    
+    // Union = |A| + |B| - |A∩B|
+    stats.union_count = stats.size1 + stats.size2 - stats.intersection;
+    return stats;
+}
+
+// hash_table_weighted_stats() for a top-K search; gives up like
+// fingerprint_stats_above() once the score cannot rise above *floor
+bool hash_table_stats_above(HashTable* set1, HashTable* set2, const IdfTable* idf, _Atomic float* floor,
+                            SetStats* stats) {
+    *stats = (SetStats){0, 0, 0, 0, 0.0, 0.0};
+    if (set1 == NULL || set2 == NULL) return true;
+    
+    stats->size1 = set1->count;
+    stats->size2 = set2->count;
+    
+    HashTable* small = set1->count <= set2->count ? set1 : set2;
+    HashTable* large = small == set1 ? set2 : set1;
+    
+    int visited = 0;
+    for (int i = 0; i < small->size; i++) {
+        HashEntry* entry = &small->entries[i];
+        if (entry->hash == 0) continue;
+        
+        HashEntry* other = hash_table_find(large, entry->kgram, entry->hash);
+        if (other != NULL) {
+            stats->intersection++;
+            stats->dot_product += (double)entry->count * other->count;
+            if (idf != NULL) {
+                double weight = idf_weight(idf, entry->hash);
+                stats->weighted_dot += (double)entry->count * other->count * weight * weight;
+            }
+        }
+        if (++visited % TOP_K_CHECK_INTERVAL == 0 &&
+            combined_score_bound(stats->size1, stats->size2, stats->intersection + small->count - visited,
+                                 idf != NULL) < atomic_load(floor)) {
+            return false;
+        }
+    }
+    
+    stats->union_count = stats->size1 + stats->size2 - stats->intersection;
+    return true;
+}
+
+// Highest combined score two sets of these sizes can reach when they share
+// at most `intersection` k-grams. Jaccard and the binary cosine both grow with
+// the intersection, and computing them with the same float operations as the
+// real score keeps the bound exact. The TF-IDF cosine has no such bound and
+// counts as 1.
+float combined_score_bound(int size1, int size2, int intersection, bool weighted_cosine) {
+    int smaller = size1 < size2 ? size1 : size2;
+    if (intersection > smaller) intersection = smaller;
+    SetStats stats = {size1, size2, intersection, size1 + size2 - intersection, 0.0, 0.0};
+    float cosine_sim = weighted_cosine ? 1.0 : cosine_from_stats(&stats);
+    return (jaccard_from_stats(&stats) * 0.6) + (cosine_sim * 0.4);
+}
+
+// Jaccard similarity from precomputed set statistics
+float jaccard_from_stats(const SetStats* stats) {
+    if (stats->size1 == 0 || stats->size2 == 0 || stats->union_count == 0) {
+        return 0.0;
+    }
+    return (float)stats->intersection / stats->union_count;
+}
+
+// Cosine similarity (binary vectors) from precomputed set statistics
+float cosine_from_stats(const SetStats* stats) {
+    if (stats->size1 == 0 || stats->size2 == 0) {
+        return 0.0;
+    }
+    
+    float magnitude1 = sqrt(stats->size1);
+    float magnitude2 = sqrt(stats->size2);
+    
+    return stats->intersection / (magnitude1 * magnitude2);
+}
+
+// Calculate Jaccard similarity between two hash tables
+float calculate_jaccard_similarity(HashTable* set1, HashTable* set2) {
+    SetStats stats = hash_table_sorted_stats(set1, set2);
+    return jaccard_from_stats(&stats);
+}
+
+// Calculate Cosine similarity between two hash tables
+float calculate_cosine_similarity(HashTable* set1, HashTable* set2) {
+    SetStats stats = hash_table_sorted_stats(set1, set2);
+    return cosine_from_stats(&stats);
+}
+
+// Count intersection of two hash tables
+int hash_table_intersection_count(HashTable* set1, HashTable* set2) {
+    return hash_table_sorted_stats(set1, set2).intersection;
+}
+
+// Count union of two hash tables
+int hash_table_union_count(HashTable* set1, HashTable* set2) {
+    return hash_table_sorted_stats(set1, set2).union_count;
+}
+
+// Shared state for building and scoring references in parallel
+typedef struct {
+    PlagiarismChecker* checker;
+    int k_value;
+    const int* to_score;   // Reference index of each task
+    SetStats* stats;       // Output, one entry per task
+    PassageStats* passages;  // Output of the suffix array engine, one entry per task
+} CompareContext;
+
+// Build missing k-grams for one reference (thread pool task)
+static void prepare_reference_task(void* context, int i) {
+    CompareContext* compare = (CompareContext*)context;
+    if (compare->checker->reference_docs[i] != NULL) {
+        build_document_kgrams(compare->checker, compare->checker->reference_docs[i], compare->k_value);
     }
-    printf("\n");
 }
 
-// Export tokens to file for other team members
-void export_tokens(DocumentReader* reader, const char* filename) {
-    FILE* file = fopen(filename, "w");
-    if (file == NULL) {
-        fprintf(stderr, "Error: Could not create file %s\n", filename);
-        return;
-    }
-    
-    for (int i = 0; i < reader->token_list.count; i++) {
-        fprintf(file, "%s\n", reader->token_list.tokens[i]);
+// Locate the passages shared by the target and one scored reference (thread pool task)
+static void locate_matches_task(void* context, int c) {
+    CompareContext* compare = (CompareContext*)context;
+    PlagiarismChecker* checker = compare->checker;
+    int i = compare->to_score[c];
+    if (checker->reference_docs[i] != NULL) {
+        locate_matches(checker->target_doc, checker->reference_docs[i], compare->k_value,
+                       &checker->matches[i]);
     }
-    
-    fclose(file);
-    printf("Tokens exported to %s\n", filename);
 }
 
-// ==================== MEMBER 2 FUNCTIONS (EXISTING) ====================
+// Overlap statistics of a target and a reference on the checker's fingerprint
+// engine; compact references are merged with the target's compressed copy
+static SetStats engine_set_stats(PlagiarismChecker* checker, DocumentReader* target,
+                                 DocumentReader* reference, const IdfTable* idf) {
+    if (reference->compact) {
+        return compressed_weighted_stats(target->compressed, reference->compressed, idf);
+    }
+    return fingerprint_weighted_stats(engine_fingerprint_set(checker, target),
+                                      engine_fingerprint_set(checker, reference), idf);
+}
 
-// Generate k-grams using sliding window technique
-void generate_kgrams(DocumentReader* reader, int k) {
-    if (k <= 0 || k > reader->token_list.count) {
-        fprintf(stderr, "Error: Invalid k value %d for token count %d\n", 
-                k, reader->token_list.count);
-        return;
+// Distinct fingerprints of a document on the checker's fingerprint engine
+static int engine_set_size(PlagiarismChecker* checker, DocumentReader* reader) {
+    if (reader->compact) {
+        return reader->compressed->count;
     }
-    
-    // Free previous k-grams if any
-    for (int i = 0; i < reader->kgram_list.count; i++) {
-        free(reader->kgram_list.kgrams[i]);
+    FingerprintTable* set = engine_fingerprint_set(checker, reader);
+    return set != NULL ? set->count : 0;
+}
+
+// Fingerprint set of a document for updating the indexes. A compact document
+// decodes its compressed copy into *expanded, which the caller frees.
+static FingerprintTable* document_fingerprint_set(PlagiarismChecker* checker, DocumentReader* reader,
+                                                  FingerprintTable** expanded) {
+    *expanded = NULL;
+    if (reader == NULL) return NULL;
+    if (reader->compact) {
+        *expanded = expand_compressed_fingerprints(reader->compressed);
+        return *expanded;
     }
-    free(reader->kgram_list.kgrams);
+    return engine_fingerprint_set(checker, reader);
+}
+
+// Compute overlap statistics between the target and one reference (thread pool task)
+static void score_reference_task(void* context, int c) {
+    CompareContext* compare = (CompareContext*)context;
+    PlagiarismChecker* checker = compare->checker;
+    DocumentReader* reference = checker->reference_docs[compare->to_score[c]];
+    SetStats empty = {0, 0, 0, 0, 0.0, 0.0};
+    uint64_t timer = metrics_timer_start();
     
-    if (reader->kgram_hash != NULL) {
-        free_hash_table(reader->kgram_hash);
+    if (reference == NULL) {
+        compare->stats[c] = empty;
+    } else if (checker->engine == ENGINE_SUFFIX_ARRAY) {
+        compare->stats[c] = empty;
+        compare->passages[c] = suffix_array_passage_stats(checker->target_doc, reference,
+                                                          compare->k_value);
+    } else if (checker->engine != ENGINE_STRING_KGRAMS) {
+        compare->stats[c] = engine_set_stats(checker, checker->target_doc, reference,
+                                             checker->use_tfidf ? checker->idf : NULL);
+    } else if (checker->use_tfidf) {
+        compare->stats[c] = hash_table_weighted_stats(checker->target_doc->kgram_hash, reference->kgram_hash,
+                                                      checker->idf);
+    } else {
+        compare->stats[c] = hash_table_sorted_stats(checker->target_doc->kgram_hash, reference->kgram_hash);
     }
+    metrics_add(METRIC_REFERENCES_SCORED, 1);
+    metrics_timer_stop(TIMER_SCORE, timer);
+}
+
+// Bring the checker's LSH index up to date with its references
+static void update_lsh_index(PlagiarismChecker* checker) {
+    LshIndex* index = checker->lsh_index;
     
-    // Calculate number of k-grams
-    int num_kgrams = reader->token_list.count - k + 1;
-    if (num_kgrams <= 0) {
-        reader->kgram_list.count = 0;
-        return;
+    // Signatures are taken over the k-gram fingerprints; rebuild when k changed
+    if (index != NULL && index->k_value != checker->k_value) {
+        free_lsh_index(index);
+        index = NULL;
     }
-    
-    // Allocate memory for k-grams
-    reader->kgram_list.kgrams = (char**)malloc(num_kgrams * sizeof(char*));
-    if (reader->kgram_list.kgrams == NULL) {
-        fprintf(stderr, "Memory allocation failed for k-grams\n");
-        return;
+    if (index == NULL) {
+        index = create_lsh_index(checker->k_value);
+        checker->lsh_index = index;
     }
     
-    reader->kgram_list.count = 0;
-    reader->kgram_list.k_value = k;
-    
-    // Create hash table for efficient storage
-    reader->kgram_hash = create_hash_table(HASH_TABLE_SIZE);
-    
-    // Generate k-grams using sliding window
-    for (int i = 0; i <= reader->token_list.count - k; i++) {
-        // Calculate required length for k-gram string
-        int total_length = 0;
-        for (int j = 0; j < k; j++) {
-            total_length += strlen(reader->token_list.tokens[i + j]) + 1; // +1 for space
-        }
-        
-        // Allocate memory for k-gram
-        char* kgram = (char*)malloc(total_length);
-        if (kgram == NULL) {
-            fprintf(stderr, "Memory allocation failed for k-gram\n");
-            continue;
-        }
-        
-        // Build k-gram string
-        kgram[0] = '\0'; // Start with empty string
-        for (int j = 0; j < k; j++) {
-            strcat(kgram, reader->token_list.tokens[i + j]);
-            if (j < k - 1) {
-                strcat(kgram, " ");
-            }
+    // Index references added since the last comparison
+    for (int i = index->indexed_count; i < checker->reference_count; i++) {
+        if (checker->reference_docs[i] != NULL) {
+            lsh_index_add(index, checker->reference_docs[i]->minhash, i);
         }
-        
-        // Store k-gram in array
-        reader->kgram_list.kgrams[reader->kgram_list.count] = kgram;
-        reader->kgram_list.count++;
-        
-        // Store k-gram in hash table (manages duplicates)
-        hash_table_insert(reader->kgram_hash, kgram);
     }
-    
-    printf("Generated %d k-grams with k=%d\n", reader->kgram_list.count, k);
-    printf("Unique k-grams in hash table: %d\n", reader->kgram_hash->count);
+    index->indexed_count = checker->reference_count;
 }
 
-// Create a hash table
-HashTable* create_hash_table(int size) {
-    HashTable* ht = (HashTable*)malloc(sizeof(HashTable));
-    if (ht == NULL) return NULL;
+// Bring the checker's inverted index up to date with its references
+static void update_inverted_index(PlagiarismChecker* checker) {
+    InvertedIndex* index = checker->inverted_index;
     
-    ht->table = (HashNode**)calloc(size, sizeof(HashNode*));
-    if (ht->table == NULL) {
-        free(ht);
-        return NULL;
+    // Postings depend on k and the engine; rebuild when either changed
+    if (index != NULL && (index->k_value != checker->k_value || index->engine != (int)checker->engine ||
+                          (checker->engine == ENGINE_WINNOWING &&
+                           index->winnow_window != checker->winnow_window))) {
+        free_inverted_index(index);
+        index = NULL;
+    }
+    if (index == NULL) {
+        index = create_inverted_index(checker->k_value, checker->engine, checker->winnow_window);
+        checker->inverted_index = index;
     }
     
-    ht->size = size;
-    ht->count = 0;
-    return ht;
+    // Index references added since the last comparison
+    for (int i = index->indexed_count; i < checker->reference_count; i++) {
+        FingerprintTable* expanded;
+        inverted_index_add(index, document_fingerprint_set(checker, checker->reference_docs[i], &expanded), i);
+        free_fingerprint_table(expanded);
+    }
+    index->indexed_count = checker->reference_count;
 }
 
-// Hash function for strings (djb2 algorithm)
-unsigned int hash_function(const char* str, int table_size) {
-    unsigned long hash = 5381;
-    int c;
-    
-    while ((c = *str++)) {
-        hash = ((hash << 5) + hash) + c; // hash * 33 + c
+// Score the selected references through the checker's inverted index
+static void score_with_inverted_index(PlagiarismChecker* checker, const int* to_score,
+                                      int score_count, SetStats* stats) {
+    InvertedIndex* index = checker->inverted_index;
+    SetStats* all = (SetStats*)malloc((checker->reference_count + 1) * sizeof(SetStats));
+    if (all == NULL) {
+        fprintf(stderr, "Memory allocation failed for comparison\n");
+        exit(EXIT_FAILURE);
     }
-    
-    return hash % table_size;
+    inverted_index_score(index, engine_fingerprint_set(checker, checker->target_doc),
+                         checker->reference_count, checker->use_tfidf ? checker->idf : NULL, all);
+    for (int c = 0; c < score_count; c++) {
+        stats[c] = all[to_score[c]];
+    }
+    free(all);
 }
 
-// Insert a k-gram into hash table (handles duplicates)
-void hash_table_insert(HashTable* ht, const char* kgram) {
-    if (ht == NULL || kgram == NULL) return;
-    
-    unsigned int index = hash_function(kgram, ht->size);
-    
-    // Check if k-gram already exists
-    HashNode* current = ht->table[index];
-    while (current != NULL) {
-        if (strcmp(current->kgram, kgram) == 0) {
-            current->count++; // Increment count for duplicate
-            return;
-        }
-        current = current->next;
+// Length of a document's TF-IDF vector for the checker's engine
+static double document_tfidf_norm(PlagiarismChecker* checker, DocumentReader* reader) {
+    if (checker->engine == ENGINE_STRING_KGRAMS) {
+        return hash_table_tfidf_norm(reader->kgram_hash, checker->idf);
     }
-    
-    // Create new node for new k-gram
-    HashNode* newNode = (HashNode*)malloc(sizeof(HashNode));
-    if (newNode == NULL) return;
-    
-    newNode->kgram = strdup(kgram);
-    newNode->count = 1;
-    newNode->next = ht->table[index];
-    ht->table[index] = newNode;
-    ht->count++;
+    FingerprintTable* expanded;
+    double norm = fingerprint_tfidf_norm(document_fingerprint_set(checker, reader, &expanded), checker->idf);
+    free_fingerprint_table(expanded);
+    return norm;
 }
 
-// Check if hash table contains a k-gram
-bool hash_table_contains(HashTable* ht, const char* kgram) {
-    if (ht == NULL || kgram == NULL) return false;
-    
-    unsigned int index = hash_function(kgram, ht->size);
-    HashNode* current = ht->table[index];
-    
-    while (current != NULL) {
-        if (strcmp(current->kgram, kgram) == 0) {
-            return true;
-        }
-        current = current->next;
-    }
-    
-    return false;
+// Compute one reference's TF-IDF vector length (thread pool task)
+static void tfidf_norm_task(void* context, int i) {
+    CompareContext* compare = (CompareContext*)context;
+    PlagiarismChecker* checker = compare->checker;
+    checker->tfidf_norms[i] = checker->reference_docs[i] != NULL ?
+        document_tfidf_norm(checker, checker->reference_docs[i]) : 0.0;
 }
 
-// Print k-grams
-void print_kgrams(DocumentReader* reader) {
-    int max_to_show = 10; // Show first 10 k-grams to avoid clutter
-    for (int i = 0; i < reader->kgram_list.count && i < max_to_show; i++) {
-        printf("K-gram %d: %s\n", i + 1, reader->kgram_list.kgrams[i]);
+// Count references added since the last comparison into the document
+// frequencies. Lengths depend on every frequency, so they are recomputed only
+// when a reference was added.
+static void update_tfidf_weights(PlagiarismChecker* checker, CompareContext* compare) {
+    IdfTable* idf = checker->idf;
+    if (idf != NULL && (idf->k_value != checker->k_value || idf->engine != (int)checker->engine ||
+                        (checker->engine == ENGINE_WINNOWING &&
+                         idf->winnow_window != checker->winnow_window))) {
+        free_idf_table(idf);
+        idf = NULL;
     }
-    if (reader->kgram_list.count > max_to_show) {
-        printf("... and %d more k-grams\n", reader->kgram_list.count - max_to_show);
+    if (idf == NULL) {
+        idf = create_idf_table(checker->k_value, checker->engine, checker->winnow_window);
+        checker->idf = idf;
+        checker->norms_documents = -1;
     }
-}
-
-// Print hash table statistics
-void print_hash_table_stats(HashTable* ht) {
-    if (ht == NULL) return;
-    
-    int empty_buckets = 0;
-    int max_chain_length = 0;
     
-    for (int i = 0; i < ht->size; i++) {
-        int chain_length = 0;
-        HashNode* current = ht->table[i];
-        
-        while (current != NULL) {
-            chain_length++;
-            current = current->next;
-        }
-        
-        if (chain_length == 0) {
-            empty_buckets++;
-        }
-        if (chain_length > max_chain_length) {
-            max_chain_length = chain_length;
+    for (int i = idf->indexed_count; i < checker->reference_count; i++) {
+        DocumentReader* reference = checker->reference_docs[i];
+        if (reference == NULL) continue;
+        if (checker->engine == ENGINE_STRING_KGRAMS) {
+            idf_table_add_kgrams(idf, reference->kgram_hash);
+        } else {
+            FingerprintTable* expanded;
+            idf_table_add_fingerprints(idf, document_fingerprint_set(checker, reference, &expanded));
+            free_fingerprint_table(expanded);
         }
     }
+    idf->indexed_count = checker->reference_count;
     
-    printf("\nHash Table Statistics:\n");
-    printf("Total size: %d\n", ht->size);
-    printf("Unique k-grams: %d\n", ht->count);
-    printf("Load factor: %.2f\n", (float)ht->count / ht->size);
-    printf("Empty buckets: %d\n", empty_buckets);
-    printf("Max chain length: %d\n", max_chain_length);
+    if (checker->norms_documents != idf->documents) {
+        thread_pool_parallel_for(checker->pool, checker->reference_count, tfidf_norm_task, compare);
+        checker->norms_documents = idf->documents;
+    }
 }
 
-// Free hash table memory
-void free_hash_table(HashTable* ht) {
-    if (ht == NULL) return;
+// Build missing k-grams for every reference and bring the TF-IDF weights, the
+// LSH index and the inverted index up to date. Afterwards targets can be
+// scored with score_reference() without changing the checker.
+void prepare_references(PlagiarismChecker* checker, int k_value) {
+    if (checker == NULL) return;
+    checker->k_value = k_value;
     
-    for (int i = 0; i < ht->size; i++) {
-        HashNode* current = ht->table[i];
-        while (current != NULL) {
-            HashNode* temp = current;
-            current = current->next;
-            free(temp->kgram);
-            free(temp);
-        }
+    CompareContext compare = {checker, k_value, NULL, NULL, NULL};
+    bool parallel = thread_pool_size(checker->pool) > 1;
+    if (parallel) set_progress_output(false);
+    thread_pool_parallel_for(checker->pool, checker->reference_count, prepare_reference_task, &compare);
+    if (parallel) set_progress_output(true);
+    if (checker->use_tfidf && checker->engine != ENGINE_SUFFIX_ARRAY) {
+        update_tfidf_weights(checker, &compare);
     }
     
-    free(ht->table);
-    free(ht);
+    if (checker->use_lsh) {
+        update_lsh_index(checker);
+    }
+    if (checker->use_inverted_index &&
+        (checker->engine == ENGINE_ROLLING_HASH || checker->engine == ENGINE_WINNOWING)) {
+        update_inverted_index(checker);
+    }
 }
 
-// Export k-grams to file for Member 3
-void export_kgrams(DocumentReader* reader, const char* filename) {
-    FILE* file = fopen(filename, "w");
-    if (file == NULL) {
-        fprintf(stderr, "Error: Could not create file %s\n", filename);
-        return;
-    }
-    
-    fprintf(file, "K-value: %d\n", reader->kgram_list.k_value);
-    fprintf(file, "Total k-grams: %d\n", reader->kgram_list.count);
-    fprintf(file, "Unique k-grams: %d\n\n", reader->kgram_hash->count);
+// TF-IDF vector length of a target, for score_reference()
+double target_tfidf_norm(PlagiarismChecker* checker, DocumentReader* target) {
+    if (!checker->use_tfidf || checker->idf == NULL || checker->engine == ENGINE_SUFFIX_ARRAY) return 0.0;
+    return document_tfidf_norm(checker, target);
+}
+
+// Combined score (60% Jaccard + 40% cosine) of reference i from its overlap
+// statistics with a target
+static float combined_from_stats(PlagiarismChecker* checker, const SetStats* stats, double target_norm, int i) {
+    float jaccard_sim = jaccard_from_stats(stats);
+    float cosine_sim = checker->use_tfidf ? tfidf_cosine(stats, target_norm, checker->tfidf_norms[i]) :
+        cosine_from_stats(stats);
+    return (jaccard_sim * 0.6) + (cosine_sim * 0.4);
+}
+
+// Combined score of a target against reference i of a prepared checker. Only
+// reads the checker, so several targets can be scored at once.
+float score_reference(PlagiarismChecker* checker, DocumentReader* target, double target_norm, int i) {
+    DocumentReader* reference = checker->reference_docs[i];
+    if (reference == NULL) return 0.0;
     
-    // Export unique k-grams from hash table
-    for (int i = 0; i < reader->kgram_hash->size; i++) {
-        HashNode* current = reader->kgram_hash->table[i];
-        while (current != NULL) {
-            fprintf(file, "%s (count: %d)\n", current->kgram, current->count);
-            current = current->next;
+    float score;
+    uint64_t timer = metrics_timer_start();
+    if (checker->engine == ENGINE_SUFFIX_ARRAY) {
+        PassageStats passages = suffix_array_passage_stats(target, reference, checker->k_value);
+        score = passages.target_tokens > 0 ? (float)passages.covered / passages.target_tokens : 0.0;
+    } else {
+        const IdfTable* idf = checker->use_tfidf ? checker->idf : NULL;
+        SetStats stats;
+        if (checker->engine != ENGINE_STRING_KGRAMS) {
+            stats = engine_set_stats(checker, target, reference, idf);
+        } else if (idf != NULL) {
+            stats = hash_table_weighted_stats(target->kgram_hash, reference->kgram_hash, idf);
+        } else {
+            stats = hash_table_sorted_stats(target->kgram_hash, reference->kgram_hash);
         }
+        score = combined_from_stats(checker, &stats, target_norm, i);
     }
-    
-    fclose(file);
-    printf("K-grams exported to %s\n", filename);
+    metrics_add(METRIC_REFERENCES_SCORED, 1);
+    metrics_timer_stop(TIMER_SCORE, timer);
+    return score;
 }
 
-// ==================== MEMBER 3 FUNCTIONS (NEW) ====================
+// Shared state of a top-K search
+typedef struct {
+    PlagiarismChecker* checker;
+    DocumentReader* target;
+    double target_norm;
+    const RankedReference* order;  // References by decreasing size bound
+    RankedReference* heap;         // Best results so far, worst at the root
+    int heap_count;
+    int top;
+    _Atomic float floor;           // Score to beat once the heap is full
+    atomic_int scored;
+    pthread_mutex_t lock;
+} TopKContext;
 
-// Create a new PlagiarismChecker instance
-PlagiarismChecker* create_plagiarism_checker() {
-    PlagiarismChecker* checker = (PlagiarismChecker*)malloc(sizeof(PlagiarismChecker));
-    if (checker == NULL) {
-        fprintf(stderr, "Memory allocation failed for PlagiarismChecker\n");
-        exit(EXIT_FAILURE);
-    }
-    
-    checker->target_doc = NULL;
-    checker->reference_count = 0;
-    checker->overall_similarity = 0.0;
-    
-    // Initialize similarity scores to 0
-    for (int i = 0; i < MAX_REFERENCE_PAPERS; i++) {
-        checker->similarity_scores[i] = 0.0;
-        checker->reference_docs[i] = NULL;
-    }
-    
-    return checker;
+// Order of a top-K ranking: higher score first, then lower reference index
+static bool ranks_before(const RankedReference* a, const RankedReference* b) {
+    return a->score > b->score || (a->score == b->score && a->reference < b->reference);
 }
 
-// Add target document to checker
-void add_target_document(PlagiarismChecker* checker, DocumentReader* target) {
-    if (checker == NULL || target == NULL) return;
-    checker->target_doc = target;
+static int compare_ranked_references(const void* a, const void* b) {
+    const RankedReference* first = (const RankedReference*)a;
+    const RankedReference* second = (const RankedReference*)b;
+    if (ranks_before(first, second)) return -1;
+    return ranks_before(second, first) ? 1 : 0;
 }
 
-// Add reference document to checker
-void add_reference_document(PlagiarismChecker* checker, DocumentReader* reference) {
-    if (checker == NULL || reference == NULL) return;
-    if (checker->reference_count < MAX_REFERENCE_PAPERS) {
-        checker->reference_docs[checker->reference_count] = reference;
-        checker->reference_count++;
+// Restore the heap below position p (the worst result stays at the root)
+static void top_k_sift_down(RankedReference* heap, int count, int p) {
+    for (;;) {
+        int worst = p;
+        int left = 2 * p + 1, right = 2 * p + 2;
+        if (left < count && ranks_before(&heap[worst], &heap[left])) worst = left;
+        if (right < count && ranks_before(&heap[worst], &heap[right])) worst = right;
+        if (worst == p) return;
+        RankedReference swap = heap[p];
+        heap[p] = heap[worst];
+        heap[worst] = swap;
+        p = worst;
     }
 }
 
-// Calculate Jaccard similarity between two hash tables
-float calculate_jaccard_similarity(HashTable* set1, HashTable* set2) {
-    if (set1 == NULL || set2 == NULL || set1->count == 0 || set2->count == 0) {
-        return 0.0;
+// Offer a scored reference to the heap and raise the floor once it is full
+static void top_k_offer(TopKContext* search, RankedReference result) {
+    pthread_mutex_lock(&search->lock);
+    if (search->heap_count < search->top) {
+        int p = search->heap_count++;
+        search->heap[p] = result;
+        while (p > 0 && ranks_before(&search->heap[(p - 1) / 2], &search->heap[p])) {
+            RankedReference swap = search->heap[p];
+            search->heap[p] = search->heap[(p - 1) / 2];
+            search->heap[(p - 1) / 2] = swap;
+            p = (p - 1) / 2;
+        }
+    } else if (ranks_before(&result, &search->heap[0])) {
+        search->heap[0] = result;
+        top_k_sift_down(search->heap, search->heap_count, 0);
     }
-    
-    int intersection = hash_table_intersection_count(set1, set2);
-    int union_count = hash_table_union_count(set1, set2);
-    
-    if (union_count == 0) return 0.0;
-    
-    return (float)intersection / union_count;
+    if (search->heap_count == search->top) {
+        atomic_store(&search->floor, search->heap[0].score);
+    }
+    pthread_mutex_unlock(&search->lock);
 }
 
-// Calculate Cosine similarity between two hash tables
-float calculate_cosine_similarity(HashTable* set1, HashTable* set2) {
-    if (set1 == NULL || set2 == NULL || set1->count == 0 || set2->count == 0) {
-        return 0.0;
+// Score one reference unless its bound already rules it out (thread pool task)
+static void top_k_task(void* context, int c) {
+    TopKContext* search = (TopKContext*)context;
+    PlagiarismChecker* checker = search->checker;
+    int i = search->order[c].reference;
+    DocumentReader* reference = checker->reference_docs[i];
+    if (reference == NULL) return;
+    if (search->order[c].score < atomic_load(&search->floor)) {
+        metrics_add(METRIC_REFERENCES_PRUNED, 1);
+        return;
     }
     
-    int intersection = hash_table_intersection_count(set1, set2);
-    float magnitude1 = sqrt(set1->count);
-    float magnitude2 = sqrt(set2->count);
-    
-    if (magnitude1 == 0 || magnitude2 == 0) return 0.0;
-    
-    return intersection / (magnitude1 * magnitude2);
+    RankedReference result = {i, 0.0};
+    if (checker->engine == ENGINE_SUFFIX_ARRAY) {
+        result.score = score_reference(checker, search->target, search->target_norm, i);
+    } else {
+        const IdfTable* idf = checker->use_tfidf ? checker->idf : NULL;
+        SetStats stats;
+        uint64_t timer = metrics_timer_start();
+        bool complete = true;
+        if (checker->engine == ENGINE_STRING_KGRAMS) {
+            complete = hash_table_stats_above(search->target->kgram_hash, reference->kgram_hash, idf,
+                                              &search->floor, &stats);
+        } else if (reference->compact) {
+            complete = compressed_stats_above(search->target->compressed, reference->compressed, idf,
+                                              &search->floor, &stats);
+        } else {
+            complete = fingerprint_stats_above(engine_fingerprint_set(checker, search->target),
+                                               engine_fingerprint_set(checker, reference), idf,
+                                               &search->floor, &stats);
+        }
+        if (!complete) {
+            metrics_add(METRIC_REFERENCES_PRUNED, 1);
+            return;
+        }
+        result.score = combined_from_stats(checker, &stats, search->target_norm, i);
+        metrics_add(METRIC_REFERENCES_SCORED, 1);
+        metrics_timer_stop(TIMER_SCORE, timer);
+    }
+    atomic_fetch_add(&search->scored, 1);
+    top_k_offer(search, result);
 }
 
-// Count intersection of two hash tables
-int hash_table_intersection_count(HashTable* set1, HashTable* set2) {
-    if (set1 == NULL || set2 == NULL) return 0;
-    
-    int intersection = 0;
+// The `top` best references of a prepared checker for a target, best first.
+// References are visited in order of an upper bound taken from the set sizes
+// alone. Once `top` results are held, a reference whose bound is below the
+// worst of them is skipped, and a scan is abandoned as soon as the shared
+// k-grams it can still find no longer lift it above that score. The result
+// is the same as scoring every reference and sorting. `scored` receives the
+// number of references scored in full. Only reads the checker.
+int top_k_references(PlagiarismChecker* checker, DocumentReader* target, double target_norm, int top,
+                     RankedReference* results, int* scored) {
+    int reference_count = checker->reference_count;
+    if (top > reference_count) top = reference_count;
+    RankedReference* order = (RankedReference*)malloc((reference_count + 1) * sizeof(RankedReference));
+    if (order == NULL) {
+        fprintf(stderr, "Memory allocation failed for top-K search\n");
+        exit(EXIT_FAILURE);
+    }
     
-    // Iterate through all buckets in set1
-    for (int i = 0; i < set1->size; i++) {
-        HashNode* current = set1->table[i];
-        while (current != NULL) {
-            if (hash_table_contains(set2, current->kgram)) {
-                intersection++;
-            }
-            current = current->next;
+    // The suffix engine's coverage has no size bound; every reference is scored
+    bool bounded = checker->engine != ENGINE_SUFFIX_ARRAY;
+    for (int i = 0; i < reference_count; i++) {
+        DocumentReader* reference = checker->reference_docs[i];
+        order[i].reference = i;
+        order[i].score = 1.0;
+        if (!bounded || reference == NULL) continue;
+        int size1, size2;
+        if (checker->engine == ENGINE_STRING_KGRAMS) {
+            size1 = target->kgram_hash != NULL ? target->kgram_hash->count : 0;
+            size2 = reference->kgram_hash != NULL ? reference->kgram_hash->count : 0;
+        } else {
+            size1 = engine_set_size(checker, target);
+            size2 = engine_set_size(checker, reference);
         }
+        order[i].score = combined_score_bound(size1, size2, size1, checker->use_tfidf);
+    }
+    qsort(order, reference_count, sizeof(RankedReference), compare_ranked_references);
+    
+    TopKContext search;
+    search.checker = checker;
+    search.target = target;
+    search.target_norm = target_norm;
+    search.order = order;
+    search.heap = results;
+    search.heap_count = 0;
+    search.top = top;
+    atomic_init(&search.floor, -1.0f);
+    atomic_init(&search.scored, 0);
+    pthread_mutex_init(&search.lock, NULL);
+    if (top > 0) {
+        thread_pool_parallel_for(checker->pool, reference_count, top_k_task, &search);
     }
+    pthread_mutex_destroy(&search.lock);
+    free(order);
     
-    return intersection;
+    qsort(results, search.heap_count, sizeof(RankedReference), compare_ranked_references);
+    if (scored != NULL) *scored = atomic_load(&search.scored);
+    return search.heap_count;
 }
 
-// Count union of two hash tables
-int hash_table_union_count(HashTable* set1, HashTable* set2) {
-    if (set1 == NULL || set2 == NULL) return 0;
+// Rank the references against the checker's target and print the best `top`
+void print_top_references(PlagiarismChecker* checker, int k_value, int top) {
+    if (checker == NULL || checker->target_doc == NULL) {
+        printf("Error: No target document specified\n");
+        return;
+    }
+    if (checker->reference_count == 0) {
+        printf("Error: No reference documents specified\n");
+        return;
+    }
     
-    // Union = |A| + |B| - |A∩B|
-    int intersection = hash_table_intersection_count(set1, set2);
-    return set1->count + set2->count - intersection;
+    build_document_kgrams(checker, checker->target_doc, k_value);
+    prepare_references(checker, k_value);
+    checker->target_norm = target_tfidf_norm(checker, checker->target_doc);
+    
+    RankedReference* results = (RankedReference*)malloc((top + 1) * sizeof(RankedReference));
+    if (results == NULL) {
+        fprintf(stderr, "Memory allocation failed for top-K search\n");
+        exit(EXIT_FAILURE);
+    }
+    int scored = 0;
+    int count = top_k_references(checker, checker->target_doc, checker->target_norm, top, results, &scored);
+    
+    printf("\n=== TOP %d REFERENCES ===\n", top);
+    printf("Target Document: %s\n", checker->target_doc->filename ? checker->target_doc->filename : "None");
+    printf("K-value used: %d\n\n", k_value);
+    for (int r = 0; r < count; r++) {
+        DocumentReader* reference = checker->reference_docs[results[r].reference];
+        printf("%3d. %6.2f%%  %s\n", r + 1, results[r].score * 100,
+               reference->filename ? reference->filename : "Unknown");
+    }
+    printf("\nScored %d of %d references in full; the rest could not reach the top %d\n",
+           scored, checker->reference_count, count);
+    free(results);
 }
 
 // Compare target document with all reference documents
@@ -740,46 +9163,134 @@ void compare_documents(PlagiarismChecker* checker, int k_value) {
     }
     
     // Ensure k-grams are generated for target document
-    if (checker->target_doc->kgram_hash == NULL || 
-        checker->target_doc->kgram_list.k_value != k_value) {
-        generate_kgrams(checker->target_doc, k_value);
+    build_document_kgrams(checker, checker->target_doc, k_value);
+    checker->k_value = k_value;
+    
+    if (checker->print_comparisons) {
+        printf("Comparing documents using k=%d...\n", k_value);
+    }
+    
+    // Ensure k-grams and indexes are up to date for every reference document
+    prepare_references(checker, k_value);
+    checker->target_norm = target_tfidf_norm(checker, checker->target_doc);
+    CompareContext compare = {checker, k_value, NULL, NULL, NULL};
+    for (int i = 0; i < checker->reference_count; i++) {
+        checker->similarity_scores[i] = 0.0;
+        checker->matches[i].count = 0;
+        checker->matches[i].covered_tokens = 0;
+    }
+    
+    // Pick which references get scored exactly
+    int* to_score = (int*)malloc((checker->reference_count + 1) * sizeof(int));
+    if (to_score == NULL) {
+        fprintf(stderr, "Memory allocation failed for comparison\n");
+        exit(EXIT_FAILURE);
+    }
+    int score_count = 0;
+    
+    if (checker->use_lsh) {
+        score_count = lsh_index_query(checker->lsh_index, checker->target_doc->minhash,
+                                      checker->reference_count, to_score);
+        
+        // Score candidates in reference order
+        bool* is_candidate = (bool*)calloc(checker->reference_count + 1, sizeof(bool));
+        if (is_candidate == NULL) {
+            fprintf(stderr, "Memory allocation failed for comparison\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int c = 0; c < score_count; c++) {
+            is_candidate[to_score[c]] = true;
+        }
+        score_count = 0;
+        for (int i = 0; i < checker->reference_count; i++) {
+            if (is_candidate[i]) to_score[score_count++] = i;
+        }
+        free(is_candidate);
+        
+        if (checker->print_comparisons) {
+            printf("LSH candidates: %d of %d references\n\n", score_count, checker->reference_count);
+        }
+    } else {
+        for (int i = 0; i < checker->reference_count; i++) {
+            to_score[score_count++] = i;
+        }
+    }
+    
+    compare.to_score = to_score;
+    compare.stats = (SetStats*)malloc((score_count + 1) * sizeof(SetStats));
+    compare.passages = (PassageStats*)calloc(score_count + 1, sizeof(PassageStats));
+    if (compare.stats == NULL || compare.passages == NULL) {
+        fprintf(stderr, "Memory allocation failed for comparison\n");
+        exit(EXIT_FAILURE);
     }
     
-    printf("Comparing documents using k=%d...\n", k_value);
+    if (checker->use_inverted_index &&
+        (checker->engine == ENGINE_ROLLING_HASH || checker->engine == ENGINE_WINNOWING)) {
+        // One pass over the target's k-grams scores every reference at once
+        score_with_inverted_index(checker, to_score, score_count, compare.stats);
+    } else {
+        // Score the selected references concurrently; each task writes its own slot
+        thread_pool_parallel_for(checker->pool, score_count, score_reference_task, &compare);
+    }
+    if (checker->find_matches) {
+        thread_pool_parallel_for(checker->pool, score_count, locate_matches_task, &compare);
+    }
     
     float total_similarity = 0.0;
     
-    // Compare with each reference document
-    for (int i = 0; i < checker->reference_count; i++) {
-        if (checker->reference_docs[i] != NULL) {
-            // Ensure k-grams are generated for reference document
-            if (checker->reference_docs[i]->kgram_hash == NULL || 
-                checker->reference_docs[i]->kgram_list.k_value != k_value) {
-                generate_kgrams(checker->reference_docs[i], k_value);
-            }
-            
-            // Calculate Jaccard similarity
-            float jaccard_sim = calculate_jaccard_similarity(
-                checker->target_doc->kgram_hash, 
-                checker->reference_docs[i]->kgram_hash
-            );
+    // Report in reference order so results are deterministic
+    for (int c = 0; c < score_count; c++) {
+        int i = to_score[c];
+        if (checker->reference_docs[i] != NULL && checker->engine == ENGINE_SUFFIX_ARRAY) {
+            // Score is the share of the target covered by runs copied from this reference
+            const PassageStats* passages = &compare.passages[c];
+            checker->similarity_scores[i] = passages->target_tokens > 0 ?
+                (float)passages->covered / passages->target_tokens : 0.0;
+            total_similarity += checker->similarity_scores[i];
+            if (!checker->print_comparisons) continue;
             
-            // Calculate Cosine similarity
-            float cosine_sim = calculate_cosine_similarity(
-                checker->target_doc->kgram_hash,
-                checker->reference_docs[i]->kgram_hash
-            );
+            printf("Comparison with %s:\n", checker->reference_docs[i]->filename);
+            printf("  Longest Common Passage: %d tokens", passages->longest);
+            if (passages->longest > 0) {
+                printf(" (target token %d, reference token %d)",
+                       passages->longest_target, passages->longest_reference);
+            }
+            printf("\n  Target Coverage: %d of %d tokens\n", passages->covered, passages->target_tokens);
+            if (checker->find_matches) {
+                printf("  Matched Passages: %d (%d tokens)\n", checker->matches[i].count,
+                       checker->matches[i].covered_tokens);
+            }
+            printf("  Combined Similarity: %.2f%%\n\n", checker->similarity_scores[i] * 100);
+        } else if (checker->reference_docs[i] != NULL) {
+            // One pass over the smaller set feeds every metric
+            float jaccard_sim = jaccard_from_stats(&compare.stats[c]);
+            float cosine_sim = checker->use_tfidf ?
+                tfidf_cosine(&compare.stats[c], checker->target_norm, checker->tfidf_norms[i]) :
+                cosine_from_stats(&compare.stats[c]);
             
             // Use weighted average (60% Jaccard + 40% Cosine)
             checker->similarity_scores[i] = (jaccard_sim * 0.6) + (cosine_sim * 0.4);
             total_similarity += checker->similarity_scores[i];
+            if (!checker->print_comparisons) continue;
             
             printf("Comparison with %s:\n", checker->reference_docs[i]->filename);
             printf("  Jaccard Similarity: %.2f%%\n", jaccard_sim * 100);
-            printf("  Cosine Similarity: %.2f%%\n", cosine_sim * 100);
+            printf("  %s: %.2f%%\n", checker->use_tfidf ? "TF-IDF Cosine Similarity" : "Cosine Similarity",
+                   cosine_sim * 100);
+            if (checker->use_lsh) {
+                printf("  MinHash Estimate: %.2f%%\n", minhash_similarity(
+                    checker->target_doc->minhash, checker->reference_docs[i]->minhash) * 100);
+            }
+            if (checker->find_matches) {
+                printf("  Matched Passages: %d (%d tokens)\n", checker->matches[i].count,
+                       checker->matches[i].covered_tokens);
+            }
             printf("  Combined Similarity: %.2f%%\n\n", checker->similarity_scores[i] * 100);
         }
     }
+    free(compare.stats);
+    free(compare.passages);
+    free(to_score);
     
     // Calculate overall similarity (average of all comparisons)
     checker->overall_similarity = total_similarity / checker->reference_count;
@@ -793,8 +9304,7 @@ void print_comparison_results(PlagiarismChecker* checker) {
     printf("Target Document: %s\n", 
            checker->target_doc ? checker->target_doc->filename : "None");
     printf("Number of Reference Documents: %d\n", checker->reference_count);
-    printf("K-value used: %d\n\n", 
-           checker->target_doc ? checker->target_doc->kgram_list.k_value : 0);
+    printf("K-value used: %d\n\n", checker->k_value);
     
     printf("INDIVIDUAL COMPARISONS:\n");
     printf("-----------------------\n");
@@ -868,7 +9378,20 @@ void export_results(PlagiarismChecker* checker, const char* filename) {
     for (int i = 0; i < checker->reference_count; i++) {
         if (checker->reference_docs[i] != NULL) {
             fprintf(file, "Reference %d: %s\n", i + 1, checker->reference_docs[i]->filename);
-            fprintf(file, "Similarity Score: %.2f%%\n\n", checker->similarity_scores[i] * 100);
+            fprintf(file, "Similarity Score: %.2f%%\n", checker->similarity_scores[i] * 100);
+            if (checker->find_matches) {
+                // Byte ranges are [start, end) in the original target and reference files
+                const MatchList* matches = &checker->matches[i];
+                fprintf(file, "Matched Passages: %d (%d tokens)\n", matches->count, matches->covered_tokens);
+                for (int m = 0; m < matches->count; m++) {
+                    const MatchSpan* span = &matches->spans[m];
+                    fprintf(file, "  target bytes %lld-%lld <-> reference bytes %lld-%lld (%d tokens)\n",
+                            (long long)span->target_start, (long long)span->target_end,
+                            (long long)span->reference_start, (long long)span->reference_end,
+                            span->length);
+                }
+            }
+            fprintf(file, "\n");
         }
     }
     
@@ -881,6 +9404,16 @@ void export_results(PlagiarismChecker* checker, const char* filename) {
 // Free plagiarism checker memory
 void free_plagiarism_checker(PlagiarismChecker* checker) {
     if (checker == NULL) return;
+    free_lsh_index(checker->lsh_index);
+    free_inverted_index(checker->inverted_index);
+    free_idf_table(checker->idf);
+    for (int i = 0; i < checker->reference_count; i++) {
+        free_match_list(&checker->matches[i]);
+    }
+    free(checker->matches);
+    free(checker->reference_docs);
+    free(checker->similarity_scores);
+    free(checker->tfidf_norms);
     free(checker);
 }
 
@@ -894,26 +9427,28 @@ void free_document_reader(DocumentReader* reader) {
     }
     
     // Free tokens
-    for (int i = 0; i < reader->token_list.count; i++) {
-        free(reader->token_list.tokens[i]);
-    }
-    free(reader->token_list.tokens);
-    
-    // Free k-grams
-    for (int i = 0; i < reader->kgram_list.count; i++) {
-        free(reader->kgram_list.kgrams[i]);
-    }
-    free(reader->kgram_list.kgrams);
+    reset_token_list(reader);
     
-    // Free hash table
+    // Free k-grams and hash table (its copies live in the k-gram arena)
+    free(reader->kgram_list.ids);
     if (reader->kgram_hash != NULL) {
         free_hash_table(reader->kgram_hash);
     }
+    arena_release(&reader->kgram_arena);
     
-    // Free stopwords
-    for (int i = 0; i < reader->stopwords_count; i++) {
-        free(reader->stopwords[i]);
-    }
+    // Free k-gram fingerprints
+    free(reader->kgram_hashes.hashes);
+    free_fingerprint_table(reader->fingerprint_set);
+    
+    // Free winnowed fingerprints
+    free(reader->winnow.hashes);
+    free(reader->winnow.positions);
+    free_fingerprint_table(reader->winnow_set);
+    
+    // Free MinHash signature and compressed fingerprints
+    free(reader->minhash);
+    free_compressed_fingerprints(reader->compressed);
+    free_private_tokens(reader->private_tokens);
     
     // Free reader itself
     free(reader);